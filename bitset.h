@@ -5,14 +5,21 @@
 #ifndef __BITSET_H
 #define __BITSET_H
 
-#include <strings.h>
-
 #include <cstddef>
-#include <cstdlib>
+#include <cstdint>
 #include <vector>
 
 namespace co {
 
+// A set of small integers (like coroutine ids) that can find the lowest
+// one not in the set quickly however big it gets.
+//
+// The bits are held in a tree of 64 bit words.  The bottom level holds the
+// bits themselves.  Each bit in a higher level is set when the
+// corresponding word in the level below it is full.  Finding a free bit
+// looks at one word on each level, so it takes O(log64 n) time: 3 words for
+// a quarter of a million bits.  Every level is a power of 64 words long,
+// with the top level being a single word.
 class BitSet {
  public:
   // Allocate the first free bit.
@@ -25,71 +32,95 @@ class BitSet {
   void Set(uint32_t bit);
 
   // Is the bitset empty (all bits clear)?
-  bool IsEmpty() const;
+  bool IsEmpty() const { return count_ == 0; }
 
   // Is the given bit set?
   bool Contains(uint32_t bit) const;
 
  private:
-  // Note the use of explicit long long type here because
-  // we use ffsll to look for the set bits and that is
-  // explicit in its use of long long.
-  std::vector<long long> bits_;
+  static constexpr uint64_t kFull = ~uint64_t(0);
+
+  // Number of bits that can be held without adding a level.
+  size_t Capacity() const {
+    return levels_.empty() ? 0 : levels_[0].size() * 64;
+  }
+  void AddLevel();
+
+  // levels_[0] is the bits, levels_.back() is the single top word.
+  std::vector<std::vector<uint64_t>> levels_;
+  size_t count_ = 0;  // Number of bits set.
 };
 
 inline uint32_t BitSet::Allocate() {
-  uint32_t start = 0;
-  for (;;) {
-    for (uint32_t i = start; i < bits_.size(); i++) {
-      uint32_t bit = static_cast<uint32_t>(ffsll(~bits_[i]));
-      if (bit != 0) {
-        bits_[i] |= (1 << (bit - 1));
-        return i * 64 + (bit - 1);
-      }
-    }
-    // Expand bit set and allocate again.  There's no point in
-    // searching the whole bitset again because we know it won't
-    // have any zero bits in it, so start at the newly added
-    // word of zeroes.
-    start = bits_.size();
-    bits_.push_back(0);
+  if (levels_.empty() || levels_.back()[0] == kFull) {
+    AddLevel();
+  }
+  // Go down the tree following the first word that isn't full.
+  size_t index = 0;
+  for (size_t level = levels_.size(); level-- > 0;) {
+    uint64_t word = levels_[level][index];
+    index = index * 64 + static_cast<size_t>(__builtin_ctzll(~word));
   }
+  uint32_t bit = static_cast<uint32_t>(index);
+  Set(bit);
+  return bit;
 }
 
 inline void BitSet::Free(uint32_t bit) {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  if (!Contains(bit)) {
     return;
   }
-  uint32_t b = bit % 64;
-  bits_[word] &= ~(1 << b);
+  count_--;
+  // The word holding the bit is no longer full, nor is anything above it.
+  size_t index = bit;
+  for (auto &level : levels_) {
+    uint64_t &word = level[index / 64];
+    bool was_full = word == kFull;
+    word &= ~(uint64_t(1) << (index % 64));
+    if (!was_full) {
+      break;
+    }
+    index /= 64;
+  }
 }
 
 inline void BitSet::Set(uint32_t bit) {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  while (bit >= Capacity()) {
+    AddLevel();
+  }
+  if (Contains(bit)) {
     return;
   }
-  uint32_t b = bit % 64;
-  bits_[word] |= (1 << b);
-}
-
-inline bool BitSet::IsEmpty() const {
-  for (uint32_t i = 0; i < bits_.size(); i++) {
-    if (bits_[i] != 0) {
-      return false;
+  count_++;
+  // If this fills the word, mark it as full in the level above, and so on.
+  size_t index = bit;
+  for (auto &level : levels_) {
+    uint64_t &word = level[index / 64];
+    word |= uint64_t(1) << (index % 64);
+    if (word != kFull) {
+      break;
     }
+    index /= 64;
   }
-  return true;
 }
 
 inline bool BitSet::Contains(uint32_t bit) const {
-  uint32_t word = bit / 64;
-  if (word < 0 || word >= bits_.size()) {
+  if (bit >= Capacity()) {
     return false;
   }
-  uint32_t b = bit % 64;
-  return (bits_[word] & (1 << b)) != 0;
+  return (levels_[0][bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
 }
+
+// Make the tree 64 times bigger with a new top level.  The old levels each
+// get 64 times as many words.  The new words are all empty so the only
+// full word is the old top word, if it was full.
+inline void BitSet::AddLevel() {
+  bool top_full = !levels_.empty() && levels_.back()[0] == kFull;
+  for (auto &level : levels_) {
+    level.resize(level.size() * 64);
+  }
+  levels_.emplace_back(1, top_full ? 1 : 0);
+}
+
 }  // namespace co
 #endif  // __BITSET_H
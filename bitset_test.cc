@@ -0,0 +1,135 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Checks for BitSet, against a simpler set doing the same things.  Prints what
+// fails and exits with 1 if anything does.
+
+#include <stdio.h>
+
+#include <random>
+#include <set>
+
+#include "bitset.h"
+#include "check.h"
+
+using namespace co;
+
+// The clear bits below the highest set one held in an ordered set, so the
+// lowest clear bit is the first one.
+class ReferenceSet {
+ public:
+  void Insert(uint32_t bit) {
+    if (bit < end_) {
+      size_ += clear_.erase(bit);
+      return;
+    }
+    for (uint32_t i = end_; i < bit; i++) {
+      clear_.insert(i);
+    }
+    end_ = bit + 1;
+    size_++;
+  }
+  void Erase(uint32_t bit) {
+    if (Contains(bit)) {
+      clear_.insert(bit);
+      size_--;
+    }
+  }
+  bool Contains(uint32_t bit) const {
+    return bit < end_ && clear_.count(bit) == 0;
+  }
+  uint32_t LowestFree() const {
+    return clear_.empty() ? end_ : *clear_.begin();
+  }
+  size_t Size() const { return size_; }
+
+ private:
+  std::set<uint32_t> clear_;
+  uint32_t end_ = 0;  // Bits from here up are clear.
+  size_t size_ = 0;
+};
+
+// Fill up past each level boundary (64, 64^2 and 64^3 bits) in order.
+static void Sequential() {
+  constexpr uint32_t kBits = 64 * 64 * 64 + 100;
+  BitSet bits;
+  CHECK(bits.IsEmpty());
+  for (uint32_t i = 0; i < kBits; i++) {
+    if (bits.Allocate() != i) {
+      CHECK(false);
+      return;
+    }
+  }
+  CHECK(!bits.IsEmpty());
+  CHECK(bits.Contains(kBits - 1));
+  CHECK(!bits.Contains(kBits));
+  // Freeing a bit in a full word (and full words above it) makes it the
+  // next one allocated.
+  for (uint32_t bit : {0u, 63u, 64u, 4095u, 4096u, 262143u, 262144u}) {
+    bits.Free(bit);
+    CHECK(!bits.Contains(bit));
+    CHECK(bits.Allocate() == bit);
+  }
+  for (uint32_t i = 0; i < kBits; i++) {
+    bits.Free(i);
+  }
+  CHECK(bits.IsEmpty());
+  CHECK(bits.Allocate() == 0);
+}
+
+// Setting a bit far past the end grows the tree without filling anything.
+static void SetFarBit() {
+  BitSet bits;
+  bits.Set(300000);
+  CHECK(bits.Contains(300000));
+  CHECK(!bits.Contains(299999));
+  CHECK(bits.Allocate() == 0);
+  CHECK(bits.Allocate() == 1);
+  bits.Set(1);  // Already set.
+  bits.Free(7);  // Not set.
+  bits.Free(1000000);  // Past the end.
+  bits.Free(0);
+  bits.Free(1);
+  bits.Free(300000);
+  CHECK(bits.IsEmpty());
+}
+
+static void Random() {
+  std::mt19937 rng(12345);
+  BitSet bits;
+  ReferenceSet reference;
+  for (int i = 0; i < 100000; i++) {
+    uint32_t r = rng() % 100;
+    if (r < 45) {
+      uint32_t expected = reference.LowestFree();
+      uint32_t bit = bits.Allocate();
+      if (bit != expected) {
+        fprintf(stderr, "step %d: allocated %u, expected %u\n", i, bit,
+                expected);
+        CHECK(false);
+        return;
+      }
+      reference.Insert(bit);
+    } else if (r < 95) {
+      // Free one near the bottom, where the interesting things happen.
+      uint32_t bit = rng() % (2 * reference.Size() + 64);
+      bits.Free(bit);
+      reference.Erase(bit);
+    } else {
+      uint32_t bit = rng() % 10000;
+      bits.Set(bit);
+      reference.Insert(bit);
+    }
+    uint32_t probe = rng() % 10100;
+    CHECK(bits.Contains(probe) == reference.Contains(probe));
+    CHECK(bits.IsEmpty() == (reference.Size() == 0));
+  }
+}
+
+int main() {
+  Sequential();
+  SetFarBit();
+  Random();
+  return co::CheckResult("bitset_test");
+}
@@ -0,0 +1,74 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "buffer_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace co {
+
+BufferPool::~BufferPool() {
+  for (auto &list : free_) {
+    for (char *buffer : list) {
+      free(buffer);
+    }
+  }
+}
+
+size_t BufferPool::RoundSize(size_t size) {
+  size_t rounded = kMinSize;
+  while (rounded < size) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+size_t BufferPool::SizeClass(size_t size) {
+  size_t sc = 0;
+  while ((size_t(1) << sc) < size) {
+    sc++;
+  }
+  return sc;
+}
+
+char *BufferPool::Allocate(size_t size) {
+  size_t sc = SizeClass(size);
+  if (sc < free_.size() && !free_[sc].empty()) {
+    char *buffer = free_[sc].back();
+    free_[sc].pop_back();
+    return buffer;
+  }
+  char *buffer = static_cast<char *>(malloc(size));
+  if (buffer == nullptr) {
+    fprintf(stderr, "Failed to allocate I/O buffer of size %zd\n", size);
+    abort();
+  }
+  return buffer;
+}
+
+void BufferPool::Free(char *buffer, size_t size) {
+  if (buffer == nullptr) {
+    return;
+  }
+  size_t sc = SizeClass(size);
+  if (sc >= free_.size()) {
+    free_.resize(sc + 1);
+  }
+  if (free_[sc].size() >= max_cached_) {
+    free(buffer);
+    return;
+  }
+  free_[sc].push_back(buffer);
+}
+
+size_t BufferPool::NumCachedBuffers() const {
+  size_t n = 0;
+  for (auto &f : free_) {
+    n += f.size();
+  }
+  return n;
+}
+
+}  // namespace co
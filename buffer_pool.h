@@ -0,0 +1,53 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef buffer_pool_h
+#define buffer_pool_h
+
+#include <cstddef>
+#include <vector>
+
+namespace co {
+
+// A pool of I/O buffers.  Sizes are rounded up to a power of two (at least
+// kMinSize) and freed buffers are kept on a free list for their size so
+// that connections coming and going don't keep going back to malloc.  A
+// scheduler holds one of these for the buffered readers and writers used
+// by its coroutines.  Like the rest of a scheduler, it's not thread safe.
+class BufferPool {
+ public:
+  static constexpr size_t kMinSize = 4096;
+
+  BufferPool() = default;
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // The actual size of a buffer given for a requested size.
+  static size_t RoundSize(size_t size);
+
+  // Allocate a buffer of the given size, which must have been rounded by
+  // RoundSize.
+  char *Allocate(size_t size);
+
+  // Give a buffer (from Allocate with the same size) back to the pool.
+  void Free(char *buffer, size_t size);
+
+  // Maximum number of free buffers kept for each size.
+  void SetMaxCachedBuffers(size_t n) { max_cached_ = n; }
+
+  // Number of free buffers in the pool.
+  size_t NumCachedBuffers() const;
+
+ private:
+  static size_t SizeClass(size_t size);
+
+  // Free buffers, indexed by size class (log2 of the size).
+  std::vector<std::vector<char *>> free_;
+  size_t max_cached_ = 256;
+};
+
+}  // namespace co
+#endif  // buffer_pool_h
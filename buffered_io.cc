@@ -0,0 +1,259 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "buffered_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "coroutine.h"
+
+namespace co {
+
+static bool IsNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && (flags & O_NONBLOCK) != 0;
+}
+
+BufferedReader::BufferedReader(Coroutine *c, int fd, size_t initial_size,
+                               size_t max_size)
+    : co_(c),
+      fd_(fd),
+      nonblocking_(IsNonBlocking(fd)),
+      capacity_(BufferPool::RoundSize(initial_size)),
+      max_size_(std::max(max_size, capacity_)) {}
+
+BufferedReader::~BufferedReader() {
+  co_->Scheduler().Buffers().Free(buffer_, capacity_);
+}
+
+bool BufferedReader::Fill() {
+  if (buffer_ == nullptr) {
+    buffer_ = co_->Scheduler().Buffers().Allocate(capacity_);
+  }
+  if (size_ == capacity_ && !Grow(capacity_ * 2)) {
+    return false;
+  }
+  // Read into the free space, which might be in two pieces.
+  size_t tail = (head_ + size_) & (capacity_ - 1);
+  struct iovec iov[2];
+  int iovcnt = 1;
+  if (tail >= head_ && size_ != capacity_) {
+    iov[0] = {buffer_ + tail, capacity_ - tail};
+    if (head_ > 0) {
+      iov[1] = {buffer_, head_};
+      iovcnt = 2;
+    }
+  } else {
+    iov[0] = {buffer_ + tail, head_ - tail};
+  }
+  ssize_t n;
+  for (;;) {
+    if (nonblocking_) {
+      n = readv(fd_, iov, iovcnt);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        break;
+      }
+    }
+    // Nothing there yet.  Wait for it and read it, which with io_uring is
+    // one asynchronous read.
+    n = co_->Read(fd_, iov[0].iov_base, iov[0].iov_len, timeout_ns_);
+    if (n == -1 && errno == ETIMEDOUT) {
+      timed_out_ = true;
+    }
+    break;
+  }
+  if (n > 0) {
+    size_ += n;
+    return true;
+  }
+  if (n == 0) {
+    eof_ = true;
+  }
+  return false;
+}
+
+bool BufferedReader::Grow(size_t size) {
+  size = BufferPool::RoundSize(size);
+  if (size > max_size_) {
+    return false;
+  }
+  BufferPool &pool = co_->Scheduler().Buffers();
+  char *buffer = pool.Allocate(size);
+  if (buffer_ != nullptr) {
+    std::string_view data = Data();
+    memcpy(buffer, data.data(), data.size());
+    pool.Free(buffer_, capacity_);
+  }
+  buffer_ = buffer;
+  capacity_ = size;
+  head_ = 0;
+  return true;
+}
+
+void BufferedReader::Linearize() {
+  std::rotate(buffer_, buffer_ + head_, buffer_ + capacity_);
+  head_ = 0;
+}
+
+std::string_view BufferedReader::Data() {
+  if (size_ == 0) {
+    return {};
+  }
+  if (head_ + size_ > capacity_) {
+    // The data wraps round the end of the buffer.
+    Linearize();
+  }
+  return std::string_view(buffer_ + head_, size_);
+}
+
+void BufferedReader::Consume(size_t n) {
+  n = std::min(n, size_);
+  size_ -= n;
+  // When empty, start again at the beginning so that the data is less
+  // likely to wrap.
+  head_ = size_ == 0 ? 0 : (head_ + n) & (capacity_ - 1);
+}
+
+bool BufferedReader::ReadUntil(std::string_view delim, std::string_view &data) {
+  size_t searched = 0;
+  for (;;) {
+    std::string_view d = Data();
+    size_t pos = d.find(delim, searched);
+    if (pos != std::string_view::npos) {
+      data = d.substr(0, pos + delim.size());
+      return true;
+    }
+    // Only look at the new data next time, allowing for a delimiter that
+    // is split across reads.
+    if (d.size() >= delim.size()) {
+      searched = d.size() - delim.size() + 1;
+    }
+    if (!Fill()) {
+      return false;
+    }
+  }
+}
+
+bool BufferedReader::Read(void *dest, size_t length) {
+  char *p = static_cast<char *>(dest);
+  while (length > 0) {
+    if (size_ == 0 && !Fill()) {
+      return false;
+    }
+    std::string_view d = Data();
+    size_t n = std::min(length, d.size());
+    memcpy(p, d.data(), n);
+    Consume(n);
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool BufferedReader::Skip(size_t length) {
+  while (length > 0) {
+    if (size_ == 0 && !Fill()) {
+      return false;
+    }
+    size_t n = std::min(length, size_);
+    Consume(n);
+    length -= n;
+  }
+  return true;
+}
+
+BufferedWriter::BufferedWriter(Coroutine *c, int fd, size_t size)
+    : co_(c),
+      fd_(fd),
+      nonblocking_(IsNonBlocking(fd)),
+      capacity_(BufferPool::RoundSize(size)) {}
+
+BufferedWriter::~BufferedWriter() {
+  co_->Scheduler().Buffers().Free(buffer_, capacity_);
+}
+
+void BufferedWriter::WaitWritable() { co_->Wait(fd_, POLLOUT); }
+
+bool BufferedWriter::Write(const void *data, size_t length) {
+  if (size_ + length <= capacity_) {
+    if (buffer_ == nullptr) {
+      buffer_ = co_->Scheduler().Buffers().Allocate(capacity_);
+    }
+    memcpy(buffer_ + size_, data, length);
+    size_ += length;
+    return true;
+  }
+  // Doesn't fit.  Write what we have with the new data.
+  struct iovec iov = {const_cast<void *>(data), length};
+  return WriteV(&iov, 1);
+}
+
+bool BufferedWriter::Flush() { return WriteV(nullptr, 0); }
+
+bool BufferedWriter::WriteV(const struct iovec *iov, int iovcnt) {
+  // Put the buffered data in front of the caller's data.
+  constexpr int kMaxIov = 16;
+  struct iovec vec[kMaxIov];
+  int n = 0;
+  if (size_ > 0) {
+    vec[n++] = {buffer_, size_};
+  }
+  while (iovcnt > 0 && n < kMaxIov) {
+    vec[n++] = *iov++;
+    iovcnt--;
+  }
+  bool ok = WriteAll(vec, n);
+  size_ = 0;
+  // Anything that didn't fit goes directly.
+  return ok && WriteAll(iov, iovcnt);
+}
+
+// Write all the data in iov, waiting for the fd when it is full.
+bool BufferedWriter::WriteAll(const struct iovec *iov, int iovcnt) {
+  constexpr int kMaxIov = 16;
+  size_t offset = 0;  // Into iov[0].
+  while (iovcnt > 0) {
+    // Copy as many as we can, with the first one adjusted for what has
+    // been written already.
+    struct iovec vec[kMaxIov];
+    int n = std::min(iovcnt, kMaxIov);
+    std::copy(iov, iov + n, vec);
+    vec[0].iov_base = static_cast<char *>(vec[0].iov_base) + offset;
+    vec[0].iov_len -= offset;
+
+    if (!nonblocking_) {
+      WaitWritable();
+    }
+    ssize_t written = writev(fd_, vec, n);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        WaitWritable();
+        continue;
+      }
+      return false;
+    }
+    // Skip the iovecs that have been written.
+    size_t w = static_cast<size_t>(written) + offset;
+    while (iovcnt > 0 && w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    offset = w;
+  }
+  return true;
+}
+
+}  // namespace co
@@ -0,0 +1,143 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef buffered_io_h
+#define buffered_io_h
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "buffer_pool.h"
+
+namespace co {
+
+class Coroutine;
+
+// Buffered reading from an fd in a coroutine.  Reads are done in large
+// pieces (as much as is available and will fit) into a ring buffer that
+// grows as needed.  The buffer comes from the scheduler's BufferPool and
+// goes back there when the reader is destroyed.
+//
+// When there's nothing to read the coroutine waits for the fd, so other
+// coroutines run.  If the fd is non-blocking a read is tried first and the
+// wait is only done if there's nothing there, saving a trip through the
+// scheduler when data is already waiting.  The wait and the read after it
+// are done with Coroutine::Read, so with an io_uring poller they are one
+// asynchronous read.
+//
+// The string_views returned point into the buffer and are only valid until
+// the next call that reads into or consumes from the buffer.
+class BufferedReader {
+ public:
+  static constexpr size_t kDefaultMaxSize = 1024 * 1024;
+
+  BufferedReader(Coroutine *c, int fd,
+                 size_t initial_size = BufferPool::kMinSize,
+                 size_t max_size = kDefaultMaxSize);
+  ~BufferedReader();
+
+  BufferedReader(const BufferedReader &) = delete;
+  BufferedReader &operator=(const BufferedReader &) = delete;
+
+  // If non-zero, give up waiting for data after this many nanoseconds.
+  void SetTimeout(uint64_t timeout_ns) { timeout_ns_ = timeout_ns; }
+
+  // Read more data, waiting for it if necessary.  Returns false at EOF,
+  // on error, on timeout or if the buffer is full at its maximum size.
+  bool Fill();
+
+  // Number of bytes in the buffer.
+  size_t Size() const { return size_; }
+  bool IsEmpty() const { return size_ == 0; }
+
+  // All the data in the buffer, in one piece.
+  std::string_view Data();
+
+  // Remove n bytes from the start of the buffer.
+  void Consume(size_t n);
+
+  // Fill the buffer until it holds the delimiter.  Sets data to the start
+  // of the buffer up to and including the delimiter.  The data is left in
+  // the buffer; Consume it when done.  Returns false if the delimiter
+  // doesn't turn up.
+  bool ReadUntil(std::string_view delim, std::string_view &data);
+
+  // Read exactly length bytes into dest.
+  bool Read(void *dest, size_t length);
+
+  // Discard the next length bytes.
+  bool Skip(size_t length);
+
+  bool Eof() const { return eof_; }
+  bool TimedOut() const { return timed_out_; }
+
+  int Fd() const { return fd_; }
+
+ private:
+  bool Grow(size_t size);
+  void Linearize();
+
+  Coroutine *co_;
+  int fd_;
+  bool nonblocking_;
+  char *buffer_ = nullptr;  // Allocated when first needed.
+  size_t capacity_;         // Power of two.
+  size_t max_size_;
+  size_t head_ = 0;  // Start of data.
+  size_t size_ = 0;  // Bytes of data, which may wrap round.
+  uint64_t timeout_ns_ = 0;
+  bool eof_ = false;
+  bool timed_out_ = false;
+};
+
+// Buffered writing to an fd in a coroutine.  Small writes are collected in
+// a buffer from the scheduler's BufferPool.  When it fills up, or when it
+// is flushed, the buffer and any large pieces of data are written together
+// with writev.  The coroutine waits for the fd if it can't take any more.
+//
+// Data isn't written until Flush is called (or the buffer fills up).  The
+// destructor doesn't flush since that might wait.
+//
+// The fd should be non-blocking.  On a blocking fd a write of more than
+// the fd can take blocks the whole thread, not just the coroutine.
+class BufferedWriter {
+ public:
+  BufferedWriter(Coroutine *c, int fd, size_t size = BufferPool::kMinSize);
+  ~BufferedWriter();
+
+  BufferedWriter(const BufferedWriter &) = delete;
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+  // Add data to the buffer.  Returns false if writing to the fd fails.
+  bool Write(const void *data, size_t length);
+  bool Write(std::string_view data) { return Write(data.data(), data.size()); }
+
+  // Write the buffered data followed by the iovecs.
+  bool WriteV(const struct iovec *iov, int iovcnt);
+
+  // Write out the buffered data.
+  bool Flush();
+
+  // Number of bytes in the buffer.
+  size_t Size() const { return size_; }
+
+  int Fd() const { return fd_; }
+
+ private:
+  bool WriteAll(const struct iovec *iov, int iovcnt);
+  void WaitWritable();
+
+  Coroutine *co_;
+  int fd_;
+  bool nonblocking_;
+  char *buffer_ = nullptr;  // Allocated when first needed.
+  size_t capacity_;
+  size_t size_ = 0;
+};
+
+}  // namespace co
+#endif  // buffered_io_h
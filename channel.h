@@ -0,0 +1,186 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef channel_h
+#define channel_h
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace co {
+
+// A Channel carries values of type T to coroutines in one scheduler (the
+// receiving scheduler).  Values can be sent by coroutines in the same
+// scheduler or in other schedulers running in other threads (like the
+// ones in a SchedulerGroup).  Send and Receive suspend the calling
+// coroutine, never the thread.
+//
+// Between coroutines in the receiving scheduler values go through a ring
+// buffer with a fixed capacity.  A sender waits when it is full and a
+// receiver waits when it is empty.  No locks are needed as only one
+// coroutine can be running.
+//
+// Values sent from other schedulers go through a lock-free queue (many
+// producers and one consumer) and never wait.  The receiving scheduler is
+// woken by its interrupt fd, but only once for a burst of values: more
+// values sent before the receiving scheduler gets round to them don't
+// cause any more wakeups.
+//
+// T must be default constructible and movable.  The channel must outlive
+// any senders and receivers.
+template <typename T>
+class Channel : private RemoteWakeup {
+ public:
+  explicit Channel(CoroutineScheduler &receiver, size_t capacity = 64)
+      : receiver_(receiver), buffer_(capacity == 0 ? 1 : capacity) {
+    stub_.next = nullptr;
+    remote_head_ = &stub_;
+    remote_tail_ = &stub_;
+  }
+
+  ~Channel() {
+    T value;
+    while (PopRemote(value)) {
+    }
+    if (remote_tail_ != &stub_) {
+      delete remote_tail_;
+    }
+  }
+
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+
+  // Send a value from coroutine c.  If c is in the receiving scheduler and
+  // the buffer is full, this waits until there is room.
+  void Send(Coroutine *c, T value) {
+    if (&c->Scheduler() != &receiver_) {
+      SendRemote(std::move(value));
+      return;
+    }
+    while (count_ == buffer_.size()) {
+      WaitIn(senders_, c);
+    }
+    buffer_[(head_ + count_) % buffer_.size()] = std::move(value);
+    count_++;
+    WakeOne(receivers_);
+  }
+
+  // Receive a value, waiting until there is one.  The coroutine must be
+  // in the receiving scheduler.
+  T Receive(Coroutine *c) {
+    T value;
+    while (!TryReceive(value)) {
+      WaitIn(receivers_, c);
+    }
+    return value;
+  }
+
+  // Receive a value if there is one available without waiting.  Must be
+  // called in the receiving scheduler's thread.
+  bool TryReceive(T &value) {
+    if (count_ > 0) {
+      value = std::move(buffer_[head_]);
+      head_ = (head_ + 1) % buffer_.size();
+      count_--;
+      WakeOne(senders_);
+      return true;
+    }
+    return PopRemote(value);
+  }
+
+  // Number of values in the local buffer.  This doesn't include values
+  // sent from other schedulers that have not been received.
+  size_t Size() const { return count_; }
+
+ private:
+  struct Node {
+    std::atomic<Node *> next;
+    T value;
+  };
+
+  // Wait in a queue of waiters until woken.  Something other than the
+  // channel can wake the coroutine, leaving it in the queue.  It takes
+  // itself out so that it isn't queued twice when it waits again and a
+  // later WakeOne doesn't wake it when it's no longer waiting here.
+  static void WaitIn(std::deque<Coroutine *> &waiters, Coroutine *c) {
+    waiters.push_back(c);
+    c->Suspend();
+    auto it = std::find(waiters.begin(), waiters.end(), c);
+    if (it != waiters.end()) {
+      waiters.erase(it);
+    }
+  }
+
+  static void WakeOne(std::deque<Coroutine *> &waiters) {
+    if (!waiters.empty()) {
+      Coroutine *c = waiters.front();
+      waiters.pop_front();
+      c->Wake();
+    }
+  }
+
+  void SendRemote(T value) {
+    Node *node = new Node;
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->value = std::move(value);
+    Node *prev = remote_head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    // Only wake the receiving scheduler if it hasn't already been woken
+    // for an earlier value.
+    if (!notified_.exchange(true, std::memory_order_acq_rel)) {
+      receiver_.WakeFromAnotherThread(this);
+    }
+  }
+
+  // Called only by the receiving scheduler.
+  bool PopRemote(T &value) {
+    Node *tail = remote_tail_;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    value = std::move(next->value);
+    remote_tail_ = next;
+    if (tail != &stub_) {
+      delete tail;
+    }
+    return true;
+  }
+
+  // Called by the receiving scheduler when woken by a remote sender.
+  // There might be more than one value so all the waiting receivers are
+  // woken.  Any that don't get one will wait again.
+  void Run() override {
+    notified_.store(false, std::memory_order_release);
+    while (!receivers_.empty()) {
+      WakeOne(receivers_);
+    }
+  }
+
+  CoroutineScheduler &receiver_;
+
+  // Ring buffer for the receiving scheduler.
+  std::vector<T> buffer_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+  std::deque<Coroutine *> senders_;    // Waiting for room.
+  std::deque<Coroutine *> receivers_;  // Waiting for a value.
+
+  // Queue of values from other schedulers.  Producers push at the head and
+  // the receiving scheduler pops from the tail.  The last node popped is
+  // kept as the tail.
+  Node stub_;
+  std::atomic<Node *> remote_head_;
+  Node *remote_tail_;
+  std::atomic<bool> notified_{false};
+};
+
+}  // namespace co
+#endif  // channel_h
@@ -0,0 +1,43 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __CHECK_H
+#define __CHECK_H
+
+#include <stdio.h>
+
+// CHECK for the *_test binaries.  A failed CHECK prints the condition and
+// carries on, so one run reports everything that is wrong.  main() ends
+// with
+//
+//   return co::CheckResult("name_test");
+//
+// which exits with 1 if any check failed.
+
+namespace co {
+
+inline int check_failures = 0;
+
+// Prints how many checks failed, or that the named test passed.  Returns
+// the exit status for main().
+inline int CheckResult(const char *name) {
+  if (check_failures != 0) {
+    fprintf(stderr, "%d failures\n", check_failures);
+    return 1;
+  }
+  printf("%s passed\n", name);
+  return 0;
+}
+
+}  // namespace co
+
+#define CHECK(cond)                                               \
+  do {                                                            \
+    if (!(cond)) {                                                \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                             \
+      co::check_failures++;                                       \
+    }                                                             \
+  } while (0)
+#endif  // __CHECK_H
@@ -0,0 +1,321 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Microbenchmarks for the coroutine library, using Google Benchmark.  The
+// benchmark loops run inside coroutines, so what's measured is the cost of
+// the coroutine operations themselves, including the trips through the
+// scheduler.  Setting up (making pipes, spawning idle coroutines) happens
+// before the loop starts and isn't counted.
+//
+// Run with --benchmark_repetitions=N to see how repeatable the results are
+// and --benchmark_filter=<regex> to pick benchmarks.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "benchmark/benchmark.h"
+#include "coroutine.h"
+#include "sync.h"
+
+using namespace co;
+
+namespace {
+
+constexpr size_t kStackSize = 16 * 1024;
+
+// A pipe with non-blocking ends that are closed when done.
+struct Pipe {
+  Pipe() {
+    if (::pipe(fds) == -1) {
+      perror("pipe");
+      abort();
+    }
+    for (int fd : fds) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+  }
+  ~Pipe() {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  int ReadFd() const { return fds[0]; }
+  int WriteFd() const { return fds[1]; }
+
+  int fds[2];
+};
+
+// Two coroutines yield to each other.  Each iteration is one yield by each
+// of them, so four context switches.
+void BM_YieldPingPong(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  bool done = false;
+  Coroutine ping(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      c->Yield();
+    }
+    done = true;
+  });
+  Coroutine pong(scheduler, [&](Coroutine *c) {
+    while (!done) {
+      c->Yield();
+    }
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_YieldPingPong);
+
+// Spawn a coroutine and let it run and exit.
+void BM_SpawnExit(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  int exited = 0;
+  Coroutine driver(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      scheduler.Spawn([&exited](Coroutine *) { exited++; }, nullptr,
+                      kStackSize);
+      c->Yield();
+    }
+  });
+  scheduler.Run();
+  benchmark::DoNotOptimize(exited);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpawnExit);
+
+struct Large {
+  char data[1024];
+};
+
+// Call a generator and have it yield a value back.
+template <typename T>
+void BM_GeneratorCall(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  Generator<T> generator(scheduler, [](Generator<T> *g) {
+    T value;
+    memset(&value, 0, sizeof(value));
+    for (;;) {
+      g->YieldValue(value);
+    }
+  });
+  Coroutine caller(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      T value = c->Call(generator);
+      benchmark::DoNotOptimize(value);
+    }
+    // The generator never finishes.
+    scheduler.Stop();
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * sizeof(T));
+}
+BENCHMARK_TEMPLATE(BM_GeneratorCall, int);
+BENCHMARK_TEMPLATE(BM_GeneratorCall, Large);
+
+// The same as BM_GeneratorCall but getting the values with Next.
+template <typename T>
+void BM_GeneratorNext(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  Generator<T> generator(scheduler, [](Generator<T> *g) {
+    T value;
+    memset(&value, 0, sizeof(value));
+    for (;;) {
+      g->YieldValue(value);
+    }
+  });
+  Coroutine caller(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      std::optional<T> value = generator.Next();
+      benchmark::DoNotOptimize(value);
+    }
+    scheduler.Stop();
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * sizeof(T));
+}
+BENCHMARK_TEMPLATE(BM_GeneratorNext, int);
+BENCHMARK_TEMPLATE(BM_GeneratorNext, Large);
+
+// A byte goes round trip through two pipes between two coroutines, each
+// waiting for the other's write to wake it.
+void BM_PipeWakeup(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  Pipe to_echo;
+  Pipe from_echo;
+  bool done = false;
+  Coroutine echo(scheduler, [&](Coroutine *c) {
+    char ch;
+    for (;;) {
+      c->Wait(to_echo.ReadFd());
+      if (done) {
+        break;
+      }
+      (void)read(to_echo.ReadFd(), &ch, 1);
+      (void)write(from_echo.WriteFd(), &ch, 1);
+    }
+  });
+  Coroutine sender(scheduler, [&](Coroutine *c) {
+    char ch = 'x';
+    for (auto _ : state) {
+      (void)write(to_echo.WriteFd(), &ch, 1);
+      c->Wait(from_echo.ReadFd());
+      (void)read(from_echo.ReadFd(), &ch, 1);
+    }
+    done = true;
+    (void)write(to_echo.WriteFd(), &ch, 1);
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PipeWakeup);
+
+// The same round trip as BM_PipeWakeup but with semaphores, which wake
+// the other coroutine through the ready queue instead of the kernel.
+void BM_SemaphorePingPong(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  Semaphore to_echo;
+  Semaphore from_echo;
+  bool done = false;
+  Coroutine echo(scheduler, [&](Coroutine *c) {
+    for (;;) {
+      to_echo.Acquire(c);
+      if (done) {
+        break;
+      }
+      from_echo.Release();
+    }
+  });
+  Coroutine sender(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      to_echo.Release();
+      from_echo.Acquire(c);
+    }
+    done = true;
+    to_echo.Release();
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SemaphorePingPong);
+
+// BM_PipeWakeup with the reads done by Coroutine::Read, for a poller type.
+// With io_uring the wait and the read are one asynchronous operation.
+void BM_PipeRead(benchmark::State &state) {
+  PollerType type = static_cast<PollerType>(state.range(0));
+  CoroutineScheduler scheduler(type);
+  if (scheduler.GetPollerType() != type) {
+    state.SkipWithError("poller not available");
+    return;
+  }
+  Pipe to_echo;
+  Pipe from_echo;
+  bool done = false;
+  Coroutine echo(scheduler, [&](Coroutine *c) {
+    char ch;
+    while (c->Read(to_echo.ReadFd(), &ch, 1) == 1 && !done) {
+      (void)write(from_echo.WriteFd(), &ch, 1);
+    }
+  });
+  Coroutine sender(scheduler, [&](Coroutine *c) {
+    char ch = 'x';
+    for (auto _ : state) {
+      (void)write(to_echo.WriteFd(), &ch, 1);
+      (void)c->Read(from_echo.ReadFd(), &ch, 1);
+    }
+    done = true;
+    (void)write(to_echo.WriteFd(), &ch, 1);
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PipeRead)
+    ->ArgName("poller")
+    ->Arg(static_cast<int>(PollerType::kEpoll))
+    ->Arg(static_cast<int>(PollerType::kIoUring));
+
+// Wait for an fd that is already ready, with and without a timeout.  The
+// difference is the cost of adding and removing the timer.
+void BM_WaitReady(benchmark::State &state) {
+  uint64_t timeout_ns = static_cast<uint64_t>(state.range(0));
+  CoroutineScheduler scheduler;
+  Pipe pipe;
+  char ch = 'x';
+  (void)write(pipe.WriteFd(), &ch, 1);
+  Coroutine waiter(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      c->Wait(pipe.ReadFd(), POLLIN, timeout_ns);
+    }
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WaitReady)->ArgName("timeout_ns")->Arg(0)->Arg(1000000000);
+
+// Wait for an fd that never becomes ready, with a timeout that has always
+// expired by the time the scheduler looks.
+void BM_WaitTimeout(benchmark::State &state) {
+  CoroutineScheduler scheduler;
+  Pipe pipe;
+  Coroutine waiter(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      c->Wait(pipe.ReadFd(), POLLIN, 1);
+    }
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WaitTimeout);
+
+// Each coroutine's stack takes two memory mappings, and Linux limits the
+// number a process can have.
+bool EnoughMappings(int64_t coroutines) {
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  if (f == nullptr) {
+    return true;
+  }
+  long max = 0;
+  bool ok = fscanf(f, "%ld", &max) != 1 || max > 2 * coroutines + 1000;
+  fclose(f);
+  return ok;
+}
+
+// Yield ping-pong with many other coroutines asleep.  The sleepers wait
+// for timers that don't expire.
+void BM_IdleWaiters(benchmark::State &state) {
+  int64_t num_idle = state.range(0);
+  if (!EnoughMappings(num_idle)) {
+    state.SkipWithError("vm.max_map_count is too low");
+    return;
+  }
+  CoroutineScheduler scheduler;
+  for (int64_t i = 0; i < num_idle; i++) {
+    scheduler.Spawn([](Coroutine *c) { c->Sleep(3600); }, nullptr,
+                    kStackSize);
+  }
+  bool done = false;
+  // These run after all the sleepers have gone to sleep.
+  Coroutine ping(scheduler, [&](Coroutine *c) {
+    for (auto _ : state) {
+      c->Yield();
+    }
+    done = true;
+    scheduler.Stop();
+  });
+  Coroutine pong(scheduler, [&](Coroutine *c) {
+    while (!done) {
+      c->Yield();
+    }
+  });
+  scheduler.Run();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IdleWaiters)->Arg(1000)->Arg(10000)->Arg(100000);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -4,6 +4,7 @@
 
 #include "coroutine.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -19,12 +20,28 @@
 
 #elif defined(__linux__)
 #include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/timerfd.h>
 
 #else
 #error "Unknown operating system"
 #endif
 
+// When running with TSAN we tell it about our own context switches
+// so that it knows which stack is which.
+#if defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define CO_TSAN 1
+#endif
+#endif
+#if defined(__SANITIZE_THREAD__)
+#define CO_TSAN 1
+#endif
+
+#if CTX_MODE == CTX_ASM && defined(CO_TSAN)
+#include <sanitizer/tsan_interface.h>
+#endif
+
 namespace co {
 static int NewEventFd() {
   int event_fd;
@@ -58,6 +75,51 @@ static void TriggerEvent(int fd) {
 #endif
 }
 
+// A single timer fd is used to wake up a poll loop that embeds the
+// scheduler when the first coroutine timer expires.
+static int NewTimerFd() {
+#if defined(__APPLE__)
+  return kqueue();
+#elif defined(__linux__)
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+#error "Unknown operating system"
+#endif
+}
+
+// Set the timer fd to trigger at the given monotonic time.
+static void SetTimerFd(int fd, uint64_t deadline) {
+#if defined(__APPLE__)
+  // kqueue timers are relative.
+  uint64_t now = MonotonicNow();
+  struct kevent e;
+  EV_SET(&e, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_NSECONDS,
+         deadline > now ? deadline - now : 0, 0);
+  kevent(fd, &e, 1, nullptr, 0, nullptr);
+#elif defined(__linux__)
+  constexpr uint64_t kBillion = 1000000000;
+  struct itimerspec new_value = {};
+  new_value.it_value.tv_sec = deadline / kBillion;
+  new_value.it_value.tv_nsec = deadline % kBillion;
+  timerfd_settime(fd, TFD_TIMER_ABSTIME, &new_value, nullptr);
+#else
+#error "Unknown operating system"
+#endif
+}
+
+static void ClearTimerFd(int fd) {
+#if defined(__APPLE__)
+  struct kevent e;
+  struct timespec zero = {};
+  kevent(fd, nullptr, 0, &e, 1, &zero);
+#elif defined(__linux__)
+  uint64_t val;
+  (void)read(fd, &val, 8);
+#else
+#error "Unknown operating system"
+#endif
+}
+
 static void ClearEvent(int fd) {
 #if defined(__APPLE__)
   struct kevent e;
@@ -108,52 +170,199 @@ asm(
 #endif
 // clang-format on
 
-Coroutine::Coroutine(CoroutineScheduler &machine, CoroutineFunction functor,
-                     const char *name, bool autostart, size_t stack_size,
-                     void *user_data)
+#if CTX_MODE == CTX_ASM
+extern "C" {
+// Save the callee-saved registers on the current stack, store the stack
+// pointer in *from_sp and restore the registers saved on the to_sp stack.
+// This returns when something switches back to *from_sp.
+void __co_SwitchContext(void **from_sp, void *to_sp);
+
+// First code run on a new coroutine's stack.  The coroutine is in a
+// callee-saved register put there by MakeInitialContext.
+void __co_Trampoline();
+}
+
+#if defined(__APPLE__)
+#define FUNCTION_TYPE(name)
+#else
+#define FUNCTION_TYPE(name) ".type " SYM(name) ", %function\n"
+#endif
+
+// clang-format off
+#if defined(__x86_64__)
+// The floating point control words (MXCSR and x87 control word) are
+// callee-saved too.
+asm(
+  ".text\n"
+  ".globl " SYM(__co_SwitchContext) "\n"
+  FUNCTION_TYPE(__co_SwitchContext)
+  SYM(__co_SwitchContext) ":\n"
+  "pushq %rbp\n"
+  "pushq %rbx\n"
+  "pushq %r12\n"
+  "pushq %r13\n"
+  "pushq %r14\n"
+  "pushq %r15\n"
+  "subq $8, %rsp\n"
+  "stmxcsr (%rsp)\n"
+  "fnstcw 4(%rsp)\n"
+  "movq %rsp, (%rdi)\n"
+  "movq %rsi, %rsp\n"
+  "ldmxcsr (%rsp)\n"
+  "fldcw 4(%rsp)\n"
+  "addq $8, %rsp\n"
+  "popq %r15\n"
+  "popq %r14\n"
+  "popq %r13\n"
+  "popq %r12\n"
+  "popq %rbx\n"
+  "popq %rbp\n"
+  "ret\n"
+
+  ".globl " SYM(__co_Trampoline) "\n"
+  FUNCTION_TYPE(__co_Trampoline)
+  SYM(__co_Trampoline) ":\n"
+  "movq %r12, %rdi\n"
+  "call " SYM(__co_Invoke) "\n"
+  "ud2\n");
+
+#elif defined(__aarch64__)
+asm(
+  ".text\n"
+  ".globl " SYM(__co_SwitchContext) "\n"
+  FUNCTION_TYPE(__co_SwitchContext)
+  ".p2align 2\n"
+  SYM(__co_SwitchContext) ":\n"
+  "sub sp, sp, #160\n"
+  "stp x19, x20, [sp, #0]\n"
+  "stp x21, x22, [sp, #16]\n"
+  "stp x23, x24, [sp, #32]\n"
+  "stp x25, x26, [sp, #48]\n"
+  "stp x27, x28, [sp, #64]\n"
+  "stp x29, x30, [sp, #80]\n"
+  "stp d8, d9, [sp, #96]\n"
+  "stp d10, d11, [sp, #112]\n"
+  "stp d12, d13, [sp, #128]\n"
+  "stp d14, d15, [sp, #144]\n"
+  "mov x9, sp\n"
+  "str x9, [x0]\n"
+  "mov sp, x1\n"
+  "ldp x19, x20, [sp, #0]\n"
+  "ldp x21, x22, [sp, #16]\n"
+  "ldp x23, x24, [sp, #32]\n"
+  "ldp x25, x26, [sp, #48]\n"
+  "ldp x27, x28, [sp, #64]\n"
+  "ldp x29, x30, [sp, #80]\n"
+  "ldp d8, d9, [sp, #96]\n"
+  "ldp d10, d11, [sp, #112]\n"
+  "ldp d12, d13, [sp, #128]\n"
+  "ldp d14, d15, [sp, #144]\n"
+  "add sp, sp, #160\n"
+  "ret\n"
+
+  ".globl " SYM(__co_Trampoline) "\n"
+  FUNCTION_TYPE(__co_Trampoline)
+  ".p2align 2\n"
+  SYM(__co_Trampoline) ":\n"
+  "mov x0, x19\n"
+  "bl " SYM(__co_Invoke) "\n"
+  "brk #0\n");
+#else
+#error "Unsupported architecture"
+#endif
+// clang-format on
+
+// Build a stack frame at the top of the stack that looks like it was
+// saved by __co_SwitchContext so that the first switch to the coroutine
+// 'returns' into __co_Trampoline.  Returns the stack pointer to switch to.
+static void *MakeInitialContext(void *stack, size_t stack_size,
+                                Coroutine *c) {
+  // Stack pointer must be 16 byte aligned on both architectures.
+  uintptr_t top =
+      (reinterpret_cast<uintptr_t>(stack) + stack_size) & ~uintptr_t(15);
+#if defined(__x86_64__)
+  // The frame is the control words, r15, r14, r13, r12, rbx, rbp and the
+  // return address.  The return address takes the place of the one pushed
+  // by a call, so the trampoline starts with the stack as if it had been
+  // called.
+  void **sp = reinterpret_cast<void **>(top - 64);
+  memset(sp, 0, 64);
+  uint32_t *control = reinterpret_cast<uint32_t *>(sp);
+  control[0] = 0x1f80;  // Default MXCSR.
+  control[1] = 0x037f;  // Default x87 control word.
+  sp[4] = c;            // r12
+  sp[7] = reinterpret_cast<void *>(__co_Trampoline);
+#elif defined(__aarch64__)
+  // The frame is x19-x28, x29 (frame pointer), x30 (link register) and
+  // d8-d15.  A zero frame pointer marks the end of the stack.
+  void **sp = reinterpret_cast<void **>(top - 160);
+  memset(sp, 0, 160);
+  sp[0] = c;  // x19
+  sp[11] = reinterpret_cast<void *>(__co_Trampoline);
+#endif
+  return sp;
+}
+#endif
+
+Coroutine::Coroutine(CoroutineScheduler &machine, const char *name,
+                     size_t stack_size, void *user_data, Priority priority,
+                     const void *site, size_t body_size)
     : scheduler_(machine),
-      function_(std::move(functor)),
-      stack_size_(stack_size),
+      stack_size_(StackPool::RoundSize(stack_size)),
+      priority_(priority),
       user_data_(user_data) {
   id_ = scheduler_.AllocateId();
-  if (name == nullptr) {
-    char buf[256];
-    snprintf(buf, sizeof(buf), "co-%d", id_);
-    name_ = buf;
-  } else {
+  if (name != nullptr) {
     name_ = name;
   }
-
-  stack_ = malloc(stack_size);
-  if (stack_ == nullptr) {
-    fprintf(stderr, "Failed to allocate stack for coroutine with size %zd: %s",
-            stack_size, strerror(errno));
-    abort();
+  StackPool &stacks = scheduler_.stacks_;
+  if (stacks.MeasuresUsage()) {
+    stack_site_ = stacks.Site(name, site);
+    stack_size_ = stacks.SiteStackSize(stack_site_, stack_size_);
   }
+  // The function goes at the top of the stack (aligned down to 16 bytes)
+  // and the coroutine runs below it, so a small stack or a big function
+  // would leave no room.
+  stack_size_ = std::max(
+      stack_size_,
+      StackPool::RoundSize(body_size + 16 + kMinStackBelowBody));
+  stack_ = stacks.Allocate(stack_size_);
+}
+
+// Where to put a function of the given size at the top of the stack.
+void *Coroutine::BodyAddress(size_t size) const {
+  return reinterpret_cast<void *>(
+      (reinterpret_cast<uintptr_t>(stack_) + stack_size_ - size) &
+      ~uintptr_t(15));
+}
 
+void Coroutine::Init(bool autostart) {
+  // The coroutine's stack starts below the function.
+  size_t usable = static_cast<char *>(body_) - static_cast<char *>(stack_);
 #if CTX_MODE == CTX_UCONTEXT
   getcontext(&resume_);
   resume_.uc_stack.ss_sp = stack_;
-  resume_.uc_stack.ss_size = stack_size;
-  resume_.uc_link = &exit_;
+  resume_.uc_stack.ss_size = usable;
+  // The coroutine's function never returns through the context link.  It
+  // switches back to the scheduler in Exit().
+  resume_.uc_link = nullptr;
   void (*func)(void) = reinterpret_cast<void (*)(void)>(__co_Invoke);
   makecontext(&resume_, func, 1, this);
+#elif CTX_MODE == CTX_ASM
+  resume_ = MakeInitialContext(stack_, usable, this);
+#if defined(CO_TSAN)
+  tsan_fiber_ = __tsan_create_fiber(0);
+#endif
+#else
+  (void)usable;
 #endif
-
-  state_ = State::kCoNew;
-  event_fd_.fd = NewEventFd();
-  if (event_fd_.fd == -1) {
-    fprintf(stderr, "Failed to allocate event fd: %s\n", strerror(errno));
-    abort();
-  }
-  event_fd_.events = POLLIN;
 
   // Might as well take the hit for allocating the pollfd vector when the
   // coroutine is created rather than delay it until the first wait.  It's
-  // unlikely there will be more than 2 fds to wait for, plus possibly a
-  // timeout.  If that's untrue we will just expand the vector when the wait is
-  // done.
-  wait_fds_.reserve(3);
+  // unlikely there will be more than 2 fds to wait for.  If that's untrue we
+  // will just expand the vector when the wait is done.
+  wait_fds_.reserve(2);
+  timer_.co = this;
   scheduler_.AddCoroutine(this);
   if (autostart) {
     Start();
@@ -161,150 +370,319 @@ Coroutine::Coroutine(CoroutineScheduler &machine, CoroutineFunction functor,
 }
 
 Coroutine::~Coroutine() {
-  free(stack_);
-  CloseEventFd(event_fd_.fd);
+  // If it's destructed before it has exited, the scheduler forgets it:
+  // its wait is undone and it is taken out of the run queues.
+  scheduler_.Unlink(this);
+#if CTX_MODE == CTX_ASM && defined(CO_TSAN)
+  __tsan_destroy_fiber(tsan_fiber_);
+#endif
+  if (destroy_body_ != nullptr) {
+    destroy_body_(body_);
+  }
+  scheduler_.stacks_.Free(stack_, stack_size_, stack_site_);
 }
 
 void Coroutine::Exit() {
+  // We can't remove ourselves from the scheduler here because the
+  // completion callback might delete this coroutine, including the stack
+  // we are running on.  Instead we go back to the scheduler and let it
+  // clean up on its own stack.
+  scheduler_.current_ = nullptr;
+  StatsEndRun();
+  if (scheduler_.watchdog_ != nullptr) {
+    scheduler_.watchdog_->SwitchedOut();
+  }
+  SetState(State::kCoDead);
+  yielded_address_ = nullptr;
+  scheduler_.exited_ = this;
 #if CTX_MODE == CTX_SETJMP
-  __real_longjmp(exit_, 1);
+  __real_longjmp(scheduler_.YieldBuf(), 1);
+#elif CTX_MODE == CTX_UCONTEXT
+  setcontext(scheduler_.YieldCtx());
 #else
-  setcontext(&exit_);
+  // Nothing will switch back to this coroutine.
+  SwitchToScheduler();
 #endif
 }
 
 void Coroutine::Start() {
-  if (state_ == State::kCoNew) {
-    state_ = State::kCoReady;
+  if (GetState() == State::kCoNew) {
+    SetState(State::kCoReady);
+    scheduler_.MakeRunnable(this);
   }
 }
 
-static int MakeTimer(uint64_t ns) {
-#if defined(__APPLE__)
-  // On MacOS we use a kqueue.
-  int kq = kqueue();
-  struct kevent e;
-
-  EV_SET(&e, 1, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, ns, 0);
-  kevent(kq, &e, 1, NULL, 0, NULL);
-  return kq;
-#elif defined(__linux__)
-  // Linux uses a timerfd.
-  struct itimerspec new_value;
-  struct timespec now;
-  constexpr int kBillion = 1000000000;
-
-  clock_gettime(CLOCK_REALTIME, &now);
-  new_value.it_value.tv_sec = now.tv_sec + ns / kBillion;
-  new_value.it_value.tv_nsec = now.tv_nsec + ns % kBillion;
-  new_value.it_interval.tv_sec = 0;
-  new_value.it_interval.tv_nsec = 0;
-  int fd = timerfd_create(CLOCK_REALTIME, 0);
-  timerfd_settime(fd, TFD_TIMER_ABSTIME, &new_value, NULL);
-  return fd;
-#endif
+void Coroutine::RegisterWaitFds() {
+  for (auto &fd : wait_fds_) {
+    scheduler_.poller_->Add(fd.fd, fd.events, this);
+  }
 }
 
-int Coroutine::EndOfWait(int timer_fd) {
-  wait_fds_.clear();
-  if (timer_fd != -1) {
-    close(timer_fd);
+int Coroutine::EndOfWait() {
+  for (auto &fd : wait_fds_) {
+    scheduler_.poller_->Remove(fd.fd, fd.events, this);
   }
-  if (wait_result_ == timer_fd) {
-    return -1;
-  }
-  // A garbage value as the Resume() value will be returned as garbage.
+  wait_fds_.clear();
+  // Cancel the timer if the wait finished before it expired.
+  scheduler_.timers_.Remove(&timer_);
+  timer_.deadline = 0;
+  // The result is -1 if the timer expired.  A garbage value as the
+  // Resume() value will be returned as garbage.
   return wait_result_;
 }
 
-int Coroutine::AddTimeout(uint64_t timeout_ns) {
-  int timer_fd = -1;
+void Coroutine::AddTimeout(uint64_t timeout_ns) {
   if (timeout_ns > 0) {
-    timer_fd = MakeTimer(timeout_ns);
-    struct pollfd timerfd = {.fd = timer_fd, .events = POLLIN};
-    wait_fds_.push_back(timerfd);
+    StartTimer(timeout_ns);
   }
-  return timer_fd;
+}
+
+// The timer is held by the scheduler.  No fds are involved.
+void Coroutine::StartTimer(uint64_t ns) {
+  timer_.deadline = MonotonicNow() + ns;
+  scheduler_.timers_.Add(&timer_);
+#if defined(CO_STATS)
+  scheduler_.stats_.timers++;
+#endif
 }
 
 int Coroutine::Wait(int fd, short event_mask, uint64_t timeout_ns) {
-  state_ = State::kCoWaiting;
+  SetState(State::kCoWaiting);
   struct pollfd pfd = {.fd = fd, .events = event_mask};
   wait_fds_.push_back(pfd);
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  RegisterWaitFds();
   yielded_address_ = __builtin_return_address(0);
-  last_tick_ = scheduler_.TickCount();
-#if CTX_MODE == CTX_SETJMP
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-  }
-#else
-  swapcontext(&resume_, scheduler_.YieldCtx());
-#endif
+  SetLastTick();
+  scheduler_.num_waiting_++;
+  SwitchToScheduler();
   // Get here when resumed.
-  return EndOfWait(timer_fd);
+  return EndOfWait();
 }
 
 int Coroutine::Wait(struct pollfd &fd, uint64_t timeout_ns) {
-  state_ = State::kCoWaiting;
+  SetState(State::kCoWaiting);
   wait_fds_.push_back(fd);
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  RegisterWaitFds();
   yielded_address_ = __builtin_return_address(0);
-  last_tick_ = scheduler_.TickCount();
-#if CTX_MODE == CTX_SETJMP
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-  }
-#else
-  swapcontext(&resume_, scheduler_.YieldCtx());
-#endif
+  SetLastTick();
+  scheduler_.num_waiting_++;
+  SwitchToScheduler();
   // Get here when resumed.
-  return EndOfWait(timer_fd);
+  return EndOfWait();
 }
 
 int Coroutine::Wait(const std::vector<struct pollfd> &fds,
                     uint64_t timeout_ns) {
-  state_ = State::kCoWaiting;
+  SetState(State::kCoWaiting);
   for (auto &fd : fds) {
     wait_fds_.push_back(fd);
   }
-  int timer_fd = AddTimeout(timeout_ns);
+  AddTimeout(timeout_ns);
+  RegisterWaitFds();
   yielded_address_ = __builtin_return_address(0);
-  last_tick_ = scheduler_.TickCount();
-#if CTX_MODE == CTX_SETJMP
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
+  SetLastTick();
+  scheduler_.num_waiting_++;
+  SwitchToScheduler();
+  // Get here when resumed.
+  return EndOfWait();
+}
+
+void Coroutine::Nanosleep(uint64_t ns) {
+  // This is a wait for no fds that always has a timer, even for a zero
+  // sleep.
+  SetState(State::kCoWaiting);
+  StartTimer(ns);
+  yielded_address_ = __builtin_return_address(0);
+  SetLastTick();
+  scheduler_.num_waiting_++;
+  SwitchToScheduler();
+  // Get here when resumed.
+  EndOfWait();
+}
+
+// Hand an operation to the poller and wait for it to complete.  Returns
+// false if the poller can't do it.
+bool Coroutine::WaitForAsyncIo(AsyncIo &io) {
+  io.co = this;
+  if (!scheduler_.poller_->Submit(&io)) {
+    return false;
+  }
+  SetState(State::kCoWaiting);
+  async_io_ = &io;
+  yielded_address_ = __builtin_return_address(0);
+  SetLastTick();
+  scheduler_.num_waiting_++;
+  SwitchToScheduler();
+  // Get here when the operation has completed.
+  async_io_ = nullptr;
+  return true;
+}
+
+// The result of a completed operation as the system call would give it.
+// A cancelled operation is one whose timeout expired.
+static int AsyncIoResult(const AsyncIo &io) {
+  if (io.result >= 0) {
+    return io.result;
+  }
+  errno = io.result == -ECANCELED ? ETIMEDOUT : -io.result;
+  return -1;
+}
+
+// Should a failed non-blocking call be retried once the fd is ready?
+static bool ShouldRetry(ssize_t result) {
+  return result == -1 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+ssize_t Coroutine::Read(int fd, void *buffer, size_t length,
+                        uint64_t timeout_ns) {
+  AsyncIo io = {.op = AsyncIo::Op::kRead,
+                .fd = fd,
+                .buffer = buffer,
+                .length = length,
+                .timeout_ns = timeout_ns};
+  // The kernel doesn't wait for non-blocking fds that aren't ready.
+  if (WaitForAsyncIo(io) && io.result != -EAGAIN) {
+    return AsyncIoResult(io);
+  }
+  for (;;) {
+    if (Wait(fd, POLLIN, timeout_ns) == -1) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    ssize_t n = ::read(fd, buffer, length);
+    if (!ShouldRetry(n)) {
+      return n;
+    }
+  }
+}
+
+ssize_t Coroutine::Write(int fd, const void *buffer, size_t length,
+                         uint64_t timeout_ns) {
+  AsyncIo io = {.op = AsyncIo::Op::kWrite,
+                .fd = fd,
+                .buffer = const_cast<void *>(buffer),
+                .length = length,
+                .timeout_ns = timeout_ns};
+  if (WaitForAsyncIo(io) && io.result != -EAGAIN) {
+    return AsyncIoResult(io);
+  }
+  for (;;) {
+    if (Wait(fd, POLLOUT, timeout_ns) == -1) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    ssize_t n = ::write(fd, buffer, length);
+    if (!ShouldRetry(n)) {
+      return n;
+    }
+  }
+}
+
+int Coroutine::Accept(int fd, struct sockaddr *addr, socklen_t *addr_len,
+                      int flags) {
+  AsyncIo io = {.op = AsyncIo::Op::kAccept,
+                .fd = fd,
+                .buffer = addr,
+                .addr_len = addr_len,
+                .flags = flags};
+  if (WaitForAsyncIo(io) && io.result != -EAGAIN) {
+    return AsyncIoResult(io);
   }
+  for (;;) {
+    Wait(fd, POLLIN);
+#if defined(__linux__)
+    int s = ::accept4(fd, addr, addr_len, flags);
 #else
-  swapcontext(&resume_, scheduler_.YieldCtx());
+    // Only Linux has accept4.
+    int s = ::accept(fd, addr, addr_len);
 #endif
-  // Get here when resumed.
-  return EndOfWait(timer_fd);
+    if (!ShouldRetry(s)) {
+      return s;
+    }
+  }
 }
 
-void Coroutine::Nanosleep(uint64_t ns) {
-  int timer = MakeTimer(ns);
-  Wait(timer);
-  close(timer);
+int Coroutine::Connect(int fd, const struct sockaddr *addr,
+                       socklen_t addr_len) {
+  AsyncIo io = {.op = AsyncIo::Op::kConnect,
+                .fd = fd,
+                .buffer = const_cast<struct sockaddr *>(addr),
+                .length = addr_len};
+  int result = WaitForAsyncIo(io) ? AsyncIoResult(io)
+                                  : ::connect(fd, addr, addr_len);
+  if (result == -1 && errno == EINPROGRESS) {
+    // The connection completes (or fails) when the socket is writable.
+    Wait(fd, POLLOUT);
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+      return -1;
+    }
+    if (error != 0) {
+      errno = error;
+      return -1;
+    }
+    return 0;
+  }
+  return result;
 }
 
-void Coroutine::TriggerEvent() { co::TriggerEvent(event_fd_.fd); }
+#if defined(__linux__)
+ssize_t Coroutine::SendFile(int out_fd, int in_fd, off_t *offset,
+                            size_t count) {
+  for (;;) {
+    ssize_t n = ::sendfile(out_fd, in_fd, offset, count);
+    if (!ShouldRetry(n)) {
+      return n;
+    }
+    if (errno != EINTR) {
+      Wait(out_fd, POLLOUT);
+    }
+  }
+}
+#endif
+
+// The task is on this coroutine's stack, so it must not return until the
+// task has woken it.
+void Coroutine::OffloadNonTemplate(OffloadTask &task) {
+  if (scheduler_.offload_pool_ == nullptr) {
+    scheduler_.offload_pool_ =
+        std::make_unique<ThreadPool>(scheduler_.offload_threads_);
+  }
+  scheduler_.offload_pool_->Submit(&task);
+  // Anything else that wakes us leaves the work running, and the task is
+  // on our stack.
+  while (!task.Done()) {
+    Suspend();
+  }
+}
+
+void OffloadTask::Execute() {
+  Work();
+  // The task can be gone as soon as this returns.
+  co_->Scheduler().WakeFromAnotherThread(this);
+}
 
-void Coroutine::ClearEvent() { co::ClearEvent(event_fd_.fd); }
+void OffloadTask::Run() {
+  done_ = true;
+  co_->Wake();
+}
 
 void Coroutine::AddPollFds(std::vector<struct pollfd> &pollfds,
                            std::vector<Coroutine *> &covec) {
-  switch (state_) {
-    case State::kCoReady:
-    case State::kCoYielded:
-      pollfds.push_back(event_fd_);
-      covec.push_back(this);
-      break;
+  switch (GetState()) {
     case State::kCoWaiting:
       for (auto &fd : wait_fds_) {
         pollfds.push_back(fd);
         covec.push_back(this);
       }
+      break;
+    case State::kCoReady:
+    case State::kCoYielded:
+      // These are in the scheduler's ready queue, not the poll set.
     case State::kCoNew:
     case State::kCoRunning:
     case State::kCoDead:
@@ -321,7 +699,9 @@ std::string Coroutine::ToString() const {
 
 std::string Coroutine::MakeDefaultString() const {
   const char *state = "unknown";
-  switch (state_) {
+  // Once it has gone from the scheduler its id might belong to another
+  // coroutine.
+  switch (IsAlive() ? GetState() : State::kCoDead) {
     case State::kCoNew:
       state = "new";
       break;
@@ -342,11 +722,101 @@ std::string Coroutine::MakeDefaultString() const {
       break;
   }
   char buffer[256];
-  snprintf(buffer, sizeof(buffer), "Coroutine %d: %s: state: %s: address: %p",
-           id_, name_.c_str(), state, yielded_address_);
+  int n = snprintf(buffer, sizeof(buffer),
+                   "Coroutine %d: %s: state: %s: address: %p", id_,
+                   Name().c_str(), state, yielded_address_);
+  if (scheduler_.stacks_.MeasuresUsage() && n >= 0 &&
+      static_cast<size_t>(n) < sizeof(buffer)) {
+    n += snprintf(buffer + n, sizeof(buffer) - n, ": stack: %zu of %zu",
+                  scheduler_.stacks_.Usage(stack_, stack_size_), stack_size_);
+  }
+#if defined(CO_STATS)
+  if (n >= 0 && static_cast<size_t>(n) < sizeof(buffer)) {
+    snprintf(buffer + n, sizeof(buffer) - n,
+             ": switches: %llu: run: %lluus (max %lluus): queued: %lluus "
+             "(max %lluus)",
+             static_cast<unsigned long long>(stats_.switches),
+             static_cast<unsigned long long>(stats_.run_ns / 1000),
+             static_cast<unsigned long long>(stats_.max_run_ns / 1000),
+             static_cast<unsigned long long>(stats_.queue_ns / 1000),
+             static_cast<unsigned long long>(stats_.max_queue_ns / 1000));
+  }
+#endif
   return buffer;
 }
 
+// Statistics are collected when a coroutine is queued, resumed and when it
+// switches back to the scheduler.  Without CO_STATS these do nothing.
+inline void Coroutine::StatsRunnable(uint64_t now) {
+#if defined(CO_STATS)
+  runnable_since_ = now;
+#endif
+}
+
+inline void Coroutine::StatsStartRun() {
+#if defined(CO_STATS)
+  uint64_t now = MonotonicNow();
+  SchedulerStats &s = scheduler_.stats_;
+  if (runnable_since_ != 0) {
+    uint64_t queued = now - runnable_since_;
+    stats_.queue_ns += queued;
+    stats_.max_queue_ns = std::max(stats_.max_queue_ns, queued);
+    s.queue_ns += queued;
+    s.max_queue_ns = std::max(s.max_queue_ns, queued);
+    runnable_since_ = 0;
+  }
+  stats_.switches++;
+  s.switches++;
+  resumed_at_ = now;
+#endif
+}
+
+inline void Coroutine::StatsEndRun() {
+#if defined(CO_STATS)
+  if (resumed_at_ == 0) {
+    return;
+  }
+  uint64_t ran = MonotonicNow() - resumed_at_;
+  stats_.run_ns += ran;
+  stats_.max_run_ns = std::max(stats_.max_run_ns, ran);
+  scheduler_.stats_.run_ns += ran;
+  resumed_at_ = 0;
+#endif
+}
+
+CoroutineStats Coroutine::Stats() const {
+#if defined(CO_STATS)
+  CoroutineStats stats = stats_;
+#else
+  CoroutineStats stats;
+#endif
+  stats.id = id_;
+  stats.name = Name();
+  stats.stack_size = stack_size_;
+  stats.stack_used = scheduler_.stacks_.Usage(stack_, stack_size_);
+  return stats;
+}
+
+const std::string &Coroutine::Name() const {
+  if (name_.empty()) {
+    ChangeName("co-" + std::to_string(id_));
+  }
+  return name_;
+}
+
+// The watchdog's thread might be reading the name of the running
+// coroutine.
+void Coroutine::ChangeName(std::string name) const {
+  Watchdog *watchdog = scheduler_.watchdog_.get();
+  if (watchdog != nullptr) {
+    watchdog->BeginNameChange();
+  }
+  name_ = std::move(name);
+  if (watchdog != nullptr) {
+    watchdog->EndNameChange();
+  }
+}
+
 void Coroutine::Show() const {
   fprintf(stderr, "%s\n", MakeDefaultString().c_str());
 }
@@ -354,23 +824,24 @@ void Coroutine::Show() const {
 bool Coroutine::IsAlive() const { return scheduler_.IdExists(id_); }
 
 void Coroutine::CallNonTemplate(Coroutine &callee) {
-  // Start the callee running if it's not already running.  If it's running
-  // we trigger its event to wake it up.
-  if (callee.state_ == State::kCoNew) {
-    callee.Start();
+  if (CanTransferTo(callee)) {
+    // Switch straight to the callee, like a function call.  It switches
+    // straight back when it yields a value.
+    TransferTo(callee);
   } else {
-    callee.TriggerEvent();
-  }
-  state_ = State::kCoYielded;
-  last_tick_ = scheduler_.TickCount();
-#if CTX_MODE == CTX_SETJMP
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-    // Never get here.
+    // Start the callee running if it's not already running.  If it has
+    // yielded we make it runnable to wake it up.  If it's waiting for an
+    // fd or a timer it carries on when the wait is over.
+    State state = callee.GetState();
+    if (state == State::kCoNew) {
+      callee.Start();
+    } else if (state == State::kCoYielded) {
+      scheduler_.MakeRunnable(&callee);
+    }
+    SetState(State::kCoYielded);
+    SetLastTick();
+    SwitchToScheduler();
   }
-#else
-  swapcontext(&resume_, scheduler_.YieldCtx());
-#endif
 
   // When we get here, the callee has done its work.  Remove this coroutine's
   // state from it.
@@ -378,47 +849,115 @@ void Coroutine::CallNonTemplate(Coroutine &callee) {
 }
 
 void Coroutine::Yield() {
-  state_ = State::kCoYielded;
+  SetState(State::kCoYielded);
   yielded_address_ = __builtin_return_address(0);
-  last_tick_ = scheduler_.TickCount();
-  TriggerEvent();
-#if CTX_MODE == CTX_SETJMP
-  if (setjmp(resume_) == 0) {
-    __real_longjmp(scheduler_.YieldBuf(), 1);
-    // Never get here.
-  }
-#else
-  swapcontext(&resume_, scheduler_.YieldCtx());
-#endif
+  SetLastTick();
+  scheduler_.MakeRunnable(this);
+  SwitchToScheduler();
 
-  // We get here when resumed.  We ignore the result of setjmp as we
+  // We get here when resumed.  We ignore the resume value as we
   // are not waiting for anything and there is no yield with timeout
   // since the coroutine is automatically rescheduled.  If you want to
   // sleep, use the various Sleep functions.
 }
 
+void Coroutine::Suspend() {
+  SetState(State::kCoYielded);
+  yielded_address_ = __builtin_return_address(0);
+  SetLastTick();
+  SwitchToScheduler();
+  // We get here when woken.
+}
+
+void Coroutine::Wake() { scheduler_.MakeRunnable(this); }
+
 void Coroutine::YieldNonTemplate() {
   if (caller_ != nullptr) {
+    if (CanTransferTo(*caller_)) {
+      // Straight back to the caller, which is waiting in CallNonTemplate.
+      // We get here when called again.
+      TransferTo(*caller_);
+      return;
+    }
     // Tell caller that there's a value available.
-    caller_->TriggerEvent();
+    scheduler_.MakeRunnable(caller_);
   }
 
-  // Yield control to another coroutine but don't trigger a wakup event.
+  // Yield control to another coroutine but don't make ourselves runnable.
   // This will be done when another call is made.
-  state_ = State::kCoYielded;
-  last_tick_ = scheduler_.TickCount();
+  SetState(State::kCoYielded);
+  SetLastTick();
+  SwitchToScheduler();
+  // We get here when resumed from another call.
+}
+
+// A coroutine can switch straight to another one (without going through
+// the scheduler) if the other one is new or has yielded and isn't waiting
+// to be run by the scheduler.  These are the cases for a generator and
+// its caller.  With setjmp, a new coroutine must be started by the
+// scheduler.
+bool Coroutine::CanTransferTo(const Coroutine &to) const {
+  State state = to.GetState();
+  if (scheduler_.in_ready_queue_[to.id_]) {
+    return false;
+  }
+#if CTX_MODE == CTX_SETJMP
+  return state == State::kCoYielded;
+#else
+  return state == State::kCoYielded || state == State::kCoNew;
+#endif
+}
+
+// Switch directly to another coroutine.  This returns when this coroutine
+// is switched back to, either directly or by the scheduler.  As far as the
+// watchdog is concerned the two are the same run, so a loop that calls a
+// generator without ever going back to the scheduler is still reported.
+void Coroutine::TransferTo(Coroutine &to) {
+  SetState(State::kCoYielded);
+  SetLastTick();
+  StatsEndRun();
+  to.SetState(State::kCoRunning);
+  to.wait_result_ = 0;
+  scheduler_.current_ = &to;
+  to.StatsStartRun();
+#if CTX_MODE == CTX_SETJMP
+  if (setjmp(resume_) == 0) {
+    __real_longjmp(to.resume_, 1);
+  }
+#elif CTX_MODE == CTX_UCONTEXT
+  swapcontext(&resume_, &to.resume_);
+#else
+#if defined(CO_TSAN)
+  __tsan_switch_to_fiber(to.tsan_fiber_, 0);
+#endif
+  __co_SwitchContext(&resume_, to.resume_);
+#endif
+}
+
+// Save this coroutine's context and switch to the scheduler.  This
+// returns when the coroutine is resumed.
+void Coroutine::SwitchToScheduler() {
+  scheduler_.current_ = nullptr;
+  StatsEndRun();
+  if (scheduler_.watchdog_ != nullptr) {
+    scheduler_.watchdog_->SwitchedOut();
+  }
 #if CTX_MODE == CTX_SETJMP
   if (setjmp(resume_) == 0) {
     __real_longjmp(scheduler_.YieldBuf(), 1);
     // Never get here.
   }
-#else
+#elif CTX_MODE == CTX_UCONTEXT
   swapcontext(&resume_, scheduler_.YieldCtx());
+#else
+#if defined(CO_TSAN)
+  __tsan_switch_to_fiber(scheduler_.tsan_fiber_, 0);
+#endif
+  __co_SwitchContext(&resume_, scheduler_.yield_);
 #endif
-  // We get here when resumed from another call.
 }
 
-void Coroutine::InvokeFunction() { function_(this); }
+void Coroutine::InvokeFunction() { invoke_body_(body_, this); }
 
 // We use an intermediate function to do the invocation of
 // the coroutine's function because we really want to avoid
@@ -426,266 +965,790 @@ void Coroutine::InvokeFunction() { function_(this); }
 // the Resume function.  A new compiler might change the
 // name mangling rules and that would break the build.
 extern "C" {
-void __co_Invoke(Coroutine *c) { c->InvokeFunction(); }
+void __co_Invoke(Coroutine *c) {
+  c->InvokeFunction();
+  // Functor returned, we are dead.  This doesn't return.
+  c->Exit();
+}
 }
 
+#if CTX_MODE == CTX_ASM
+// Switch from the scheduler to this coroutine.  Unlike the other modes, this
+// returns to the scheduler when the coroutine switches back.
+void Coroutine::SwitchFromScheduler() {
+#if defined(CO_TSAN)
+  scheduler_.tsan_fiber_ = __tsan_get_current_fiber();
+  __tsan_switch_to_fiber(tsan_fiber_, 0);
+#endif
+  __co_SwitchContext(&scheduler_.yield_, resume_);
+}
+#endif
+
 void Coroutine::Resume(int value) {
-  switch (state_) {
+  scheduler_.current_ = this;
+  StatsStartRun();
+  if (scheduler_.watchdog_ != nullptr) {
+    scheduler_.watchdog_->Resumed(id_, &name_, yielded_address_);
+  }
+  switch (GetState()) {
     case State::kCoReady:
       // Initial invocation of the coroutine.  We need to do a bit
       // of magic to switch to the coroutine's stack and invoke
-      // the function using the stack.  When the function returns
-      // we longjmp to the exit environment with the stack restored
-      // to the current one, which is the stack used by the
-      // CoroutineScheduler.
-      state_ = State::kCoRunning;
+      // the function using the stack.  The function never returns
+      // here.  When it's done it calls Exit() which switches back
+      // to the scheduler's context.
+      SetState(State::kCoRunning);
       yielded_address_ = nullptr;
-#if CTX_MODE == CTX_SETJMP
-      if (setjmp(exit_) == 0) {
-        void *sp = reinterpret_cast<char *>(stack_) + stack_size_;
-        jmp_buf &exit_state = exit_;
+#if CTX_MODE == CTX_ASM
+      // The stack was set up by MakeInitialContext so this is the same
+      // as any other resume.
+      SwitchFromScheduler();
+#elif CTX_MODE == CTX_SETJMP
+      {
+        // The stack starts below the function, which is 16 byte aligned
+        // as the stack pointer must be on both architectures.
+        void *sp = body_;
 
 // clang-format off
 #if defined(__aarch64__)
-      asm("mov x12, sp\n"     // Save current stack pointer.
-          "mov x13, x29\n"    // Save current frame pointer
-          "sub sp, %0, #32\n" // Set new stack pointer.
-          "stp x12, x13, [sp, #16]\n"
-          "str %1, [sp, #0]\n" // Save exit state to stack.
-          "mov x0, %2\n"
+      register Coroutine *self asm("x0") = this;
+      asm("mov sp, %0\n"     // Set new stack pointer.
+          "mov x29, xzr\n"   // No frame pointer, end of stack.
           "bl " SYM(__co_Invoke) "\n"
-          "ldr x0, [sp, #0]\n" // Restore exit state.
-          "ldp x12, x29, [sp, #16]\n"
-          "mov sp, x12\n" // Restore stack pointer
-          "mov w1, #1\n"
-          "bl " SYM(longjmp) "\n"
           :
-          : "r"(sp), "r"(exit_state), "r"(this)
-          : "x12", "x13");
+          : "r"(sp), "r"(self));
 
 #elif defined(__x86_64__)
-      asm("movq %%rsp, %%r14\n" // Save current stack pointer.
-          "movq %%rbp, %%r15\n" // Save current frame pointer
-          "movq %0, %%rsp\n"
-          "pushq %%r14\n"    // Push rsp
-          "pushq %%r15\n"    // Push rbp
-          "pushq %1\n"       // Push env
-          "subq $8, %%rsp\n" // Align to 16
-          "movq %2, %%rdi\n" // this
+      asm("movq %0, %%rsp\n"   // Set new stack pointer.
+          "xorl %%ebp, %%ebp\n" // No frame pointer, end of stack.
           "call " SYM(__co_Invoke) "\n"
-          "addq $8, %%rsp\n" // Remove alignment.
-          "popq %%rdi\n"     // Pop env
-          "popq %%rbp\n"
-          "popq %%rsp\n"
-          "movl $1, %%esi\n"
-          "call " SYM(longjmp) "\n"
           :
-          : "r"(sp), "r"(exit_state), "r"(this)
-          : "%r14", "%r15");
+          : "r"(sp), "D"(this));
 #else
 #error "Unknown architecture"
 #endif
         // clang-format on
       }
 #else
-      getcontext(&exit_);
-      // We will get here when the coroutines's function returns.
-      if (first_resume_) {
-        // This is the first time we have been resumed so set the context
-        // to that set up by makecontext.  This will set the stack and invoke
-        // the function.
-        setcontext(&resume_);
-      }
+      // Switch to the context set up by makecontext.  This will set the
+      // stack and invoke the function.
+      setcontext(&resume_);
 #endif
-
-      // Trigger the caller when we exit.
-      if (caller_ != nullptr) {
-        caller_->TriggerEvent();
-      }
-      // Functor returned, we are dead.
-      state_ = State::kCoDead;
-      scheduler_.RemoveCoroutine(this);
       break;
-    case State::kCoYielded:
     case State::kCoWaiting:
-      state_ = State::kCoRunning;
+      scheduler_.num_waiting_--;
+      [[fallthrough]];
+    case State::kCoYielded:
+      SetState(State::kCoRunning);
       wait_result_ = value;
 #if CTX_MODE == CTX_SETJMP
       __real_longjmp(resume_, 1);
-#else
+#elif CTX_MODE == CTX_UCONTEXT
       setcontext(&resume_);
+#else
+      SwitchFromScheduler();
 #endif
       break;
     case State::kCoRunning:
     case State::kCoNew:
-      // Should never get here.
-      break;
     case State::kCoDead:
-#if CTX_MODE == CTX_SETJMP
-      __real_longjmp(exit_, 1);
-#else
-      setcontext(&exit_);
-#endif
+      // Should never get here.
       break;
   }
 }
 
-CoroutineScheduler::CoroutineScheduler() {
+CoroutineScheduler::CoroutineScheduler(PollerType poller_type)
+    : poller_(Poller::Create(poller_type)) {
   interrupt_fd_.fd = NewEventFd();
   interrupt_fd_.events = POLLIN;
+  poller_->Add(interrupt_fd_.fd, interrupt_fd_.events, nullptr);
 }
 
-CoroutineScheduler::~CoroutineScheduler() { CloseEventFd(interrupt_fd_.fd); }
+CoroutineScheduler::~CoroutineScheduler() {
+  // Offloaded work refers to coroutines' stacks, so it has to be finished
+  // first.
+  offload_pool_.reset();
+  // Delete the coroutines we own that haven't exited.  The others belong to
+  // someone else.
+  Coroutine *c = first_;
+  while (c != nullptr) {
+    Coroutine *next = c->next_;
+    if (c->owned_) {
+      delete c;
+    }
+    c = next;
+  }
+  CloseEventFd(interrupt_fd_.fd);
+  CloseEventFd(timer_fd_);
+}
 
 void CoroutineScheduler::BuildPollFds(PollState *poll_state) {
   poll_state->pollfds.clear();
   poll_state->coroutines.clear();
 
   poll_state->pollfds.push_back(interrupt_fd_);
-  for (auto *c : coroutines_) {
-    auto state = c->GetState();
-    if (state == Coroutine::State::kCoNew ||
-        state == Coroutine::State::kCoRunning ||
-        state == Coroutine::State::kCoDead) {
+  if (num_waiting_ == 0) {
+    // Nothing is waiting for an fd so there's no point looking.
+    return;
+  }
+  // Only the waiting coroutines are looked at.
+  for (size_t id = 0; id < states_.size(); id++) {
+    if (states_[id] == Coroutine::State::kCoWaiting) {
+      coroutines_by_id_[id]->AddPollFds(poll_state->pollfds,
+                                        poll_state->coroutines);
+    }
+  }
+}
+
+// Schedule the coroutines whose fds have been triggered.  Within a
+// priority class this scheduler chooses the coroutine that has been
+// waiting longest.  Unless they are just new no two coroutines can have
+// been waiting for the same amount of time, so within a class it is
+// completely fair.
+//
+// All the triggered coroutines (up to the maximum batch size) are queued
+// in order of the time they have been waiting, and they are all run before
+// the next poll.  If there are more than the maximum, the ones in the
+// highest classes that have been waiting longest are queued and the others
+// will be triggered again by the next poll.
+void CoroutineScheduler::QueueTriggered(const std::vector<PollEvent> &events) {
+  triggered_.clear();
+  for (auto &event : events) {
+    Coroutine *co = event.co;
+    uint32_t id = co->id_;
+    // A coroutine might have more than one fd triggered or still be queued
+    // from the last poll.  It only gets queued once.
+    if (in_ready_queue_[id]) {
       continue;
     }
-    c->AddPollFds(poll_state->pollfds, poll_state->coroutines);
-    if (state == Coroutine::State::kCoReady) {
-      // Coroutine is ready to go, trigger its event so that we can start
-      // it.
-      c->TriggerEvent();
-    }
-  }
-}
-
-// Schedule the next coroutine to run.  This scheduler chooses the
-// coroutine that has been waiting longest.  Unless they are just new
-// no two coroutines can have been waiting for the same amount of time.
-// This is a completely fair scheduler with all coroutines given the
-// same priority.
-CoroutineScheduler::ChosenCoroutine CoroutineScheduler::ChooseRunnable(
-    PollState *poll_state, int num_ready) {
-  // Find the ready coroutine with the highest time waiting.
-  // We need to process all ready coroutines once to choose the
-  // one to run.
-  // Worst case is that all coroutines are ready, which means we
-  // need O(n) complexity.  We can't avoid processing all the ready
-  // coroutines so we only do it once rather than inserting them into
-  // a data structure and processing it afterwards.
-  Coroutine *chosen = nullptr;
-  int chosen_fd;
-  uint64_t max_wait;
-  for (size_t i = 1; i < poll_state->pollfds.size(); i++) {
-    struct pollfd *fd = &poll_state->pollfds[i];
-    Coroutine *co = poll_state->coroutines[i - 1];
-    uint64_t wait_time = tick_count_ - co->LastTick();
-    if (fd->revents != 0 && (chosen == nullptr || wait_time > max_wait)) {
-      chosen = co;
-      chosen_fd = fd->fd;
-      max_wait = wait_time;
+    in_ready_queue_[id] = true;
+    triggered_.emplace_back(co, event.fd, last_ticks_[id]);
+  }
+  auto first_to_run = [](const ChosenCoroutine &a, const ChosenCoroutine &b) {
+    if (a.co->priority_ != b.co->priority_) {
+      return a.co->priority_ < b.co->priority_;
     }
+    return a.tick < b.tick;
+  };
+  if (triggered_.size() > max_batch_size_) {
+    std::nth_element(triggered_.begin(), triggered_.begin() + max_batch_size_,
+                     triggered_.end(), first_to_run);
+    for (size_t i = max_batch_size_; i < triggered_.size(); i++) {
+      Coroutine *co = triggered_[i].co;
+      in_ready_queue_[co->id_] = false;
+      // Expired timers and completed asynchronous I/O won't be triggered
+      // again by the next poll unless they are put back.
+      if (co->timer_.deadline != 0 && !co->timer_.IsQueued()) {
+        timers_.Add(&co->timer_);
+      }
+      if (co->async_io_ != nullptr) {
+        completed_io_.push_back({co, triggered_[i].fd, POLLIN});
+      }
+    }
+    triggered_.resize(max_batch_size_);
   }
-  if (chosen == nullptr) {
-    return ChosenCoroutine();
+  std::stable_sort(triggered_.begin(), triggered_.end(), first_to_run);
+#if defined(CO_STATS)
+  uint64_t now = MonotonicNow();
+  for (auto &t : triggered_) {
+    t.co->StatsRunnable(now);
+  }
+#endif
+  for (auto &t : triggered_) {
+    t.triggered = true;
+    Enqueue(t);
   }
-  return ChosenCoroutine(chosen, chosen_fd);
 }
 
-CoroutineScheduler::ChosenCoroutine CoroutineScheduler::GetRunnableCoroutine(
-    PollState *poll_state, int num_ready) {
-  if (interrupt_fd_.revents != 0) {
-    // Interrupted.
-    ClearEvent(interrupt_fd_.fd);
-    return ChosenCoroutine();
+// How long a poll should wait before the next timer expires.  -1 means
+// forever.
+int64_t CoroutineScheduler::NextTimeout() const {
+  if (timers_.IsEmpty()) {
+    return -1;
+  }
+  uint64_t now = MonotonicNow();
+  uint64_t deadline = timers_.NextDeadline();
+  return deadline > now ? static_cast<int64_t>(deadline - now) : 0;
+}
+
+// Add an event with an fd of -1 (which is what Wait returns for a
+// timeout) for each coroutine whose timer has expired.  These go after the
+// fd events so that if a coroutine has both, the fd wins.
+void CoroutineScheduler::AddExpiredTimers(std::vector<PollEvent> &events) {
+  if (timers_.IsEmpty()) {
+    return;
+  }
+  uint64_t now = MonotonicNow();
+  while (Timer *timer = timers_.PopExpired(now)) {
+    events.push_back({timer->co, -1, 0});
+  }
+}
+
+// Add the events held back from the last batch for asynchronous I/O that
+// had already completed.
+void CoroutineScheduler::AddCompletedIo(std::vector<PollEvent> &events) {
+  events.insert(events.end(), completed_io_.begin(), completed_io_.end());
+  completed_io_.clear();
+}
+
+// Remove the interrupt fd's event (the only one without a coroutine) from
+// the events.  Returns true if it was there.
+bool CoroutineScheduler::TakeInterrupt(std::vector<PollEvent> &events) {
+  for (size_t i = 0; i < events.size(); i++) {
+    if (events[i].co == nullptr) {
+      events.erase(events.begin() + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The deadline heaps have the earliest deadline (and then the longest
+// waiting) at the front.
+bool CoroutineScheduler::LaterDeadline(const DeadlineEntry &a,
+                                       const DeadlineEntry &b) {
+  if (a.deadline != b.deadline) {
+    return a.deadline > b.deadline;
   }
+  return a.chosen.tick > b.chosen.tick;
+}
 
-  ChosenCoroutine chosen = ChooseRunnable(poll_state, num_ready);
+void CoroutineScheduler::PushDeadline(RunQueue &queue,
+                                      const ChosenCoroutine &c) {
+  queue.deadlines.push_back({c.co->deadline_, c});
+  std::push_heap(queue.deadlines.begin(), queue.deadlines.end(),
+                 LaterDeadline);
+}
 
-  if (chosen.co != nullptr) {
-    chosen.co->ClearEvent();
+void CoroutineScheduler::PopDeadline(RunQueue &queue,
+                                     ChosenCoroutine &chosen) {
+  std::pop_heap(queue.deadlines.begin(), queue.deadlines.end(),
+                LaterDeadline);
+  chosen = queue.deadlines.back().chosen;
+  queue.deadlines.pop_back();
+}
+
+// Put a runnable coroutine in the queue for its priority class.  This and
+// ChooseNext are on every switch, so the deadlines and the starvation
+// checks are kept out of the way.
+inline void CoroutineScheduler::Enqueue(const ChosenCoroutine &c) {
+  size_t priority = static_cast<size_t>(c.co->priority_);
+  RunQueue &queue = run_queues_[priority];
+  if (c.co->deadline_ != 0) {
+    PushDeadline(queue, c);
+  } else if (c.triggered) {
+    queue.io_ready.push_back(c);
+  } else {
+    queue.ready.push_back(c);
   }
+  queue.size++;
+  runnable_classes_ |= 1U << priority;
+  if (c.triggered) {
+    num_io_ready_++;
+  } else {
+    num_ready_++;
+  }
+}
+
+// Choose the priority class to run a coroutine from, when there is a
+// runnable one.  This is the highest class with runnable coroutines unless
+// a lower one has been passed over as many times as the starvation limit
+// allows.
+inline size_t CoroutineScheduler::ChooseClass() {
+  if ((runnable_classes_ & (runnable_classes_ - 1)) != 0) {
+    return ChooseStarvedClass();
+  }
+  // Usually only one class has anything to run.
+  size_t chosen = __builtin_ctz(runnable_classes_);
+  run_queues_[chosen].passed_over = 0;
   return chosen;
 }
 
+// ChooseClass when more than one class has runnable coroutines.
+size_t CoroutineScheduler::ChooseStarvedClass() {
+  size_t chosen = __builtin_ctz(runnable_classes_);
+  uint32_t lower = runnable_classes_ & (runnable_classes_ - 1);
+  for (uint32_t classes = lower; classes != 0; classes &= classes - 1) {
+    size_t priority = __builtin_ctz(classes);
+    if (run_queues_[priority].passed_over >= starvation_limit_) {
+      chosen = priority;
+      break;
+    }
+  }
+  for (uint32_t classes = runnable_classes_; classes != 0;
+       classes &= classes - 1) {
+    size_t priority = __builtin_ctz(classes);
+    if (priority == chosen) {
+      run_queues_[priority].passed_over = 0;
+    } else {
+      run_queues_[priority].passed_over++;
+    }
+  }
+  return chosen;
+}
+
+// Choose the next coroutine to run from the chosen priority class.  The
+// one with the earliest deadline goes first.  Otherwise it's between the
+// coroutine at the head of the ready queue and the one at the head of the
+// queue of triggered coroutines.  Both queues are in the order in which
+// the coroutines started waiting, so their heads are the ones that have
+// been waiting longest.  Whichever of the two has waited longer is run,
+// which keeps the same fairness as if everything was in the poll set.
+CoroutineScheduler::ChosenCoroutine CoroutineScheduler::ChooseNext() {
+  ChosenCoroutine chosen;
+  if (runnable_classes_ == 0) {
+    return chosen;
+  }
+  size_t priority = ChooseClass();
+  RunQueue &queue = run_queues_[priority];
+  if (!queue.deadlines.empty()) {
+    PopDeadline(queue, chosen);
+  } else if (!queue.io_ready.empty() &&
+             (queue.ready.empty() ||
+              queue.io_ready.front().tick < queue.ready.front().tick)) {
+    chosen = queue.io_ready.front();
+    queue.io_ready.pop_front();
+  } else {
+    chosen = queue.ready.front();
+    queue.ready.pop_front();
+  }
+  if (--queue.size == 0) {
+    runnable_classes_ &= ~(1U << priority);
+  }
+  if (chosen.triggered) {
+    num_io_ready_--;
+  } else {
+    num_ready_--;
+  }
+  in_ready_queue_[chosen.co->id_] = false;
+  return chosen;
+}
+
+void CoroutineScheduler::MakeRunnable(Coroutine *c) {
+  uint32_t id = c->id_;
+  if (in_ready_queue_[id]) {
+    return;
+  }
+  in_ready_queue_[id] = true;
+  Enqueue(ChosenCoroutine(c, -1, last_ticks_[id]));
+#if defined(CO_STATS)
+  c->StatsRunnable(MonotonicNow());
+#endif
+}
+
 void CoroutineScheduler::Run() {
   running_ = true;
+  if (stop_requested_.exchange(false)) {
+    // Stopped before we got here, maybe by another thread.
+    running_ = false;
+  }
   while (running_) {
-    if (coroutines_.empty()) {
+    if (num_coroutines_ == 0) {
       // No coroutines, nothing to do.
       break;
     }
 #if CTX_MODE == CTX_SETJMP
     setjmp(yield_);
-#else
+#elif CTX_MODE == CTX_UCONTEXT
     getcontext(&yield_);
 #endif
-    // We get here any time a coroutine yields or waits.
-
-    BuildPollFds(&poll_state_);
-
-    // Wait for coroutines (or the interrupt fd) to trigger.
-    int num_ready =
-        ::poll(poll_state_.pollfds.data(), poll_state_.pollfds.size(), -1);
-    if (num_ready <= 0) {
+    // We get here any time a coroutine yields, waits or exits.
+    ReapExited();
+    if (!running_ || num_coroutines_ == 0) {
+      // Stopped by the coroutine that just yielded or nothing left to run.
       continue;
     }
-
-    // Copy interrupt fd from poll fd set.
-    interrupt_fd_ = poll_state_.pollfds[0];
+    RunRemoteWakeups();
+
+    // We only need to poll when we've run all the coroutines triggered by
+    // the last poll and either there is nothing else to run, in which case
+    // we block until something happens, or there are coroutines waiting
+    // for fds and a batch of ready ones has run since the last poll.
+    // Without the batch every yield would cost a poll while anything at
+    // all was waiting.
+    if (num_io_ready_ == 0 &&
+        (num_ready_ == 0 ||
+         (runs_since_poll_ >= max_batch_size_ &&
+          (num_waiting_ > 0 || !completed_io_.empty())))) {
+      runs_since_poll_ = 0;
+      // Wait for coroutines (or the interrupt fd) to trigger.
+      poll_events_.clear();
+      int64_t timeout =
+          num_ready_ == 0 && completed_io_.empty() ? NextTimeout() : 0;
+      int num_ready = poller_->Poll(timeout, poll_events_);
+      if (num_ready < 0) {
+        continue;
+      }
+      StatsPoll(poller_->NumFds(), num_ready);
+      bool interrupted = TakeInterrupt(poll_events_);
+      AddCompletedIo(poll_events_);
+      AddExpiredTimers(poll_events_);
+      QueueTriggered(poll_events_);
+      if (interrupted) {
+        // Interrupted.
+        ClearEvent(interrupt_fd_.fd);
+        continue;
+      }
+    }
 
     // One more tick.
     tick_count_++;
 
     // Choose a runnable coroutine.
-    ChosenCoroutine c = GetRunnableCoroutine(&poll_state_, num_ready);
+    ChosenCoroutine c = ChooseNext();
     if (c.co != nullptr) {
+      runs_since_poll_++;
       c.co->Resume(c.fd);
     }
   }
+  // The last coroutine to run might have exited as well as stopping us.
+  ReapExited();
+  stop_requested_ = false;
 }
 
 void CoroutineScheduler::GetPollState(PollState *poll_state) {
   BuildPollFds(poll_state);
+  if (!timers_.IsEmpty()) {
+    // The caller's poll needs to wake up when the first timer expires.
+    // This uses a single timer fd that is only set when the first
+    // deadline changes.
+    if (timer_fd_ == -1) {
+      timer_fd_ = NewTimerFd();
+    }
+    uint64_t deadline = timers_.NextDeadline();
+    if (deadline != timer_fd_deadline_) {
+      SetTimerFd(timer_fd_, deadline);
+      timer_fd_deadline_ = deadline;
+    }
+    poll_state->pollfds.push_back({.fd = timer_fd_, .events = POLLIN});
+    poll_state->coroutines.push_back(nullptr);
+  }
+  // Asynchronous I/O started since the last poll is submitted now, and the
+  // caller's poll wakes up when any of it completes.
+  int async_io_fd = poller_->FlushAsyncIo();
+  if (async_io_fd != -1) {
+    poll_state->pollfds.push_back({.fd = async_io_fd, .events = POLLIN});
+    poll_state->coroutines.push_back(nullptr);
+  }
+  if (num_ready_ > 0 || num_io_ready_ > 0 || !completed_io_.empty()) {
+    // There are coroutines ready to run.  Make sure the caller's poll
+    // returns immediately.
+    TriggerEvent(interrupt_fd_.fd);
+  }
 }
 
 void CoroutineScheduler::ProcessPoll(PollState *poll_state) {
-  int num_ready = 0;
+  poll_events_.clear();
+  size_t num_ready = poll_state->pollfds[0].revents != 0 ? 1 : 0;
   for (size_t i = 1; i < poll_state->pollfds.size(); i++) {
-    if (poll_state->pollfds[i].revents != 0) {
-      num_ready++;
+    struct pollfd &fd = poll_state->pollfds[i];
+    if (fd.revents == 0) {
+      continue;
+    }
+    num_ready++;
+    Coroutine *co = poll_state->coroutines[i - 1];
+    if (co == nullptr) {
+      if (fd.fd == timer_fd_) {
+        // The expired timers are dealt with below.
+        ClearTimerFd(fd.fd);
+        timer_fd_deadline_ = 0;
+      } else {
+        poller_->CompleteAsyncIo(poll_events_);
+      }
+      continue;
     }
+    poll_events_.push_back({co, fd.fd, fd.revents});
   }
-  // One more tick.
-  tick_count_++;
+  StatsPoll(poll_state->pollfds.size(), num_ready);
 
-  // Choose a runnable coroutine.
-  ChosenCoroutine c = GetRunnableCoroutine(poll_state, num_ready);
-  if (c.co != nullptr) {
+  // The interrupt fd is only used to wake the caller's poll here.
+  if (poll_state->pollfds[0].revents != 0) {
+    ClearEvent(interrupt_fd_.fd);
+  }
+  RunRemoteWakeups();
+  AddCompletedIo(poll_events_);
+  AddExpiredTimers(poll_events_);
+  QueueTriggered(poll_events_);
+
+  // Run the coroutines that are runnable now.  Any that become runnable
+  // while we are doing this will be run next time.
+  size_t num_runnable = std::min(num_ready_ + num_io_ready_, max_batch_size_);
+  for (size_t i = 0; i < num_runnable; i++) {
+    // One more tick.
+    tick_count_++;
+
+    // Choose a runnable coroutine.
+    ChosenCoroutine c = ChooseNext();
+    if (c.co == nullptr) {
+      break;
+    }
+    ResumeCoroutine(c);
+  }
+}
+
+void CoroutineScheduler::GetPollChanges(PollChanges *changes) {
+  changes->changes.clear();
+  poller_->TakeChanges(changes->changes);
+  // The interrupt fd is in the poller's set but the caller is told about
+  // it by WakeFd.
+  changes->changes.erase(
+      std::remove_if(changes->changes.begin(), changes->changes.end(),
+                     [this](const PollChange &change) {
+                       return change.fd == interrupt_fd_.fd;
+                     }),
+      changes->changes.end());
+  // Asynchronous I/O started since the last poll is submitted now.  The
+  // completion fd doesn't change, so it is added to the caller's set once.
+  int async_io_fd = poller_->FlushAsyncIo();
+  if (async_io_fd != -1 && async_io_fd != async_io_fd_) {
+    changes->changes.push_back({async_io_fd, 0, POLLIN});
+    async_io_fd_ = async_io_fd;
+  }
+  if (num_ready_ > 0 || num_io_ready_ > 0 || !completed_io_.empty() ||
+      poller_->HasAlwaysReady()) {
+    changes->timeout_ns = 0;
+  } else {
+    changes->timeout_ns = NextTimeout();
+  }
+}
+
+void CoroutineScheduler::ProcessReadyFd(int fd, short revents) {
+  if (fd == interrupt_fd_.fd) {
+    // What woke the caller is dealt with by RunReady.
+    ClearEvent(fd);
+  } else if (fd == async_io_fd_) {
+    poller_->CompleteAsyncIo(poll_events_);
+  } else {
+    poller_->Dispatch(fd, revents, poll_events_);
+  }
+}
+
+size_t CoroutineScheduler::RunReady(size_t budget) {
+  StatsPoll(poller_->NumFds(), poll_events_.size());
+  RunRemoteWakeups();
+  poller_->DispatchAlwaysReady(poll_events_);
+  AddCompletedIo(poll_events_);
+  AddExpiredTimers(poll_events_);
+  QueueTriggered(poll_events_);
+  poll_events_.clear();
+
+  // Coroutines that become runnable while we are doing this are run too,
+  // as long as the budget lasts.
+  size_t num_run = 0;
+  while (num_run < budget) {
+    ChosenCoroutine c = ChooseNext();
+    if (c.co == nullptr) {
+      break;
+    }
+    // One more tick.
+    tick_count_++;
+    ResumeCoroutine(c);
+    num_run++;
+  }
+  return num_run;
+}
+
+// Resume a coroutine from outside Run().  The coroutine will come back here
+// when it yields, waits or exits.
+void CoroutineScheduler::ResumeCoroutine(const ChosenCoroutine &c) {
+#if CTX_MODE == CTX_SETJMP
+  if (setjmp(yield_) == 0) {
+    c.co->Resume(c.fd);
+  }
+#elif CTX_MODE == CTX_ASM
+  c.co->Resume(c.fd);
+#else
+  volatile bool resumed = false;
+  getcontext(&yield_);
+  if (!resumed) {
+    resumed = true;
     c.co->Resume(c.fd);
   }
+#endif
+  ReapExited();
+}
+
+// Called on the scheduler's stack after a coroutine has exited.
+void CoroutineScheduler::ReapExited() {
+  Coroutine *c = exited_;
+  if (c == nullptr) {
+    return;
+  }
+  exited_ = nullptr;
+  // Wake the caller when we exit.
+  if (c->caller_ != nullptr) {
+    MakeRunnable(c->caller_);
+  }
+  RemoveCoroutine(c);
+}
+
+void CoroutineScheduler::WakeFromAnotherThread(RemoteWakeup *w) {
+  RemoteWakeup *head = remote_wakeups_.load(std::memory_order_relaxed);
+  do {
+    w->next_ = head;
+  } while (!remote_wakeups_.compare_exchange_weak(
+      head, w, std::memory_order_release, std::memory_order_relaxed));
+  if (head == nullptr) {
+    // Only the first one needs to interrupt the scheduler.  The others
+    // will be picked up with it.
+    TriggerEvent(interrupt_fd_.fd);
+  }
+}
+
+void CoroutineScheduler::RunRemoteWakeups() {
+  if (remote_wakeups_.load(std::memory_order_relaxed) == nullptr) {
+    return;
+  }
+  RemoteWakeup *w =
+      remote_wakeups_.exchange(nullptr, std::memory_order_acquire);
+  // The list is a stack.  Reverse it so they are run in the order they
+  // came in.
+  RemoteWakeup *list = nullptr;
+  while (w != nullptr) {
+    RemoteWakeup *next = w->next_;
+    w->next_ = list;
+    list = w;
+    w = next;
+  }
+  while (list != nullptr) {
+    RemoteWakeup *next = list->next_;
+    list->Run();
+    list = next;
+  }
 }
 
 void CoroutineScheduler::AddCoroutine(Coroutine *c) {
-  coroutines_.push_back(c);
+  c->prev_ = last_;
+  c->next_ = nullptr;
+  if (last_ == nullptr) {
+    first_ = c;
+  } else {
+    last_->next_ = c;
+  }
+  last_ = c;
+  num_coroutines_++;
+
+  uint32_t id = c->id_;
+  if (id >= states_.size()) {
+    coroutines_by_id_.resize(id + 1);
+    states_.resize(id + 1, Coroutine::State::kCoDead);
+    last_ticks_.resize(id + 1);
+    in_ready_queue_.resize(id + 1);
+  }
+  coroutines_by_id_[id] = c;
+  states_[id] = Coroutine::State::kCoNew;
+  last_ticks_[id] = 0;
+  in_ready_queue_[id] = false;
 }
 
-// Removes a coroutine but doesn't destruct it.  The coroutines's id will
-// be removed and can be reused immediately after the completion callback
-// is called.
+// Removes a coroutine but doesn't destruct it unless the scheduler owns
+// it.  The coroutines's id will be removed and can be reused immediately
+// after the completion callback is called.
 void CoroutineScheduler::RemoveCoroutine(Coroutine *c) {
-  coroutine_ids_.Free(c->Id());
-  last_freed_coroutine_id_ = c->Id();
-
-  for (auto it = coroutines_.begin(); it != coroutines_.end(); it++) {
-    if (*it == c) {
-      coroutines_.erase(it);
-      // Call completion callback to allow for external memory management.
-      if (completion_callback_ != nullptr) {
-        completion_callback_(c);
-      }
-      break;
+  if (!Unlink(c)) {
+    return;
+  }
+  // Call completion callback to allow for external memory management.
+  if (completion_callback_ != nullptr) {
+    completion_callback_(c);
+  }
+  if (c->owned_) {
+    delete c;
+  }
+}
+
+// Take a coroutine out of the list and free its id.  Returns false if it
+// wasn't in the list.
+bool CoroutineScheduler::Unlink(Coroutine *c) {
+  if (c->prev_ == nullptr && first_ != c) {
+    return false;
+  }
+  uint32_t id = c->id_;
+  if (states_[id] == Coroutine::State::kCoWaiting) {
+    ForgetWait(c);
+  }
+  if (in_ready_queue_[id]) {
+    RemoveFromRunQueues(c);
+  }
+  coroutine_ids_.Free(id);
+  last_freed_coroutine_id_ = id;
+  coroutines_by_id_[id] = nullptr;
+  states_[id] = Coroutine::State::kCoDead;
+  in_ready_queue_[id] = false;
+
+  if (c->prev_ == nullptr) {
+    first_ = c->next_;
+  } else {
+    c->prev_->next_ = c->next_;
+  }
+  if (c->next_ == nullptr) {
+    last_ = c->prev_;
+  } else {
+    c->next_->prev_ = c->prev_;
+  }
+  c->prev_ = c->next_ = nullptr;
+  num_coroutines_--;
+  return true;
+}
+
+// Undo the wait of a coroutine that is being destructed before it has
+// exited, so that no fd event or timer refers to it afterwards.
+void CoroutineScheduler::ForgetWait(Coroutine *c) {
+  if (c->async_io_ != nullptr) {
+    // The kernel still owns the operation, which is on the coroutine's
+    // stack.
+    fprintf(stderr, "Coroutine %s destructed during asynchronous I/O\n",
+            c->Name().c_str());
+    abort();
+  }
+  c->EndOfWait();
+  num_waiting_--;
+  completed_io_.erase(
+      std::remove_if(completed_io_.begin(), completed_io_.end(),
+                     [c](const PollEvent &e) { return e.co == c; }),
+      completed_io_.end());
+}
+
+// Take a coroutine out of whichever run queue it is in.  This is only for
+// coroutines that are destructed before they have exited, so it can look
+// through the queues.  The coroutine's priority may have changed since it
+// was queued, so all the classes are searched.
+void CoroutineScheduler::RemoveFromRunQueues(Coroutine *c) {
+  auto is_c = [c](const ChosenCoroutine &e) { return e.co == c; };
+  for (size_t priority = 0; priority < kCoNumPriorities; priority++) {
+    RunQueue &queue = run_queues_[priority];
+    bool triggered;
+    if (auto it = std::find_if(queue.ready.begin(), queue.ready.end(), is_c);
+        it != queue.ready.end()) {
+      triggered = false;
+      queue.ready.erase(it);
+    } else if (auto it = std::find_if(queue.io_ready.begin(),
+                                      queue.io_ready.end(), is_c);
+               it != queue.io_ready.end()) {
+      triggered = true;
+      queue.io_ready.erase(it);
+    } else if (auto it = std::find_if(
+                   queue.deadlines.begin(), queue.deadlines.end(),
+                   [c](const DeadlineEntry &e) { return e.chosen.co == c; });
+               it != queue.deadlines.end()) {
+      triggered = it->chosen.triggered;
+      queue.deadlines.erase(it);
+      std::make_heap(queue.deadlines.begin(), queue.deadlines.end(),
+                     LaterDeadline);
+    } else {
+      continue;
+    }
+    if (--queue.size == 0) {
+      runnable_classes_ &= ~(1U << priority);
+    }
+    if (triggered) {
+      num_io_ready_--;
+    } else {
+      num_ready_--;
     }
+    break;
   }
+  in_ready_queue_[c->id_] = false;
 }
 
 uint32_t CoroutineScheduler::AllocateId() {
@@ -701,22 +1764,61 @@ uint32_t CoroutineScheduler::AllocateId() {
 }
 
 void CoroutineScheduler::Stop() {
+  stop_requested_ = true;
   running_ = false;
   TriggerEvent(interrupt_fd_.fd);
 }
 
+void CoroutineScheduler::SetWatchdog(uint64_t threshold_ns,
+                                     StallCallback callback) {
+  // Stop the old one (waiting for its thread) before starting a new one.
+  watchdog_.reset();
+  if (threshold_ns > 0 && callback != nullptr) {
+    watchdog_ = std::make_unique<Watchdog>(threshold_ns, std::move(callback));
+  }
+}
+
 void CoroutineScheduler::Show() {
-  for (auto *co : coroutines_) {
+  for (Coroutine *co = first_; co != nullptr; co = co->next_) {
     co->Show();
   }
 }
 
 std::vector<std::string> CoroutineScheduler::AllCoroutineStrings() const {
   std::vector<std::string> r;
-  for (auto *co : coroutines_) {
+  for (Coroutine *co = first_; co != nullptr; co = co->next_) {
     r.emplace_back(co->ToString());
   }
   return r;
 }
 
+inline void CoroutineScheduler::StatsPoll(size_t num_fds, size_t num_ready) {
+#if defined(CO_STATS)
+  stats_.polls++;
+  stats_.poll_fds += num_fds;
+  stats_.max_poll_fds = std::max<uint64_t>(stats_.max_poll_fds, num_fds);
+  stats_.ready_fds += num_ready;
+  stats_.max_ready_fds = std::max<uint64_t>(stats_.max_ready_fds, num_ready);
+#else
+  (void)num_fds;
+  (void)num_ready;
+#endif
+}
+
+SchedulerStats CoroutineScheduler::Stats() const {
+#if defined(CO_STATS)
+  return stats_;
+#else
+  return {};
+#endif
+}
+
+std::vector<CoroutineStats> CoroutineScheduler::AllCoroutineStats() const {
+  std::vector<CoroutineStats> r;
+  for (Coroutine *co = first_; co != nullptr; co = co->next_) {
+    r.push_back(co->Stats());
+  }
+  return r;
+}
+
 }  // namespace co
@@ -5,18 +5,18 @@
 #ifndef coroutine_h
 #define coroutine_h
 
-// We have two modes of context switches available.  The most
+// We have three modes of context switches available.  The most
 // portable is using setjmp/longjmp with a little assembly
 // language to switch stacks for the first call.  There is
 // also user contexts which is a System V facility that is
-// available on Linux and other operating systems.
-//
-// TODO: maybe I need to write my own context switching functions
-// if the OS providers are going to remove features.  They seem
-// to be forcing everything into threads, which is the antithesis
-// of coroutines.
+// available on Linux and other operating systems.  The fastest
+// is our own context switching functions, written in assembly
+// language for x86_64 and aarch64, that just save and restore the
+// callee-saved registers.  They don't touch the signal mask, which
+// means they don't make any system calls.
 #define CTX_SETJMP 1
 #define CTX_UCONTEXT 2
+#define CTX_ASM 3
 
 // Apple has deprecated user contexts so we can't use them
 // on MacOS.  Linux still has them and there's an issue with
@@ -26,36 +26,71 @@
 // coroutines.  It's also not possible to suppress the
 // longjmp interception in TSAN, so if you want to make
 // use of TSAN in something that uses coroutines, you have to
-// use user contexts.
-#if defined(__APPLE__)
-#define CTX_MODE CTX_SETJMP
-#include <csetjmp>
+// use user contexts or our own context switches, which tell
+// TSAN about the switches.
+//
+// You can choose the mode by defining CTX_MODE when building
+// (everything, not just this library).
+#if !defined(CTX_MODE)
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CTX_MODE CTX_ASM
 #elif defined(__linux__)
-// Linux supports user contexts.  Let's use them so that tsan works.
 #define CTX_MODE CTX_UCONTEXT
-#include <ucontext.h>
 #else
 // Portable version is setjmp/longjmp
 #define CTX_MODE CTX_SETJMP
+#endif
+#endif
+
+#if CTX_MODE == CTX_SETJMP
 #include <csetjmp>
+#elif CTX_MODE == CTX_UCONTEXT
+#include <ucontext.h>
 #endif
 
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <functional>
-#include <list>
+#include <memory>
+#include <iterator>
+#include <new>
+#include <optional>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Statistics about where the scheduler's time goes (context switches, run
+// and queueing times, poll sizes) are only collected if CO_STATS is defined
+// when building everything.  Without it they cost nothing and the
+// snapshots are all zero.
+#if defined(CO_STATS)
+constexpr bool kCoStatsEnabled = true;
+#else
+constexpr bool kCoStatsEnabled = false;
+#endif
+
 #include "bitset.h"
+#include "buffer_pool.h"
+#include "poller.h"
+#include "stack_pool.h"
+#include "thread_pool.h"
+#include "timer_queue.h"
+#include "watchdog.h"
 
 namespace co {
 
 class CoroutineScheduler;
 class Coroutine;
+class OffloadTask;
 template <typename T>
 class Generator;
 
@@ -67,6 +102,61 @@ using GeneratorFunction = std::function<void(Generator<T> *)>;
 
 constexpr size_t kCoDefaultStackSize = 32 * 1024;
 
+// Maximum number of coroutines whose fds have been triggered that are
+// run after a single poll.
+constexpr size_t kCoDefaultMaxBatchSize = 64;
+
+// Number of threads that run the work given to Coroutine::Offload.
+constexpr size_t kCoDefaultOffloadThreads = 4;
+
+// Scheduling priority classes, highest first.  Runnable coroutines in a
+// higher class are run before those in a lower one, but a class that has
+// runnable coroutines is only passed over a limited number of times in a
+// row (see CoroutineScheduler::SetStarvationLimit).  Within a class the
+// coroutine that has been waiting longest is run first.
+enum class Priority : uint8_t {
+  kHigh,
+  kNormal,
+  kLow,
+};
+constexpr size_t kCoNumPriorities = 3;
+
+// Number of times in a row that a priority class with runnable coroutines
+// can be passed over for higher ones.
+constexpr size_t kCoDefaultStarvationLimit = 16;
+
+// Statistics for one coroutine.  Times are in nanoseconds.  A coroutine is
+// queued when it is runnable (new, yielded or its wait is over) but another
+// one is running.
+struct CoroutineStats {
+  uint32_t id = 0;
+  std::string name;
+  uint64_t switches = 0;      // Number of times it has been resumed.
+  uint64_t run_ns = 0;        // Total time running.
+  uint64_t max_run_ns = 0;    // Longest single run.
+  uint64_t queue_ns = 0;      // Total time queued.
+  uint64_t max_queue_ns = 0;  // Longest single time queued.
+  // The stack's size and the most of it used so far, in bytes.  These
+  // don't need CO_STATS, but the usage is 0 unless the scheduler's
+  // StackPool measures it.
+  size_t stack_size = 0;
+  size_t stack_used = 0;
+};
+
+// Statistics for a scheduler, including coroutines that have exited.
+struct SchedulerStats {
+  uint64_t switches = 0;       // Coroutine resumes.
+  uint64_t run_ns = 0;         // Total time coroutines have been running.
+  uint64_t queue_ns = 0;       // Total time coroutines have been queued.
+  uint64_t max_queue_ns = 0;   // Longest time any coroutine was queued.
+  uint64_t polls = 0;          // Calls to poll (or epoll_wait or kevent).
+  uint64_t poll_fds = 0;       // Sum of the number of fds in each poll.
+  uint64_t max_poll_fds = 0;   // Most fds in one poll.
+  uint64_t ready_fds = 0;      // Sum of the number of ready fds per poll.
+  uint64_t max_ready_fds = 0;  // Most ready fds from one poll.
+  uint64_t timers = 0;         // Timers started for timeouts and sleeps.
+};
+
 extern "C" {
 // This is needed here because it's a friend with C linkage.
 void __co_Invoke(class Coroutine *c);
@@ -75,18 +165,35 @@ void __co_Invoke(class Coroutine *c);
 template <typename T>
 class Generator;
 
-// This is a Coroutine.  It executes its function (pointer to a function
-// or a lambda).
+// This is a Coroutine.  It executes its function (pointer to a function,
+// a lambda or a CoroutineFunction).
 //
-// It has its own stack with default size kCoDefaultStackSize.
-// By default, the coroutine will be given a unique name and will
+// It has its own stack with default size kCoDefaultStackSize.  The stack
+// comes from the scheduler's StackPool and has a guard page below it.
+// The function is moved (or copied) to the top of the stack, so however
+// much a lambda captures, making a coroutine doesn't allocate memory for
+// it.  By default, the coroutine will be given a unique name and will
 // be started automatically.  It can have some user data which is
 // not owned by the coroutine.
 class Coroutine {
  public:
-  Coroutine(CoroutineScheduler &machine, CoroutineFunction function,
+  template <typename F,
+            typename = std::enable_if_t<
+                std::is_invocable_v<std::decay_t<F> &, Coroutine *>>>
+  Coroutine(CoroutineScheduler &machine, F &&function,
             const char *name = nullptr, bool autostart = true,
-            size_t stack_size = kCoDefaultStackSize, void *user_data = nullptr);
+            size_t stack_size = kCoDefaultStackSize, void *user_data = nullptr,
+            Priority priority = Priority::kNormal)
+      : Coroutine(machine, name, stack_size, user_data, priority,
+                  reinterpret_cast<const void *>(&InvokeBody<std::decay_t<F>>),
+                  sizeof(std::decay_t<F>)) {
+    using Body = std::decay_t<F>;
+    static_assert(alignof(Body) <= 16, "coroutine function is overaligned");
+    body_ = new (BodyAddress(sizeof(Body))) Body(std::forward<F>(function));
+    invoke_body_ = &InvokeBody<Body>;
+    destroy_body_ = [](void *body) { static_cast<Body *>(body)->~Body(); };
+    Init(autostart);
+  }
 
   ~Coroutine();
 
@@ -96,7 +203,17 @@ class Coroutine {
   // Yield control to another coroutine.
   void Yield();
 
-  // Call another coroutine and store the result.
+  // Suspend the coroutine until something calls Wake.  These are for
+  // building things like channels on top of coroutines.  Wake must be
+  // called from the coroutine's scheduler's thread and only for a
+  // suspended coroutine.
+  void Suspend();
+  void Wake();
+
+  // Call a generator and return the value it yields.  If it finishes
+  // without yielding one this returns T(), so T must be default
+  // constructible.  Generator::Next doesn't need that and says when the
+  // generator has finished.
   template <typename T>
   T Call(Generator<T> &callee);
 
@@ -116,6 +233,40 @@ class Coroutine {
   // Returns the fd that was triggered, or -1 for a timeout.
   int Wait(const std::vector<struct pollfd> &fds, uint64_t timeout_ns = 0);
 
+  // I/O without waiting for the fd to be ready first.  When the scheduler's
+  // poller can do asynchronous I/O (PollerType::kIoUring) the operation is
+  // handed to the kernel and the coroutine waits for it to complete.  All
+  // the operations started before the scheduler next polls are submitted
+  // together.  Otherwise, or if the kernel says the fd isn't ready, these
+  // wait for the fd and then make the system call.
+  //
+  // They return what the system call would, setting errno on error.  If
+  // the timeout expires first, the result is -1 with errno ETIMEDOUT.
+  ssize_t Read(int fd, void *buffer, size_t length, uint64_t timeout_ns = 0);
+  ssize_t Write(int fd, const void *buffer, size_t length,
+                uint64_t timeout_ns = 0);
+  int Accept(int fd, struct sockaddr *addr, socklen_t *addr_len,
+             int flags = 0);
+  // Returns 0 once connected.  The socket should be non-blocking.
+  int Connect(int fd, const struct sockaddr *addr, socklen_t addr_len);
+#if defined(__linux__)
+  // Like sendfile, sending up to count bytes of in_fd at *offset to out_fd,
+  // which should be non-blocking.  io_uring has no sendfile so this always
+  // waits for out_fd to be writable when it's full.
+  ssize_t SendFile(int out_fd, int in_fd, off_t *offset, size_t count);
+#endif
+
+  // Run function (called with no arguments) on one of the scheduler's
+  // offload threads and return its result.  Only this coroutine waits for
+  // it; the others carry on running.  Use it for anything that would block
+  // the thread, like opening and reading regular files (which Wait always
+  // sees as ready) or compressing and hashing.  The function runs on
+  // another thread, so it must not touch anything that belongs to the
+  // scheduler or its coroutines without locking, and it must not throw.
+  template <typename F>
+  std::invoke_result_t<F &> Offload(F &&function);
+
+  // Terminate the coroutine.  This doesn't return.
   void Exit();
 
   // Sleeping functions.
@@ -128,9 +279,10 @@ class Coroutine {
   }
 
   // Set and get the name.  You can change the name at any time.  It's
-  // only for debug really.
-  void SetName(const std::string &name) { name_ = name; }
-  const std::string &Name() const { return name_; }
+  // only for debug really.  Without one, the name is "co-" followed by the
+  // id, which is only made when it's first asked for.
+  void SetName(const std::string &name) { ChangeName(name); }
+  const std::string &Name() const;
 
   // Set and get the user data (not owned by the coroutine).  It's up
   // to you what this contains and you are responsible for its
@@ -138,10 +290,24 @@ class Coroutine {
   void SetUserData(void *user_data) { user_data_ = user_data; }
   void *UserData() const { return user_data_; }
 
+  // Set and get the scheduling priority class.  A change takes effect the
+  // next time the coroutine becomes runnable.
+  void SetPriority(Priority priority) { priority_ = priority; }
+  Priority GetPriority() const { return priority_; }
+
+  // Set and get the deadline, in nanoseconds on the MonotonicNow clock, or
+  // 0 for none.  When runnable, coroutines with deadlines are run before
+  // the others in their priority class, earliest deadline first.  The
+  // deadline stays until it is changed, so a coroutine that has finished
+  // its urgent work should clear it.  Like the priority, a change takes
+  // effect the next time the coroutine becomes runnable.
+  void SetDeadline(uint64_t deadline_ns) { deadline_ = deadline_ns; }
+  uint64_t Deadline() const { return deadline_; }
+
   // Is the given coroutine alive?
   bool IsAlive() const;
 
-  uint64_t LastTick() const { return last_tick_; }
+  uint64_t LastTick() const;
   CoroutineScheduler &Scheduler() const { return scheduler_; }
 
   void Show() const;
@@ -157,8 +323,11 @@ class Coroutine {
   // this will be the same as that printed by Show().
   std::string ToString() const;
 
+  // A snapshot of the coroutine's statistics.
+  CoroutineStats Stats() const;
+
  private:
-  enum class State {
+  enum class State : uint8_t {
     kCoNew,
     kCoReady,
     kCoRunning,
@@ -171,46 +340,100 @@ class Coroutine {
   friend class Generator;
 
   friend void __co_Invoke(Coroutine *c);
+  // Set up everything but the function, then the context once the
+  // function is on the stack.  The site is what the stack pool counts the
+  // stack usage of unnamed coroutines by.  It's different for each type
+  // of function.  The stack is made big enough for a function of body_size
+  // with at least kMinStackBelowBody under it.
+  Coroutine(CoroutineScheduler &machine, const char *name, size_t stack_size,
+            void *user_data, Priority priority, const void *site,
+            size_t body_size);
+  static constexpr size_t kMinStackBelowBody = 1024;
+  template <typename Body>
+  static void InvokeBody(void *body, Coroutine *c) {
+    (*static_cast<Body *>(body))(c);
+  }
+  void *BodyAddress(size_t size) const;
+  void ChangeName(std::string name) const;
+  void Init(bool autostart);
   void InvokeFunction();
-  int EndOfWait(int timer_fd);
-  int AddTimeout(uint64_t timeout_ns);
-  State GetState() const { return state_; }
+  int EndOfWait();
+  void AddTimeout(uint64_t timeout_ns);
+  void StartTimer(uint64_t ns);
+  void RegisterWaitFds();
+  bool WaitForAsyncIo(AsyncIo &io);
+  void OffloadNonTemplate(OffloadTask &task);
+  // The state and tick count are held by the scheduler.
+  State GetState() const;
+  void SetState(State state);
+  void SetLastTick();
   void AddPollFds(std::vector<struct pollfd> &pollfds,
                   std::vector<Coroutine *> &covec);
   void Resume(int value);
-  void TriggerEvent();
-  void ClearEvent();
   void CallNonTemplate(Coroutine &c);
   void YieldNonTemplate();
+  bool CanTransferTo(const Coroutine &to) const;
+  void TransferTo(Coroutine &to);
+  void SwitchToScheduler();
+#if CTX_MODE == CTX_ASM
+  void SwitchFromScheduler();
+#endif
+  void StatsRunnable(uint64_t now);
+  void StatsStartRun();
+  void StatsEndRun();
 
   std::string MakeDefaultString() const;
 
+  // The fields used on every switch come first so that they share as few
+  // cache lines as possible.  The scheduling state that the scheduler
+  // looks at for all coroutines (state, tick count, whether it's queued)
+  // isn't here at all, it's in the scheduler's arrays.  The names,
+  // functions and, for setjmp and ucontext, the large saved contexts are
+  // at the end.
   CoroutineScheduler &scheduler_;
-  uint32_t id_;                 // Coroutine ID.
-  CoroutineFunction function_;  // Coroutine body.
-  std::string name_;            // Optional name.
-  State state_;
-  void *stack_;                      // Stack, allocated from malloc.
-  void *yielded_address_ = nullptr;  // Address at which we've yielded.
+  uint32_t id_;  // Coroutine ID.
+  int wait_result_;
+#if CTX_MODE == CTX_ASM
+  void *resume_ = nullptr;      // Saved stack pointer for resuming.
+  void *tsan_fiber_ = nullptr;  // Only used when running with TSAN.
+#endif
+  void *stack_;                      // Stack, from the scheduler's pool.
   size_t stack_size_;
+  StackSiteStats *stack_site_ = nullptr;  // Only if measuring stacks.
+  void *yielded_address_ = nullptr;  // Address at which we've yielded.
+  Coroutine *caller_ = nullptr;      // If being called, who is calling us.
+  std::vector<struct pollfd> wait_fds_;  // Pollfds for waiting for an fd.
+  AsyncIo *async_io_ = nullptr;          // Asynchronous I/O being waited for.
+  Timer timer_;                          // Timeout for a wait.
+  bool owned_ = false;                   // Deleted by the scheduler.
+  Priority priority_;
+  uint64_t deadline_ = 0;  // 0 for none.
+
+  // Links in the scheduler's list of coroutines.
+  Coroutine *prev_ = nullptr;
+  Coroutine *next_ = nullptr;
+
+  // Cold: only used when starting, for debug and for statistics.
+  void *body_ = nullptr;  // The function, at the top of the stack.
+  void (*invoke_body_)(void *body, Coroutine *c) = nullptr;
+  void (*destroy_body_)(void *body) = nullptr;
+  mutable std::string name_;  // Made when first needed if not given.
+  void *user_data_;           // User data, not owned by this.
+
+  // Function used to create a string for this coroutine.
+  std::function<std::string()> to_string_callback_;
+
 #if CTX_MODE == CTX_SETJMP
   jmp_buf resume_;  // Program environemnt for resuming.
-  jmp_buf exit_;    // Program environemt to exit.
-#else
+#elif CTX_MODE == CTX_UCONTEXT
   ucontext_t resume_;
-  ucontext_t exit_;
 #endif
-  int wait_result_;
-  bool first_resume_ = true;
 
-  struct pollfd event_fd_;               // Pollfd for event.
-  std::vector<struct pollfd> wait_fds_;  // Pollfds for waiting for an fd.
-  Coroutine *caller_ = nullptr;          // If being called, who is calling us.
-  void *user_data_;                      // User data, not owned by this.
-  uint64_t last_tick_ = 0;               // Tick count of last resume.
-
-  // Function used to create a string for this coroutine.
-  std::function<std::string()> to_string_callback_;
+#if defined(CO_STATS)
+  CoroutineStats stats_;
+  uint64_t runnable_since_ = 0;  // When it was last queued, 0 if not.
+  uint64_t resumed_at_ = 0;      // When it was last resumed, 0 if not.
+#endif
 };
 
 // A Generator is a coroutine that generates values.  The magic lamda line
@@ -219,6 +442,16 @@ class Coroutine {
 //
 // A generator doesn't start automatically.  It's started on the
 // first call.
+//
+// Values are moved (or copied if they are lvalues) straight into a
+// std::optional belonging to the caller, so T doesn't need to be default
+// constructible and nothing is copied more than it has to be.  A running
+// coroutine can get the values one at a time with Next or go through them
+// all with a range for loop:
+//
+//   for (std::string &line : lines) {
+//     ...
+//   }
 template <typename T>
 class Generator : public Coroutine {
  public:
@@ -230,15 +463,95 @@ class Generator : public Coroutine {
                     gen_function_(reinterpret_cast<Generator<T> *>(c));
                   },
                   name, /*autostart=*/false, stack_size, user_data),
-        gen_function_(function) {}
+        gen_function_(std::move(function)) {}
 
-  // Yield control and store value.
+  // Yield control and give the value to the caller.
   void YieldValue(const T &value);
+  void YieldValue(T &&value);
+
+  // Call the generator from the running coroutine and return the value it
+  // yields, or nothing if it has finished.  This must be called from a
+  // coroutine in the same scheduler.
+  std::optional<T> Next();
+
+  // Iteration over the values, calling the generator from the running
+  // coroutine each time the iterator is advanced.  The value referred to
+  // by the iterator is valid until the iterator is advanced.
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T *;
+    using reference = T &;
+
+    Iterator() = default;
+    T &operator*() const { return *generator_->value_; }
+    T *operator->() const { return &*generator_->value_; }
+    Iterator &operator++() {
+      if (!generator_->Advance()) {
+        generator_ = nullptr;
+      }
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(const Iterator &other) const {
+      return generator_ == other.generator_;
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+   private:
+    friend class Generator;
+    explicit Iterator(Generator *generator) : generator_(generator) {}
+    Generator *generator_ = nullptr;  // nullptr at the end.
+  };
+
+  Iterator begin() { return Iterator(Advance() ? this : nullptr); }
+  Iterator end() { return Iterator(); }
 
  private:
   friend class Coroutine;
+  // Call from caller, putting the value (if any) in result.
+  void CallFrom(Coroutine *caller, std::optional<T> &result);
+  bool Advance();
+
   GeneratorFunction<T> gen_function_;
-  T *result_ = nullptr;  // Where to put result in YieldValue.
+  std::optional<T> *result_ = nullptr;  // Where YieldValue puts the value.
+  std::optional<T> value_;              // Current value when iterating.
+};
+
+// Another thread can ask a scheduler to call Run in the scheduler's own
+// thread using CoroutineScheduler::WakeFromAnotherThread.  The object must
+// not be passed again until its Run has been called.
+class RemoteWakeup {
+ public:
+  virtual ~RemoteWakeup() = default;
+  virtual void Run() = 0;
+
+ private:
+  friend class CoroutineScheduler;
+  RemoteWakeup *next_ = nullptr;
+};
+
+// Work given to the offload threads by Coroutine::Offload.  Work is called
+// on an offload thread, then the coroutine is woken in its own scheduler's
+// thread.
+class OffloadTask : public ThreadPool::Task, public RemoteWakeup {
+ public:
+  explicit OffloadTask(Coroutine *c) : co_(c) {}
+
+  void Execute() final;
+  void Run() final;
+
+  // Set in the coroutine's thread just before it is woken.
+  bool Done() const { return done_; }
+
+ protected:
+  virtual void Work() = 0;
+
+ private:
+  Coroutine *co_;
+  bool done_ = false;
 };
 
 struct PollState {
@@ -246,31 +559,85 @@ struct PollState {
   std::vector<Coroutine *> coroutines;
 };
 
+// What has changed since the last call to GetPollChanges.
+struct PollChanges {
+  std::vector<PollChange> changes;
+  // How long the caller's poll can wait before calling RunReady.  -1 means
+  // forever (until an fd is ready) and 0 means don't wait.
+  int64_t timeout_ns = -1;
+};
+
 class CoroutineScheduler {
  public:
-  CoroutineScheduler();
+  // The poller type specifies how the scheduler waits for fds.  If the
+  // type isn't available, ::poll is used.
+  CoroutineScheduler(PollerType poller_type = PollerType::kDefault);
   ~CoroutineScheduler();
 
   // Run the scheduler until all coroutines have terminated or
   // told to stop.
   void Run();
 
-  // Stop the scheduler.  Running coroutines will not be terminated.
+  // Stop the scheduler.  Running coroutines will not be terminated.  This
+  // can be called from any thread.  If the scheduler isn't running, the next
+  // call to Run will return immediately.
   void Stop();
 
+  // Make a coroutine that belongs to the scheduler.  It starts running
+  // when the scheduler gets to it and is deleted by the scheduler when it
+  // exits, after the completion callback has been called.  Any that
+  // haven't exited when the scheduler is destructed are deleted then.
+  // There is no need to keep track of them yourself.
+  template <typename F>
+  Coroutine *Spawn(F &&function, const char *name = nullptr,
+                   size_t stack_size = kCoDefaultStackSize,
+                   void *user_data = nullptr,
+                   Priority priority = Priority::kNormal) {
+    Coroutine *c =
+        new Coroutine(*this, std::forward<F>(function), name,
+                      /*autostart=*/true, stack_size, user_data, priority);
+    c->owned_ = true;
+    return c;
+  }
+
   void AddCoroutine(Coroutine *c);
   void RemoveCoroutine(Coroutine *c);
   void StartCoroutine(Coroutine *c);
 
+  // Number of coroutines that haven't exited.
+  size_t NumCoroutines() const { return num_coroutines_; }
+
   // When you don't want to use the Run function, these
   // functions allow you to incorporate the multiplexed
-  // IO into your own poll loop.
+  // IO into your own poll loop.  The poll state is rebuilt from all the
+  // coroutines by every call, so for large numbers of them use the
+  // functions below instead.
   void GetPollState(PollState *poll_state);
   void ProcessPoll(PollState *poll_state);
 
+  // Embedding the scheduler in an event loop that keeps its own set of fds
+  // (an epoll set, say), at a cost that depends on how much happens rather
+  // than on the number of coroutines.  Before each poll, call
+  // GetPollChanges and apply the changes to the set (an fd with events of
+  // 0 is to be removed; it may have been closed already).  Poll the set
+  // along with WakeFd for POLLIN, level triggered, waiting for no longer
+  // than the timeout.  Pass each of the scheduler's fds that is ready
+  // (WakeFd too) to ProcessReadyFd, then call RunReady to run up to budget
+  // runnable coroutines.  It returns how many it ran.
+  void GetPollChanges(PollChanges *changes);
+  int WakeFd() const { return interrupt_fd_.fd; }
+  void ProcessReadyFd(int fd, short revents);
+  size_t RunReady(size_t budget);
+
   // Print the state of all the coroutines to stderr.
   void Show();
 
+  // Call w->Run() in this scheduler's thread as soon as it is next in
+  // control.  This is safe to call from any thread.  Many calls made
+  // before the scheduler gets round to them cost one write to the
+  // interrupt fd.
+  void WakeFromAnotherThread(RemoteWakeup *w);
+
   // Call the given function when a coroutine exits.
   // You can use this to delete the coroutine.
   void SetCompletionCallback(CompletionCallback callback) {
@@ -281,65 +648,276 @@ class CoroutineScheduler {
   // coroutines.
   std::vector<std::string> AllCoroutineStrings() const;
 
+  // Snapshots of the statistics for the scheduler and for all the
+  // coroutines.  These are all zero unless built with CO_STATS.
+  SchedulerStats Stats() const;
+  std::vector<CoroutineStats> AllCoroutineStats() const;
+
+  // The pool from which coroutine stacks are allocated.
+  StackPool &Stacks() { return stacks_; }
+
+  // The pool from which I/O buffers (for BufferedReader and BufferedWriter)
+  // are allocated.
+  BufferPool &Buffers() { return buffers_; }
+
+  // Watch for coroutines that run for longer than threshold_ns without
+  // giving up control, calling the callback (on another thread) when one
+  // is found.  A threshold of 0 turns the watchdog off.  Call this before
+  // Run or from a coroutine in this scheduler.
+  void SetWatchdog(uint64_t threshold_ns, StallCallback callback);
+
+  // Which type of poller is being used?
+  PollerType GetPollerType() const { return poller_->Type(); }
+
+  // The number of offload threads (see Coroutine::Offload).  The threads
+  // are started when the first work is offloaded, so this has to be called
+  // before then.
+  void SetOffloadThreads(size_t num_threads) {
+    offload_threads_ = num_threads;
+  }
+
+  // After a poll, all the coroutines whose fds have been triggered are run
+  // in turn, longest waiting first, before polling again.  This sets the
+  // maximum number of them that will be run for one poll.  Others will be
+  // picked up by the next poll.  It is also how many ready coroutines run
+  // between polls while others are waiting for fds.  A value of 1 means
+  // that the scheduler polls before running each coroutine.
+  void SetMaxBatchSize(size_t n) { max_batch_size_ = n == 0 ? 1 : n; }
+  size_t MaxBatchSize() const { return max_batch_size_; }
+
+  // The number of times in a row that a priority class with runnable
+  // coroutines can be passed over for higher ones.  When it has been, one
+  // of its coroutines is run next, so however busy the higher classes are
+  // each class gets at least one run in every n + 1 or so.
+  void SetStarvationLimit(size_t n) { starvation_limit_ = n == 0 ? 1 : n; }
+  size_t StarvationLimit() const { return starvation_limit_; }
+
  private:
   friend class Coroutine;
   template <typename T>
   friend class Generator;
+  // An entry in the ready queues.  The tick count is the coroutine's when
+  // it was queued (it can't change until it runs) so that the queues can be
+  // ordered without looking at the coroutines.
   struct ChosenCoroutine {
     ChosenCoroutine() = default;
-    ChosenCoroutine(Coroutine *c, int f) : co(c), fd(f) {}
+    ChosenCoroutine(Coroutine *c, int f, uint64_t t) : co(c), fd(f), tick(t) {}
     Coroutine *co = nullptr;
     int fd = 0x12345678;
+    bool triggered = false;  // Queued by a poll rather than made runnable.
+    uint64_t tick = 0;
   };
 
-  void BuildPollFds(PollState *poll_state);
-  ChosenCoroutine ChooseRunnable(PollState *poll_state, int num_ready);
+  // An entry in a deadline heap, with the coroutine's deadline when it was
+  // queued.
+  struct DeadlineEntry {
+    uint64_t deadline;
+    ChosenCoroutine chosen;
+  };
+
+  // The runnable coroutines in one priority class.
+  struct RunQueue {
+    // Coroutines that are ready to run without waiting for any fds, in the
+    // order in which they became ready.
+    std::deque<ChosenCoroutine> ready;
+    // Coroutines whose fds were triggered by the last poll, longest
+    // waiting first.
+    std::deque<ChosenCoroutine> io_ready;
+    // Coroutines with deadlines, however they became runnable.  This is a
+    // heap with the earliest deadline at the front.
+    std::vector<DeadlineEntry> deadlines;
+    size_t size = 0;  // Entries in all three.
+    // Times in a row a higher class has been chosen instead of this one.
+    size_t passed_over = 0;
+  };
 
-  ChosenCoroutine GetRunnableCoroutine(PollState *poll_state, int num_ready);
+  void BuildPollFds(PollState *poll_state);
+  void QueueTriggered(const std::vector<PollEvent> &events);
+  bool TakeInterrupt(std::vector<PollEvent> &events);
+  int64_t NextTimeout() const;
+  void AddCompletedIo(std::vector<PollEvent> &events);
+  void AddExpiredTimers(std::vector<PollEvent> &events);
+  void ResumeCoroutine(const ChosenCoroutine &c);
+
+  ChosenCoroutine ChooseNext();
+  size_t ChooseClass();
+  size_t ChooseStarvedClass();
+  static bool LaterDeadline(const DeadlineEntry &a, const DeadlineEntry &b);
+  void Enqueue(const ChosenCoroutine &c);
+  void PushDeadline(RunQueue &queue, const ChosenCoroutine &c);
+  void PopDeadline(RunQueue &queue, ChosenCoroutine &chosen);
+  void MakeRunnable(Coroutine *c);
+  void ReapExited();
+  void RunRemoteWakeups();
+  bool Unlink(Coroutine *c);
+  void ForgetWait(Coroutine *c);
+  void RemoveFromRunQueues(Coroutine *c);
   uint32_t AllocateId();
+  void StatsPoll(size_t num_fds, size_t num_ready);
   uint64_t TickCount() const { return tick_count_; }
   bool IdExists(uint32_t id) const { return coroutine_ids_.Contains(id); }
 #if CTX_MODE == CTX_SETJMP
   jmp_buf &YieldBuf() { return yield_; }
-#else
+#elif CTX_MODE == CTX_UCONTEXT
   ucontext_t *YieldCtx() { return &yield_; }
 #endif
 
-  std::list<Coroutine *> coroutines_;
+  // These are first so that they are destructed after everything else.
+  StackPool stacks_;
+  BufferPool buffers_;
+  // All the coroutines, in the order they were made.  This is an
+  // intrusive list so that a coroutine can be removed in constant time.
+  Coroutine *first_ = nullptr;
+  Coroutine *last_ = nullptr;
+  size_t num_coroutines_ = 0;
+  // The scheduling state of each coroutine, indexed by id.  This is here
+  // in arrays rather than in the coroutines so that the scheduler's passes
+  // over it read a few contiguous cache lines instead of one or two from
+  // each coroutine.  Ids are reused lowest first so the arrays stay dense.
+  std::vector<Coroutine *> coroutines_by_id_;
+  std::vector<Coroutine::State> states_;
+  std::vector<uint64_t> last_ticks_;      // Tick count of last switch out.
+  std::vector<uint8_t> in_ready_queue_;  // In one of the ready queues.
+  // The runnable coroutines, by priority class, and the numbers of them
+  // that were made runnable and that were triggered by a poll.  Bit n of
+  // runnable_classes_ is set if class n has any.
+  std::array<RunQueue, kCoNumPriorities> run_queues_;
+  uint32_t runnable_classes_ = 0;
+  size_t num_ready_ = 0;
+  size_t num_io_ready_ = 0;
+  std::vector<ChosenCoroutine> triggered_;
+  // Completed asynchronous I/O that didn't fit in the last batch.  Unlike
+  // fds, these won't be triggered again by the next poll.
+  std::vector<PollEvent> completed_io_;
+  size_t max_batch_size_ = kCoDefaultMaxBatchSize;
+  size_t runs_since_poll_ = 0;  // Coroutines run by Run since it polled.
+  size_t starvation_limit_ = kCoDefaultStarvationLimit;
+  int num_waiting_ = 0;  // Number of coroutines waiting for fds.
+  Coroutine *exited_ = nullptr;  // Coroutine that has just exited.
+  Coroutine *current_ = nullptr;  // Coroutine that is running.
   BitSet coroutine_ids_;
   uint32_t last_freed_coroutine_id_ = -1U;
 #if CTX_MODE == CTX_SETJMP
   jmp_buf yield_;
-#else
+#elif CTX_MODE == CTX_UCONTEXT
   ucontext_t yield_;
+#else
+  void *yield_ = nullptr;       // Saved stack pointer of the scheduler.
+  void *tsan_fiber_ = nullptr;  // Only used when running with TSAN.
 #endif
-  bool running_ = false;
-  PollState poll_state_;
+  std::atomic<bool> running_{false};
+  std::atomic<bool> stop_requested_{false};  // Stop called before Run.
+  std::unique_ptr<Poller> poller_;
+  std::vector<PollEvent> poll_events_;
   struct pollfd interrupt_fd_;
+  std::atomic<RemoteWakeup *> remote_wakeups_{nullptr};  // A stack.
+  TimerQueue timers_;  // Timers for all waiting coroutines.
+  int timer_fd_ = -1;  // Only used by GetPollState.
+  uint64_t timer_fd_deadline_ = 0;
+  int async_io_fd_ = -1;  // Told to the caller by GetPollChanges.
   uint64_t tick_count_ = 0;
   CompletionCallback completion_callback_;
+  std::unique_ptr<Watchdog> watchdog_;  // Only if SetWatchdog was called.
+  size_t offload_threads_ = kCoDefaultOffloadThreads;
+  std::unique_ptr<ThreadPool> offload_pool_;  // Made when first used.
+#if defined(CO_STATS)
+  SchedulerStats stats_;
+#endif
 };
 
+inline Coroutine::State Coroutine::GetState() const {
+  return scheduler_.states_[id_];
+}
+
+inline void Coroutine::SetState(State state) {
+  scheduler_.states_[id_] = state;
+}
+
+inline uint64_t Coroutine::LastTick() const {
+  return scheduler_.last_ticks_[id_];
+}
+
+inline void Coroutine::SetLastTick() {
+  scheduler_.last_ticks_[id_] = scheduler_.tick_count_;
+}
+
 template <typename T>
 inline void Generator<T>::YieldValue(const T &value) {
-  // Copy value.
   if (result_ != nullptr) {
-    *result_ = value;
+    result_->emplace(value);
   }
   YieldNonTemplate();
 }
 
 template <typename T>
-inline T Coroutine::Call(Generator<T> &callee) {
-  T result;
+inline void Generator<T>::YieldValue(T &&value) {
+  if (result_ != nullptr) {
+    result_->emplace(std::move(value));
+  }
+  YieldNonTemplate();
+}
+
+template <typename T>
+inline void Generator<T>::CallFrom(Coroutine *caller,
+                                   std::optional<T> &result) {
+  result.reset();
+  if (!IsAlive()) {
+    return;
+  }
   // Tell the callee that it's being called and where to store the value.
-  callee.caller_ = this;
-  callee.result_ = &result;
-  CallNonTemplate(callee);
+  caller_ = caller;
+  result_ = &result;
+  caller->CallNonTemplate(*this);
   // Call done.  No result now.
-  callee.result_ = nullptr;
+  result_ = nullptr;
+}
+
+template <typename T>
+inline std::optional<T> Generator<T>::Next() {
+  std::optional<T> result;
+  CallFrom(Scheduler().current_, result);
   return result;
 }
 
+template <typename T>
+inline bool Generator<T>::Advance() {
+  CallFrom(Scheduler().current_, value_);
+  return value_.has_value();
+}
+
+template <typename T>
+inline T Coroutine::Call(Generator<T> &callee) {
+  std::optional<T> result;
+  callee.CallFrom(this, result);
+  if (result.has_value()) {
+    return std::move(*result);
+  }
+  return T();
+}
+
+template <typename F>
+inline std::invoke_result_t<F &> Coroutine::Offload(F &&function) {
+  using R = std::invoke_result_t<F &>;
+  static_assert(!std::is_reference_v<R>,
+                "offloaded functions must return a value");
+  struct Task : public OffloadTask {
+    Task(Coroutine *c, F &f) : OffloadTask(c), function(f) {}
+    void Work() override {
+      if constexpr (std::is_void_v<R>) {
+        function();
+      } else {
+        result.emplace(function());
+      }
+    }
+    F &function;
+    std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result{};
+  };
+  Task task(this, function);
+  OffloadNonTemplate(task);
+  if constexpr (!std::is_void_v<R>) {
+    return std::move(*task.result);
+  }
+}
+
 }  // namespace co
 #endif /* coroutine_h */
@@ -0,0 +1,138 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Checks for corners of the scheduler: coroutines that are destructed
+// before they have exited and generators called while they are waiting.
+// Prints what fails and exits with 1 if anything does.  Use of a
+// destructed coroutine is best found by building with ASAN.
+
+#include <unistd.h>
+
+#include "check.h"
+#include "coroutine.h"
+
+using namespace co;
+
+// Destructed while waiting for an fd with a timeout.  Neither the fd nor
+// the timer may resume it.
+static void DestroyWaiting() {
+  CoroutineScheduler scheduler;
+  int pipes[2];
+  CHECK(pipe(pipes) == 0);
+  bool resumed = false;
+  Coroutine *waiter = new Coroutine(scheduler, [&](Coroutine *c) {
+    c->Wait(pipes[0], POLLIN, 1000000);
+    resumed = true;
+  });
+  Coroutine killer(scheduler, [&](Coroutine *c) {
+    c->Yield();  // Let the waiter wait.
+    delete waiter;
+    CHECK(write(pipes[1], "x", 1) == 1);
+    c->Millisleep(5);  // Past the waiter's timeout.
+  });
+  scheduler.Run();
+  CHECK(!resumed);
+  CHECK(scheduler.NumCoroutines() == 0);
+  close(pipes[0]);
+  close(pipes[1]);
+}
+
+// Destructed after a poll has triggered it and before it has run.  The
+// killer moves to a higher class so it runs first.
+static void DestroyTriggered() {
+  CoroutineScheduler scheduler;
+  int waiter_pipes[2];
+  int killer_pipes[2];
+  CHECK(pipe(waiter_pipes) == 0);
+  CHECK(pipe(killer_pipes) == 0);
+  bool resumed = false;
+  Coroutine *waiter = new Coroutine(scheduler, [&](Coroutine *c) {
+    c->Wait(waiter_pipes[0], POLLIN);
+    resumed = true;
+  });
+  Coroutine killer(scheduler, [&](Coroutine *c) {
+    c->Yield();  // Let the waiter wait.
+    c->SetPriority(Priority::kHigh);
+    CHECK(write(waiter_pipes[1], "x", 1) == 1);
+    CHECK(write(killer_pipes[1], "x", 1) == 1);
+    c->Wait(killer_pipes[0], POLLIN);
+    delete waiter;
+    c->Millisleep(1);
+  });
+  scheduler.Run();
+  CHECK(!resumed);
+  CHECK(scheduler.NumCoroutines() == 0);
+  for (int fd : {waiter_pipes[0], waiter_pipes[1], killer_pipes[0],
+                 killer_pipes[1]}) {
+    close(fd);
+  }
+}
+
+// Destructed while in the run queues, with and without a deadline.  The
+// killer is in a higher class so the victim never gets to run.
+static void DestroyRunnable(uint64_t deadline) {
+  CoroutineScheduler scheduler;
+  int runs = 0;
+  Coroutine *victim = new Coroutine(
+      scheduler,
+      [&](Coroutine *c) {
+        for (;;) {
+          runs++;
+          c->Yield();
+        }
+      },
+      nullptr, /*autostart=*/false);
+  victim->SetDeadline(deadline);
+  victim->Start();
+  Coroutine killer(
+      scheduler,
+      [&](Coroutine *c) {
+        delete victim;
+        // Something still has to be scheduled afterwards.
+        c->Yield();
+        c->Millisleep(1);
+      },
+      nullptr, true, kCoDefaultStackSize, nullptr, Priority::kHigh);
+  scheduler.Run();
+  CHECK(runs == 0);
+  CHECK(scheduler.NumCoroutines() == 0);
+}
+
+// A generator called again while it is waiting for an fd, because its
+// caller was woken by something else.  The call mustn't end the wait.
+static void CallWaiting() {
+  CoroutineScheduler scheduler;
+  int pipes[2];
+  CHECK(pipe(pipes) == 0);
+  int wait_result = 0;
+  Generator<int> generator(scheduler, [&](Generator<int> *g) {
+    wait_result = g->Wait(pipes[0], POLLIN, 1000000000);
+    g->YieldValue(1);
+  });
+  Coroutine caller(scheduler, [&](Coroutine *c) {
+    // Woken by the other coroutine before the generator has a value.
+    CHECK(c->Call(generator) == 0);
+    CHECK(c->Call(generator) == 1);
+    c->Call(generator);  // Let it finish.
+  });
+  Coroutine other(scheduler, [&](Coroutine *c) {
+    c->Yield();  // Let the generator wait.
+    caller.Wake();
+    c->Millisleep(1);
+    CHECK(write(pipes[1], "x", 1) == 1);
+  });
+  scheduler.Run();
+  CHECK(wait_result == pipes[0]);
+  close(pipes[0]);
+  close(pipes[1]);
+}
+
+int main() {
+  DestroyWaiting();
+  DestroyTriggered();
+  DestroyRunnable(0);
+  DestroyRunnable(MonotonicNow() + 1000000000);
+  CallWaiting();
+  return co::CheckResult("coroutine_test");
+}
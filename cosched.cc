@@ -0,0 +1,158 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Measures the cost of the scheduler's loop with large numbers of
+// coroutines:
+//
+// yield:    every coroutine yields in turn, so each resume goes through
+//           the ready queue.
+// idle:     two coroutines yield to each other while all the others are
+//           asleep, waiting for timers that never expire.
+// pollfds:  GetPollState (used to embed the scheduler in another poll loop)
+//           with all the coroutines waiting.
+// changes:  GetPollChanges (the incremental way to embed it) with all the
+//           coroutines waiting.  Each op is a call, so this doesn't depend
+//           on the number of coroutines.
+//
+// Usage: cosched [number of coroutines...]  The default is 10000 and
+// 100000.  Each coroutine takes two memory mappings (its stack and guard
+// page) so 100000 of them need vm.max_map_count raised above the usual
+// 65530 on Linux.  Sizes that need more mappings than that are skipped.
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "coroutine.h"
+
+using namespace co;
+
+static constexpr size_t kStackSize = 16 * 1024;
+
+static void PrintResult(const char *test, int n, uint64_t elapsed,
+                        uint64_t ops) {
+  printf("%-8s %7d coroutines: %10llu ops in %9.3f ms, %7.1f ns per op\n",
+         test, n, static_cast<unsigned long long>(ops), elapsed / 1e6,
+         static_cast<double>(elapsed) / ops);
+}
+
+static void Yield(int n) {
+  constexpr int kRounds = 20;
+  CoroutineScheduler scheduler;
+  for (int i = 0; i < n; i++) {
+    scheduler.Spawn(
+        [](Coroutine *c) {
+          for (int j = 0; j < kRounds; j++) {
+            c->Yield();
+          }
+        },
+        nullptr, kStackSize);
+  }
+  uint64_t start = MonotonicNow();
+  scheduler.Run();
+  PrintResult("yield", n, MonotonicNow() - start,
+              static_cast<uint64_t>(n) * (kRounds + 1));
+}
+
+static void Idle(int n) {
+  constexpr int kYields = 200000;
+  CoroutineScheduler scheduler;
+  for (int i = 0; i < n; i++) {
+    scheduler.Spawn([](Coroutine *c) { c->Sleep(3600); }, nullptr,
+                    kStackSize);
+  }
+  uint64_t start = 0;
+  int done = 0;
+  auto ping_pong = [&](Coroutine *c) {
+    if (start == 0) {
+      start = MonotonicNow();
+    }
+    for (int i = 0; i < kYields; i++) {
+      c->Yield();
+    }
+    if (++done == 2) {
+      c->Scheduler().Stop();
+    }
+  };
+  scheduler.Spawn(ping_pong, "ping", kStackSize);
+  scheduler.Spawn(ping_pong, "pong", kStackSize);
+  scheduler.Run();
+  PrintResult("idle", n, MonotonicNow() - start, 2 * kYields);
+}
+
+static void PollFds(int n) {
+  constexpr int kPolls = 200;
+  CoroutineScheduler scheduler;
+  scheduler.SetMaxBatchSize(n);
+  for (int i = 0; i < n; i++) {
+    scheduler.Spawn([](Coroutine *c) { c->Sleep(3600); }, nullptr,
+                    kStackSize);
+  }
+  // Run them all until they are asleep.
+  PollState state;
+  scheduler.GetPollState(&state);
+  ::poll(state.pollfds.data(), state.pollfds.size(), 0);
+  scheduler.ProcessPoll(&state);
+
+  uint64_t start = MonotonicNow();
+  for (int i = 0; i < kPolls; i++) {
+    scheduler.GetPollState(&state);
+  }
+  PrintResult("pollfds", n, MonotonicNow() - start,
+              static_cast<uint64_t>(n) * kPolls);
+}
+
+static void Changes(int n) {
+  constexpr int kPolls = 200;
+  CoroutineScheduler scheduler;
+  for (int i = 0; i < n; i++) {
+    scheduler.Spawn([](Coroutine *c) { c->Sleep(3600); }, nullptr,
+                    kStackSize);
+  }
+  // Run them all until they are asleep.  The first call reports every fd.
+  PollChanges changes;
+  scheduler.GetPollChanges(&changes);
+  scheduler.RunReady(n);
+
+  uint64_t start = MonotonicNow();
+  for (int i = 0; i < kPolls; i++) {
+    scheduler.GetPollChanges(&changes);
+  }
+  PrintResult("changes", n, MonotonicNow() - start, kPolls);
+}
+
+// Each coroutine's stack takes two memory mappings, and Linux limits the
+// number a process can have.
+static bool EnoughMappings(int coroutines) {
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  if (f == nullptr) {
+    return true;
+  }
+  long max = 0;
+  bool ok = fscanf(f, "%ld", &max) != 1 || max > 2L * coroutines + 1000;
+  fclose(f);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  std::vector<int> sizes;
+  for (int i = 1; i < argc; i++) {
+    sizes.push_back(atoi(argv[i]));
+  }
+  if (sizes.empty()) {
+    sizes = {10000, 100000};
+  }
+  for (int n : sizes) {
+    if (!EnoughMappings(n)) {
+      printf("skipping %d coroutines: vm.max_map_count is too low\n", n);
+      continue;
+    }
+    Yield(n);
+    Idle(n);
+    PollFds(n);
+    Changes(n);
+  }
+}
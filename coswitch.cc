@@ -0,0 +1,54 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Measures the cost of a context switch.  Two coroutines yield to each
+// other through the scheduler, so each Yield is a switch out of the
+// coroutine and a switch back into the other one.
+//
+// Build with CTX_MODE set to CTX_SETJMP (1), CTX_UCONTEXT (2) or
+// CTX_ASM (3) to compare the modes.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "coroutine.h"
+
+using namespace co;
+
+static const char *ModeName() {
+  switch (CTX_MODE) {
+    case CTX_SETJMP:
+      return "setjmp";
+    case CTX_UCONTEXT:
+      return "ucontext";
+    case CTX_ASM:
+      return "asm";
+  }
+  return "unknown";
+}
+
+int main(int argc, char **argv) {
+  int iterations = 1000000;
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+  CoroutineScheduler scheduler;
+  auto func = [iterations](Coroutine *c) {
+    for (int i = 0; i < iterations; i++) {
+      c->Yield();
+    }
+  };
+  Coroutine c1(scheduler, func, "c1");
+  Coroutine c2(scheduler, func, "c2");
+
+  uint64_t start = MonotonicNow();
+  scheduler.Run();
+  uint64_t elapsed = MonotonicNow() - start;
+
+  // Each yield is two context switches, one to the scheduler and one
+  // to the other coroutine.
+  double switches = 4.0 * iterations;
+  printf("%s: %d yields in %.3f ms, %.1f ns per switch\n", ModeName(),
+         2 * iterations, elapsed / 1e6, elapsed / switches);
+}
@@ -0,0 +1,92 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef histogram_h
+#define histogram_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A histogram of latencies (or any other non-negative integers) with
+// log-linear buckets, like an HDR histogram.  Each power of two is split
+// into kSubBuckets linear buckets, so a value is recorded with a relative
+// error of at most 1/kSubBuckets (about 1.6%) whatever its size, in a fixed
+// amount of memory.  Recording a value is a few instructions and never
+// allocates.
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 6;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+  LatencyHistogram() : counts_((64 - kSubBucketBits + 1) * kSubBuckets) {}
+
+  void Record(uint64_t value) {
+    counts_[Index(value)]++;
+    count_++;
+    sum_ += value;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Min() const { return count_ == 0 ? 0 : min_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const {
+    return count_ == 0 ? 0 : static_cast<double>(sum_) / count_;
+  }
+
+  // The value that percentile (0 to 100) of the recorded values are less
+  // than or equal to, by the nearest-rank method.  This is the highest
+  // value in the bucket it falls in, but no more than the maximum recorded.
+  uint64_t Percentile(double percentile) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    // Multiplying first keeps whole percentiles of whole counts exact.
+    uint64_t rank =
+        static_cast<uint64_t>(std::ceil(percentile * count_ / 100.0));
+    rank = std::max<uint64_t>(1, std::min(rank, count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(HighestValue(i), max_);
+      }
+    }
+    return max_;
+  }
+
+ private:
+  // Values below kSubBuckets have a bucket each.  Above that, the top
+  // kSubBucketBits bits after the leading one pick the bucket within the
+  // power of two.
+  static size_t Index(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+  }
+
+  static uint64_t HighestValue(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    int shift = static_cast<int>(index / kSubBuckets) - 1;
+    uint64_t sub = index % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
+
+#endif  // histogram_h
@@ -0,0 +1,125 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Checks for LatencyHistogram, against the exact percentiles of the same
+// values.  Prints what fails and exits with 1 if anything does.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "http_client/histogram.h"
+
+// The exact value for a percentile by the nearest-rank method: the
+// smallest value that at least that percentage of the values are less than
+// or equal to.
+static uint64_t ExactPercentile(const std::vector<uint64_t> &sorted,
+                                double percentile) {
+  size_t rank = 1;
+  while (rank < sorted.size() && rank * 100.0 < percentile * sorted.size()) {
+    rank++;
+  }
+  return sorted[rank - 1];
+}
+
+// Is a value from the histogram no lower than the exact one and within its
+// relative error?
+static bool WithinError(uint64_t got, uint64_t exact) {
+  if (got < exact) {
+    return false;
+  }
+  return static_cast<double>(got - exact) <=
+         static_cast<double>(exact) / LatencyHistogram::kSubBuckets;
+}
+
+static void Empty() {
+  LatencyHistogram h;
+  CHECK(h.Count() == 0);
+  CHECK(h.Min() == 0);
+  CHECK(h.Max() == 0);
+  CHECK(h.Mean() == 0);
+  CHECK(h.Percentile(50) == 0);
+}
+
+// Values below the number of sub-buckets have a bucket each, so they come
+// out exactly.
+static void SmallValues() {
+  LatencyHistogram h;
+  std::vector<uint64_t> values;
+  for (uint64_t v = 0; v < LatencyHistogram::kSubBuckets; v++) {
+    for (uint64_t i = 0; i <= v % 3; i++) {
+      h.Record(v);
+      values.push_back(v);
+    }
+  }
+  CHECK(h.Count() == values.size());
+  CHECK(h.Min() == 0);
+  CHECK(h.Max() == LatencyHistogram::kSubBuckets - 1);
+  for (double p : {0.0, 1.0, 10.0, 25.0, 50.0, 90.0, 99.0, 100.0}) {
+    CHECK(h.Percentile(p) == ExactPercentile(values, p));
+  }
+}
+
+// High percentiles of a few values aren't rounded down to a lower rank.
+static void NearestRank() {
+  LatencyHistogram h;
+  for (uint64_t v = 1; v <= 7; v++) {
+    h.Record(v);
+  }
+  CHECK(h.Percentile(0) == 1);
+  CHECK(h.Percentile(14) == 1);
+  CHECK(h.Percentile(15) == 2);
+  CHECK(h.Percentile(50) == 4);
+  CHECK(h.Percentile(90) == 7);
+  CHECK(h.Percentile(100) == 7);
+}
+
+// Values of every size are within the relative error, never below the
+// exact value and never above the maximum.
+static void Accuracy() {
+  std::mt19937_64 rng(777);
+  LatencyHistogram h;
+  std::vector<uint64_t> values;
+  for (int i = 0; i < 100000; i++) {
+    // Spread over all the powers of two.
+    uint64_t v = rng() >> (rng() % 64);
+    h.Record(v);
+    values.push_back(v);
+  }
+  h.Record(UINT64_MAX);
+  values.push_back(UINT64_MAX);
+  std::sort(values.begin(), values.end());
+  CHECK(h.Min() == values.front());
+  CHECK(h.Max() == UINT64_MAX);
+  CHECK(h.Percentile(100) == UINT64_MAX);
+  for (double p : {0.1, 1.0, 10.0, 50.0, 75.0, 90.0, 99.0, 99.9}) {
+    uint64_t exact = ExactPercentile(values, p);
+    uint64_t got = h.Percentile(p);
+    if (!WithinError(got, exact)) {
+      fprintf(stderr, "p%g: got %llu, exact %llu\n", p,
+              static_cast<unsigned long long>(got),
+              static_cast<unsigned long long>(exact));
+      CHECK(false);
+    }
+  }
+
+  LatencyHistogram m;
+  for (uint64_t v : {1000, 2000, 6000}) {
+    m.Record(v);
+  }
+  CHECK(m.Mean() == 3000);
+  CHECK(WithinError(m.Percentile(50), 2000));
+  CHECK(m.Percentile(100) == 6000);
+}
+
+int main() {
+  Empty();
+  SmallValues();
+  NearestRank();
+  Accuracy();
+  return co::CheckResult("histogram_test");
+}
@@ -2,15 +2,20 @@
 // All Rights Reserved
 // See LICENSE file for licensing information.
 
+#include "buffered_io.h"
 #include "coroutine.h"
+#include "http_parser.h"
+#include "http_client/histogram.h"
+#include <charconv>
+#include <algorithm>
+#include <csignal>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <map>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <set>
-#include <sstream>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,395 +23,533 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <vector>
-#include <memory>
 
 void Usage(void) {
-  fprintf(stderr, "usage: client -j <jobs> <host> <filename>\n");
+  fprintf(stderr, "usage: client [-j <jobs>] [-p <pipeline>] [-n <requests>] "
+                  "[-d <seconds>] [-u] [--bench] [--json] <host[:port]> "
+                  "<filename>\n");
   exit(1);
 }
 
-// Send data to the server from a coroutine.
-static bool SendToServer(co::Coroutine *c, int fd, const char *request,
-                         size_t length) {
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
-    c->Wait(fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
-    }
-    ssize_t n = write(fd, request + offset, nbytes);
-    if (n == -1) {
-      perror("write");
-      return false;
+// Keep-alive connections that are not in use, by host:port.  A job takes a
+// connection from here (or makes a new one), sends its requests and puts it
+// back when all the responses have been read, so the connection setup cost
+// is only paid once per connection rather than once per request.
+//
+// Only connections with nothing left to read are put back, so they can be
+// given to any coroutine.
+class ConnectionPool {
+ public:
+  ~ConnectionPool() {
+    for (auto &idle : idle_) {
+      for (int fd : idle.second) {
+        close(fd);
+      }
     }
-    if (n == 0) {
-      return false;
+  }
+
+  // Get a connection to the address, connecting if there are none idle.
+  // Returns -1 if the connect fails.
+  // Sets reused if the connection came from the pool.
+  int Get(co::Coroutine *c, const std::string &key,
+          const struct sockaddr_in &addr, bool &reused) {
+    std::vector<int> &idle = idle_[key];
+    reused = !idle.empty();
+    if (reused) {
+      int fd = idle.back();
+      idle.pop_back();
+      return fd;
     }
-    length -= n;
-    offset += n;
+    return Connect(c, addr);
   }
-  return true;
-}
 
-static std::vector<std::string> SplitString(const std::string &str) {
-  std::vector<std::string> result;
-  std::istringstream iss(str);
-  std::string token;
+  void Put(const std::string &key, int fd) { idle_[key].push_back(fd); }
 
-  while (std::getline(iss, token, ' ')) {
-    result.push_back(token);
+  size_t NumConnects() const { return num_connects_; }
+
+ private:
+  // Non-blocking connect, waiting for it to complete.
+  int Connect(co::Coroutine *c, const struct sockaddr_in &addr) {
+    num_connects_++;
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+      perror("socket");
+      exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // The requests are written together, so don't wait for acks.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (c->Connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      perror("connect");
+      close(fd);
+      return -1;
+    }
+    return fd;
   }
 
-  return result;
-}
+  std::map<std::string, std::vector<int>> idle_;
+  size_t num_connects_ = 0;
+};
 
-static size_t ReadHeaders(std::string &buffer, std::vector<std::string> &header,
-                          std::map<std::string, std::string> &http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer.size() && buffer[i] != '\r') {
-    i++;
-  }
-  if (i == buffer.size()) {
-    // No header line.
-    return i;
-  }
-  std::string header_line(buffer.substr(0, i));
-  i += 2; // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  header = SplitString(header_line);
-
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer.length()) {
-    if (buffer[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
-      break;
-    }
-    char *name = &buffer[i];
-    while (i < buffer.size() && buffer[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer[i] = toupper(buffer[i]);
-      i++;
+// What to fetch and how, shared by all the jobs.
+struct Options {
+  std::string host;      // Host name as given, sent in the Host header.
+  std::string key;       // host:port for the connection pool.
+  struct sockaddr_in addr;
+  std::string filename;
+  int pipeline = 1;      // Requests sent at once on a connection.
+  bool output = true;    // Copy the bodies to stdout.
+};
+
+// How many requests to send.  With -n there is a limit on the number, with
+// -d a time limit.  Without either each job sends one set of requests.
+struct Load {
+  long long remaining = -1;  // -1 for no limit.
+  uint64_t end_time = 0;     // 0 for no limit.
+  long long requests = 0;    // Responses received.
+  long long errors = 0;      // Non-200 responses and failed connections.
+
+  // Latencies in nanoseconds for --bench.  Time to first byte and total
+  // time are from when the request was sent.  For pipelined requests that
+  // is when the set of them was sent.
+  bool bench = false;
+  LatencyHistogram connect_ns;
+  LatencyHistogram first_byte_ns;
+  LatencyHistogram total_ns;
+
+  // How many requests to send next, up to max.  0 when done.
+  int Take(int max) {
+    if (end_time != 0 && co::MonotonicNow() >= end_time) {
+      return 0;
     }
-    // No header value, end of headers.
-    if (i == buffer.size()) {
-      break;
+    if (remaining < 0) {
+      return max;
     }
-    buffer[i] = '\0'; // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer.size() && isspace(buffer[i])) {
-      i++;
+    int n = static_cast<int>(std::min<long long>(max, remaining));
+    remaining -= n;
+    return n;
+  }
+};
+
+// Copy length bytes of the body to stdout (or just skip them).
+static bool ReadContents(co::BufferedReader &reader, size_t length,
+                         bool write_to_output) {
+  while (length > 0) {
+    if (reader.IsEmpty() && !reader.Fill()) {
+      return false;
     }
-    char *value = &buffer[i];
-    while (i < buffer.size()) {
-      if (i < buffer.size() + 3 && buffer[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer[i + 2] != ' ' && buffer[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
-      }
-      i++;
+    std::string_view data = reader.Data();
+    size_t nbytes = std::min(length, data.size());
+    if (write_to_output) {
+      fwrite(data.data(), 1, nbytes, stdout);
     }
-    buffer[i] = '\0'; // Replace \r by EOL
-    i += 2;
-    http_headers[name] = value;
+    reader.Consume(nbytes);
+    length -= nbytes;
   }
-  return i;
+  return true;
 }
 
-static size_t ReadContents(co::Coroutine *c, int fd, std::string &buffer,
-                           size_t i, int length, bool write_to_output) {
-  while (length > 0) {
-    if (i < buffer.size()) {
-      // Data remaining in buffer
-      size_t nbytes = buffer.size() - i;
-      if (nbytes > length) {
-        nbytes = length;
-      }
-      if (write_to_output) {
-        fwrite(&buffer[i], 1, nbytes, stdout);
-      }
-      length -= nbytes;
-      i += nbytes;
-    } else {
-      // No data in buffer, read some more into the buffer.
-      buffer.clear();
-      i = 0;
-      char buf[256];
-      c->Wait(fd, POLLIN);
-      ssize_t n = read(fd, buf, sizeof(buf));
-      if (n == -1) {
-        perror("read");
-        break;
-      }
-      if (n == 0) {
-        printf("done\n");
-        break;
-      }
-      buffer += std::string(buf, n);
+// Copy the rest of the data on the connection (for a response without a
+// length that ends when the server closes the connection).
+static void ReadToEof(co::BufferedReader &reader, bool write_to_output) {
+  while (!reader.IsEmpty() || reader.Fill()) {
+    std::string_view data = reader.Data();
+    if (write_to_output) {
+      fwrite(data.data(), 1, data.size(), stdout);
     }
+    reader.Consume(data.size());
   }
-  return i;
 }
 
-static size_t ReadChunkLength(co::Coroutine *c, int fd, std::string &buffer,
-                              size_t i, int *length) {
-  for (;;) {
-    char ch;
-    if (i < buffer.size()) {
-      ch = toupper(buffer[i++]);
-    } else {
-      // Fill the buffer with some more data.
-      buffer.clear();
-      i = 0;
-      c->Wait(fd, POLLIN);
-      char buf[256];
-      ssize_t n = read(fd, buf, sizeof(buf));
-      if (n == -1) {
-        perror("read");
-        *length = 0;
-        return i;
-      }
-      if (n == 0) {
-        // Didn't read anything, EOF on input.
-        return i;
-      }
-      buffer += std::string(buf, n);
-      continue;
-    }
-    if (ch == '\r') {
-      i++;
-      break;
-    }
-    if (ch > '9') {
-      ch = ch - 'A' + 10;
-    } else {
-      ch -= '0';
-    }
-    *length = (*length << 4) | ch;
+// Read the line holding the length of the next chunk, in hex.
+static bool ReadChunkLength(co::BufferedReader &reader, size_t *length) {
+  std::string_view line;
+  if (!reader.ReadUntil("\r\n", line)) {
+    return false;
   }
-  return i;
+  // Anything after the number (chunk extensions) is ignored.
+  *length = 0;
+  std::from_chars(line.data(), line.data() + line.size(), *length, 16);
+  reader.Consume(line.size());
+  return true;
 }
 
-static void ReadChunkedContents(co::Coroutine *c, int fd, std::string &buffer,
-                                size_t i) {
+static bool ReadChunkedContents(co::BufferedReader &reader,
+                                bool write_to_output) {
   for (;;) {
     // First line is the length of the chunk in hex.
-    int length = 0;
-    i = ReadChunkLength(c, fd, buffer, i, &length);
+    size_t length;
+    if (!ReadChunkLength(reader, &length)) {
+      return false;
+    }
     if (length == 0) {
-      break;
+      // No trailers are sent, just the CRLF after the last chunk.
+      return reader.Skip(2);
+    }
+    if (!ReadContents(reader, length, write_to_output)) {
+      return false;
     }
-    i = ReadContents(c, fd, buffer, i, length, true);
 
     // Chunk is followed by a CRLF.  Don't print this, just skip it.
-    i = ReadContents(c, fd, buffer, i, 2, false);
+    if (!reader.Skip(2)) {
+      return false;
+    }
   }
 }
 
-void Client(co::Coroutine *c, std::string server_name, in_addr_t ipaddr,
-            std::string filename) {
-
-  int fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    perror("socket");
-    exit(1);
+static bool ServerKeepsAlive(const co::HttpParser &response) {
+  std::string_view connection = response.Find("Connection");
+  if (co::HttpParser::Equal(connection, "close")) {
+    return false;
   }
-
-  struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
-#if defined(__APPLE__)
-                             .sin_len = sizeof(int),
-#endif
-                             .sin_addr.s_addr = ipaddr};
-  int e = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-  if (e != 0) {
-    close(fd);
-    perror("connect");
-    return;
+  if (co::HttpParser::Equal(connection, "keep-alive")) {
+    return true;
   }
-  char request[256];
-
-  int reqlen =
-      snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
-               filename.c_str(), server_name.c_str());
-  bool ok = SendToServer(c, fd, request, reqlen);
-  if (!ok) {
-    fprintf(stderr, "Failed to send to server: %s\n", strerror(errno));
-    close(fd);
-    return;
-  }
-
-  std::string buffer;
+  return response.Protocol() == "HTTP/1.1";
+}
 
-  // Read incoming HTTP request and parse it.
+// Read one response from the connection.  Returns false if the connection
+// can't be used for another request.  Sets ok if the status was 200.  If
+// first_byte isn't null it's set to the time the response started to
+// arrive.
+static bool ReadResponse(co::BufferedReader &reader,
+                         co::HttpParser &response, bool write_to_output,
+                         bool &ok, uint64_t *first_byte) {
+  ok = false;
+  response.Reset();
+
+  // Read incoming HTTP response header and parse it.  With pipelining the
+  // header might already be in the buffer.
   for (;;) {
-    char buf[64];
-
+    // Carry on parsing the header.  A blank line terminates it.
+    std::string_view data = reader.Data();
+    if (first_byte != nullptr && *first_byte == 0 && !data.empty()) {
+      *first_byte = co::MonotonicNow();
+    }
+    co::HttpParser::Status status = response.Parse(data.data(), data.size());
+    if (status == co::HttpParser::Status::kComplete) {
+      break;
+    }
+    if (status == co::HttpParser::Status::kError) {
+      fprintf(stderr, "Invalid response header\n");
+      return false;
+    }
     // Wait for data to arrive.  This will yield to other coroutines and
     // we will resume when data is available to read.
-    c->Wait(fd, POLLIN);
-    ssize_t n = read(fd, buf, sizeof(buf));
-    if (n == -1) {
-      perror("read");
-      close(fd);
-      return;
-    }
-    if (n == 0) {
+    if (!reader.Fill()) {
       // EOF while reading header, nothing we can do.
-      close(fd);
-      return;
+      if (!reader.Eof()) {
+        perror("read");
+      }
+      return false;
     }
-    // Append to data buffer.
-    buffer += std::string(buf, n);
+  }
+
+  // Check for valid status.  The body is read whatever the status so that
+  // the next response can be found, but it's only printed for a 200.
+  int status_value = response.StatusCode();
+  ok = status_value == 200;
+  if (!ok) {
+    std::string_view protocol = response.Protocol();
+    std::string_view reason = response.Reason();
+    fprintf(stderr, "%.*s Error: %d: %.*s\n", static_cast<int>(protocol.size()),
+            protocol.data(), status_value, static_cast<int>(reason.size()),
+            reason.data());
+  }
+  bool output = ok && write_to_output;
+  bool keep_alive = ServerKeepsAlive(response);
+
+  // We are the end of the http headers in the buffer.  We now need to work
+  // out the length.  This is either from the CONTENT-LENGTH header or if
+  // TRANSFER-ENCODING is "chunked", we have a series of chunks, each of which
+  // is preceded by a hex length on a line of its own and terminated with a
+  // CRLF.  Without either, the body ends when the server closes the
+  // connection.
+  bool is_chunked = false;
+  long long content_length = -1;
+
+  if (co::HttpParser::Equal(response.Find("Transfer-Encoding"), "chunked")) {
+    is_chunked = true;
+  } else if (response.Has("Content-Length")) {
+    std::string_view length = response.Find("Content-Length");
+    content_length = 0;
+    std::from_chars(length.data(), length.data() + length.size(),
+                    content_length);
+  }
 
-    // A blank line terminates the read.
-    if (buffer.find("\r\n\r\n") != std::string::npos) {
+  // The body follows the header in the reader's buffer.
+  reader.Consume(response.HeaderLength());
+  if (is_chunked) {
+    return ReadChunkedContents(reader, output) && keep_alive;
+  }
+  if (content_length == -1) {
+    ReadToEof(reader, output);
+    return false;
+  }
+  return ReadContents(reader, content_length, output) && keep_alive;
+}
+
+enum class Result {
+  kReusable,  // All responses read, connection can be used again.
+  kClosed,    // Connection can't be used again.
+  kStale,     // Reused connection closed by the server before use.
+};
+
+// Send up to n requests at once on a connection and read the responses.
+static Result SendRequests(co::Coroutine *c, int fd, bool reused,
+                           const Options &opts, int n, Load &load) {
+  co::BufferedReader reader(c, fd);
+  co::BufferedWriter writer(c, fd);
+  char request[256];
+
+  int reqlen =
+      snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+               opts.filename.c_str(), opts.host.c_str());
+  for (int i = 0; i < n; i++) {
+    if (!writer.Write(request, reqlen)) {
       break;
     }
   }
+  bool sent = writer.Flush();
+  uint64_t sent_time = load.bench ? co::MonotonicNow() : 0;
+
+  // A connection from the pool might have been closed by the server while
+  // it was idle (it has a keep-alive timeout).  In that case nothing at all
+  // comes back and the requests can be sent again on a new connection.
+  if (reused && (!sent || !reader.Fill())) {
+    return Result::kStale;
+  }
+  if (!sent) {
+    fprintf(stderr, "Failed to send to server: %s\n", strerror(errno));
+    load.errors += n;
+    return Result::kClosed;
+  }
 
-  std::vector<std::string> header;
-  std::map<std::string, std::string> http_headers;
-
-  // The buffer contains the HTTP header line and the HTTP headers.
-  size_t i = ReadHeaders(buffer, header, http_headers);
-
-  const size_t kProtocol = 0;
-  const size_t kStatus = 1;
-  const size_t kError = 2;
-
-  // Make alises for the http header fields.
-  std::string &status = header[kStatus];
-  std::string &protocol = header[kProtocol];
-
-  // Check for valid status.
-  int status_value = atoi(status.c_str());
-  if (status_value != 200) {
-    fprintf(stderr, "%s Error: %d: ", protocol.c_str(), status_value);
-    // Print all error strings.
-    const char *sep = "";
-    for (size_t i = kError; i < header.size(); i++) {
-      std::string &s = header[i];
-      fprintf(stderr, "%s%s", sep, s.c_str());
-      sep = " ";
+  co::HttpParser response(co::HttpParser::Kind::kResponse);
+  for (int i = 0; i < n; i++) {
+    bool ok;
+    uint64_t first_byte = 0;
+    bool reusable = ReadResponse(reader, response, opts.output, ok,
+                                 load.bench ? &first_byte : nullptr);
+    load.requests++;
+    if (!ok) {
+      load.errors++;
+    } else if (load.bench) {
+      load.first_byte_ns.Record(first_byte - sent_time);
+      load.total_ns.Record(co::MonotonicNow() - sent_time);
     }
-    fprintf(stderr, "\n");
-  } else {
-    // We are the end of the http headers in the buffer.  We now need to work
-    // out the length.  This is either from the CONTENT-LENGTH header or if
-    // TRANSFER-ENCODING is "chunked", we have a series of chunks, each of which
-    // is preceded by a hex length on a line of its own and terminated with a
-    // CRLF
-    auto it = http_headers.find("TRANSFER-ENCODING");
-    bool is_chunked = false;
-    int content_length = -1;
-
-    if (it != http_headers.end() && it->second == "chunked") {
-      is_chunked = true;
-    } else {
-      auto it = http_headers.find("CONTENT-LENGTH");
-      if (it != http_headers.end()) {
-        content_length = (int)strtoll(it->second.c_str(), NULL, 10);
-      }
+    if (!reusable) {
+      // The rest of the requests are lost.
+      load.errors += n - i - 1;
+      return Result::kClosed;
     }
+  }
+  // Anything left over wasn't asked for.
+  return reader.IsEmpty() ? Result::kReusable : Result::kClosed;
+}
 
-    // We use the buffer to hold all the data received, in blocks.
-    if (is_chunked) {
-      ReadChunkedContents(c, fd, buffer, i);
-    } else {
-      if (content_length == -1) {
-        fprintf(stderr,
-                "Don't know how many bytes to read, no Content-length in "
-                "headers\n");
+void Client(co::Coroutine *c, ConnectionPool &pool, const Options &opts,
+            Load &load) {
+  int n;
+  while ((n = load.Take(opts.pipeline)) > 0) {
+    Result result;
+    do {
+      bool reused;
+      uint64_t start = load.bench ? co::MonotonicNow() : 0;
+      int fd = pool.Get(c, opts.key, opts.addr, reused);
+      if (fd == -1) {
+        load.errors += n;
+        return;
+      }
+      if (load.bench && !reused) {
+        load.connect_ns.Record(co::MonotonicNow() - start);
+      }
+      result = SendRequests(c, fd, reused, opts, n, load);
+      if (result == Result::kReusable) {
+        pool.Put(opts.key, fd);
       } else {
-        ReadContents(c, fd, buffer, i, content_length, true);
+        close(fd);
       }
+    } while (result == Result::kStale);
+    if (load.remaining < 0 && load.end_time == 0) {
+      // Just the one set of requests.
+      return;
     }
   }
+}
 
-  close(fd);
+static const double kPercentiles[] = {50, 90, 99, 99.9};
+
+// Print the --bench results as a table, times in microseconds.
+static void PrintBenchReport(const Load &load, size_t connects,
+                             double secs) {
+  printf("%lld requests, %lld errors, %zu connections in %.3f seconds: "
+         "%.0f requests/second\n\n",
+         load.requests, load.errors, connects, secs,
+         secs > 0 ? load.requests / secs : 0.0);
+  printf("%-12s %9s %10s %10s %10s %10s %10s %10s %10s\n", "latency (us)",
+         "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+  auto row = [](const char *name, const LatencyHistogram &h) {
+    printf("%-12s %9llu %10.1f %10.1f", name,
+           static_cast<unsigned long long>(h.Count()), h.Min() / 1e3,
+           h.Mean() / 1e3);
+    for (double p : kPercentiles) {
+      printf(" %10.1f", h.Percentile(p) / 1e3);
+    }
+    printf(" %10.1f\n", h.Max() / 1e3);
+  };
+  row("connect", load.connect_ns);
+  row("first byte", load.first_byte_ns);
+  row("total", load.total_ns);
+}
+
+// Print the --bench results as JSON, times in microseconds, so that runs
+// can be compared by a script.
+static void PrintBenchJson(const Load &load, size_t connects, double secs) {
+  printf("{\n  \"requests\": %lld,\n  \"errors\": %lld,\n"
+         "  \"connections\": %zu,\n  \"seconds\": %.6f,\n"
+         "  \"requests_per_second\": %.1f,\n  \"latency_us\": {",
+         load.requests, load.errors, connects, secs,
+         secs > 0 ? load.requests / secs : 0.0);
+  auto object = [](const char *name, const LatencyHistogram &h, bool last) {
+    printf("\n    \"%s\": {\"count\": %llu, \"min\": %.3f, "
+           "\"mean\": %.3f",
+           name, static_cast<unsigned long long>(h.Count()), h.Min() / 1e3,
+           h.Mean() / 1e3);
+    for (double p : kPercentiles) {
+      printf(", \"p%g\": %.3f", p, h.Percentile(p) / 1e3);
+    }
+    printf(", \"max\": %.3f}%s", h.Max() / 1e3, last ? "" : ",");
+  };
+  object("connect", load.connect_ns, false);
+  object("first_byte", load.first_byte_ns, false);
+  object("total", load.total_ns, true);
+  printf("\n  }\n}\n");
+}
+
+// Parse a numeric argument for an option, either as -xN or -x N.
+static long long NumericArg(int argc, const char *argv[], int &i) {
+  const char *arg = argv[i][2] != '\0' ? &argv[i][2]
+                                       : (++i < argc ? argv[i] : nullptr);
+  if (arg == nullptr || !isdigit(arg[0])) {
+    Usage();
+  }
+  return atoll(arg);
 }
 
 int main(int argc, const char *argv[]) {
-  std::string host;
-  std::string filename;
+  // A write to a connection closed by the server gets an error, not a
+  // signal.
+  signal(SIGPIPE, SIG_IGN);
+
+  Options opts;
+  Load load;
   int num_jobs = 1;
+  long long duration = 0;
+  bool json = false;
+  co::PollerType poller_type = co::PollerType::kDefault;
+  std::string host;
   for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
-      if (strcmp(argv[i], "-j") == 0) {
-        // Allow -j N where N is a number
-        i++;
-        if (i < argc) {
-          if (isdigit(argv[i][0])) {
-            num_jobs = atoi(argv[i]);
-          } else {
-            Usage();
-          }
-        } else {
-          Usage();
-        }
-      } else if (argv[i][1] == 'j' && isdigit(argv[i][2])) {
-        // Allow -jN where N is a number.
-        num_jobs = atoi(&argv[i][2]);
-      } else {
+    if (strcmp(argv[i], "--bench") == 0) {
+      load.bench = true;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      load.bench = true;
+      json = true;
+    } else if (argv[i][0] == '-') {
+      switch (argv[i][1]) {
+      case 'j':
+        num_jobs = static_cast<int>(NumericArg(argc, argv, i));
+        break;
+      case 'p':
+        opts.pipeline =
+            std::max(1, static_cast<int>(NumericArg(argc, argv, i)));
+        break;
+      case 'n':
+        load.remaining = NumericArg(argc, argv, i);
+        break;
+      case 'd':
+        duration = NumericArg(argc, argv, i);
+        break;
+      case 'u':
+        poller_type = co::PollerType::kIoUring;
+        break;
+      default:
         Usage();
       }
     } else {
       if (host.empty()) {
         host = argv[i];
-      } else if (filename.empty()) {
-        filename = argv[i];
+      } else if (opts.filename.empty()) {
+        opts.filename = argv[i];
       } else {
         Usage();
       }
     }
   }
-  if (host.empty() || filename.empty()) {
+  if (host.empty() || opts.filename.empty()) {
     Usage();
   }
 
+  int port = 80;
+  size_t colon = host.find(':');
+  if (colon != std::string::npos) {
+    port = atoi(host.c_str() + colon + 1);
+    host.resize(colon);
+  }
+  opts.host = host;
+  opts.key = host + ":" + std::to_string(port);
+
+  // The host is only looked up once.
   struct hostent *entry = gethostbyname(host.c_str());
   if (entry == NULL) {
     fprintf(stderr, "unknown host %s\n", host.c_str());
     exit(1);
   }
-  in_addr_t ipaddr = ((struct in_addr *)entry->h_addr_list[0])->s_addr;
-
-  co::CoroutineScheduler scheduler;
-  std::set<std::unique_ptr<co::Coroutine>> jobs;
-  scheduler.SetCompletionCallback([&jobs](co::Coroutine *c) {
-    for (auto it = jobs.begin(); it != jobs.end(); it++) {
-      if (it->get() == c) {
-        jobs.erase(it);
-        return;
-      }
-    }
-  });
+  opts.addr = {};
+#if defined(__APPLE__)
+  opts.addr.sin_len = sizeof(opts.addr);
+#endif
+  opts.addr.sin_family = AF_INET;
+  opts.addr.sin_port = htons(port);
+  opts.addr.sin_addr.s_addr =
+      ((struct in_addr *)entry->h_addr_list[0])->s_addr;
+
+  // With a number of requests or a duration (or --bench) this is a load
+  // generator: the bodies are thrown away and a summary is printed at the
+  // end.
+  bool load_test = load.remaining >= 0 || duration > 0 || load.bench;
+  opts.output = !load_test;
+
+  co::CoroutineScheduler scheduler(poller_type);
+  ConnectionPool pool;
+
+  uint64_t start = co::MonotonicNow();
+  if (duration > 0) {
+    load.end_time = start + static_cast<uint64_t>(duration) * 1000000000ULL;
+  }
 
-  // Run all the jobs in parallel.  They will be removed from the
-  // jobs set when they complete.
+  // Run all the jobs in parallel.  The scheduler deletes them when they
+  // complete.
   for (int i = 0; i < num_jobs; i++) {
-    jobs.insert(std::make_unique<co::Coroutine>(
-        scheduler, [ipaddr, host, filename](co::Coroutine *c) {
-          Client(c, host, ipaddr, filename);
-        }));
+    scheduler.Spawn([&pool, &opts, &load](co::Coroutine *c) {
+      Client(c, pool, opts, load);
+    });
   }
 
   // Run the main loop
   scheduler.Run();
+
+  double secs = (co::MonotonicNow() - start) / 1e9;
+  if (json) {
+    PrintBenchJson(load, pool.NumConnects(), secs);
+  } else if (load.bench) {
+    PrintBenchReport(load, pool.NumConnects(), secs);
+  } else if (load_test) {
+    fprintf(stderr,
+            "%lld requests, %lld errors, %zu connections in %.3f seconds: "
+            "%.0f requests/second\n",
+            load.requests, load.errors, pool.NumConnects(), secs,
+            secs > 0 ? load.requests / secs : 0.0);
+  }
 }
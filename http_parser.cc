@@ -0,0 +1,177 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "http_parser.h"
+
+#include <ctype.h>
+#include <string.h>
+
+namespace co {
+
+static std::string_view Trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Split off the text up to the next space.
+static std::string_view NextToken(std::string_view &s) {
+  size_t space = s.find(' ');
+  std::string_view token = s.substr(0, space);
+  s.remove_prefix(space == std::string_view::npos ? s.size() : space + 1);
+  return token;
+}
+
+bool HttpParser::Equal(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (tolower(static_cast<unsigned char>(a[i])) !=
+        tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void HttpParser::Reset() {
+  scanned_ = 0;
+  header_length_ = 0;
+  first_ = second_ = third_ = {};
+  status_code_ = 0;
+  num_headers_ = 0;
+}
+
+HttpParser::Status HttpParser::Parse(const char *data, size_t length) {
+  if (header_length_ != 0) {
+    return Status::kComplete;
+  }
+  // Look for the blank line at the end of the header.  Lines should end
+  // with \r\n but a bare \n is accepted too.  memchr is much faster than
+  // looking at each character (it uses vector instructions) and we only
+  // look at the data we haven't seen before.  Back up a little in case the
+  // last call stopped in the middle of the blank line.
+  size_t i = scanned_ < 2 ? 0 : scanned_ - 2;
+  size_t end = 0;
+  while (i < length) {
+    const char *nl =
+        static_cast<const char *>(memchr(data + i, '\n', length - i));
+    if (nl == nullptr) {
+      break;
+    }
+    size_t pos = nl - data;
+    if ((pos >= 1 && data[pos - 1] == '\n') ||
+        (pos >= 2 && data[pos - 1] == '\r' && data[pos - 2] == '\n')) {
+      end = pos + 1;
+      break;
+    }
+    i = pos + 1;
+  }
+  if (end == 0) {
+    scanned_ = length;
+    return Status::kIncomplete;
+  }
+
+  // The whole header is there.  Split it into lines, up to the blank one.
+  std::string_view header(data, end);
+  bool first = true;
+  for (;;) {
+    size_t eol = header.find('\n');
+    std::string_view line = header.substr(0, eol);
+    header.remove_prefix(eol + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (first) {
+      if (!ParseFirstLine(line)) {
+        return Status::kError;
+      }
+      first = false;
+    } else if (line.empty()) {
+      break;
+    } else if (!ParseHeaderLine(line)) {
+      return Status::kError;
+    }
+  }
+  header_length_ = end;
+  return Status::kComplete;
+}
+
+bool HttpParser::ParseFirstLine(std::string_view line) {
+  first_ = NextToken(line);
+  second_ = NextToken(line);
+  if (kind_ == Kind::kRequest) {
+    third_ = NextToken(line);
+    if (first_.empty() || second_.empty() || third_.empty() || !line.empty()) {
+      return false;
+    }
+    return true;
+  }
+  // The reason phrase is the rest of the line and can have spaces in it.
+  third_ = line;
+  if (first_.empty() || second_.size() != 3) {
+    return false;
+  }
+  status_code_ = 0;
+  for (char ch : second_) {
+    if (!isdigit(static_cast<unsigned char>(ch))) {
+      return false;
+    }
+    status_code_ = status_code_ * 10 + (ch - '0');
+  }
+  return true;
+}
+
+bool HttpParser::ParseHeaderLine(std::string_view line) {
+  if (line.empty()) {
+    return false;
+  }
+  if (line.front() == ' ' || line.front() == '\t') {
+    // An obsolete continuation of the last header's value.  The value is
+    // extended to include it (it follows on in the buffer).
+    if (num_headers_ == 0) {
+      return false;
+    }
+    std::string_view &value = headers_[num_headers_ - 1].value;
+    std::string_view rest = Trim(line);
+    if (!rest.empty()) {
+      if (value.empty()) {
+        value = rest;
+      } else {
+        value = std::string_view(value.data(),
+                                 rest.data() + rest.size() - value.data());
+      }
+    }
+    return true;
+  }
+  size_t colon = line.find(':');
+  if (colon == std::string_view::npos || colon == 0 ||
+      num_headers_ == kMaxHeaders) {
+    return false;
+  }
+  headers_[num_headers_++] = {line.substr(0, colon),
+                              Trim(line.substr(colon + 1))};
+  return true;
+}
+
+const HttpHeader *HttpParser::FindHeader(std::string_view name) const {
+  for (size_t i = 0; i < num_headers_; i++) {
+    if (Equal(headers_[i].name, name)) {
+      return &headers_[i];
+    }
+  }
+  return nullptr;
+}
+
+std::string_view HttpParser::Find(std::string_view name) const {
+  const HttpHeader *h = FindHeader(name);
+  return h == nullptr ? std::string_view() : h->value;
+}
+
+}  // namespace co
@@ -0,0 +1,102 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef http_parser_h
+#define http_parser_h
+
+#include <cstddef>
+#include <string_view>
+
+namespace co {
+
+struct HttpHeader {
+  std::string_view name;
+  std::string_view value;
+};
+
+// An incremental parser for the header of an HTTP request or response.
+// Data is received into a connection buffer and Parse is called with the
+// whole of the buffer each time more arrives.  Each call carries on from
+// where the last one stopped looking for the blank line at the end of the
+// header, so a header that arrives in pieces is only scanned once.  Lines
+// can end with \r\n or, leniently, with a bare \n.
+//
+// Nothing is copied or allocated.  The request line and headers are
+// string_views into the buffer passed to Parse, so they are only valid
+// while the buffer is unchanged.  The headers are held in a small flat
+// table and looked up without regard to case.
+//
+// To parse the next message on the same connection (for keep-alive or
+// pipelining), remove the header (and body) from the front of the buffer
+// and call Reset.
+class HttpParser {
+ public:
+  enum class Kind {
+    kRequest,   // Request line is: method target protocol
+    kResponse,  // Status line is: protocol status reason
+  };
+
+  enum class Status {
+    kIncomplete,  // Need more data.
+    kComplete,    // The header is all there and has been parsed.
+    kError,       // Malformed, or too many headers.
+  };
+
+  static constexpr size_t kMaxHeaders = 64;
+
+  explicit HttpParser(Kind kind) : kind_(kind) {}
+
+  // Parse the header at the start of data.  The data must start at the same
+  // place as the last call, with more added to the end.
+  Status Parse(const char *data, size_t length);
+
+  // Start again for a new message.
+  void Reset();
+
+  // Length of the header, including the blank line that ends it.  This is
+  // where the body (or next message) starts.
+  size_t HeaderLength() const { return header_length_; }
+
+  // Request line.
+  std::string_view Method() const { return first_; }
+  std::string_view Target() const { return second_; }
+
+  // Status line.
+  int StatusCode() const { return status_code_; }
+  std::string_view Reason() const { return third_; }
+
+  // HTTP/1.0 or HTTP/1.1 etc, for both requests and responses.
+  std::string_view Protocol() const {
+    return kind_ == Kind::kRequest ? third_ : first_;
+  }
+
+  // The value of a header, or an empty view if it isn't there (or is
+  // empty).  The name is matched without regard to case.
+  std::string_view Find(std::string_view name) const;
+  bool Has(std::string_view name) const { return FindHeader(name) != nullptr; }
+
+  size_t NumHeaders() const { return num_headers_; }
+  const HttpHeader &Header(size_t i) const { return headers_[i]; }
+
+  // Case insensitive comparison.
+  static bool Equal(std::string_view a, std::string_view b);
+
+ private:
+  const HttpHeader *FindHeader(std::string_view name) const;
+  bool ParseFirstLine(std::string_view line);
+  bool ParseHeaderLine(std::string_view line);
+
+  Kind kind_;
+  size_t scanned_ = 0;  // Data before this has no end of header.
+  size_t header_length_ = 0;
+  std::string_view first_;
+  std::string_view second_;
+  std::string_view third_;
+  int status_code_ = 0;
+  HttpHeader headers_[kMaxHeaders];
+  size_t num_headers_ = 0;
+};
+
+}  // namespace co
+#endif  // http_parser_h
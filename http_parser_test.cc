@@ -0,0 +1,187 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Checks for HttpParser.  Prints what fails and exits with 1 if anything
+// does.
+
+#include <string>
+
+#include "check.h"
+#include "http_parser.h"
+
+using namespace co;
+using Status = HttpParser::Status;
+
+static const std::string kRequest =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Content-Length:  12 \r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static void CheckRequest(const HttpParser &parser, size_t length) {
+  CHECK(parser.HeaderLength() == length);
+  CHECK(parser.Method() == "GET");
+  CHECK(parser.Target() == "/index.html");
+  CHECK(parser.Protocol() == "HTTP/1.1");
+  CHECK(parser.NumHeaders() == 3);
+  CHECK(parser.Find("Host") == "example.com");
+  CHECK(parser.Find("Content-Length") == "12");
+  CHECK(parser.Find("Connection") == "keep-alive");
+}
+
+// The header arrives in two pieces, split at every offset, and one byte at
+// a time.
+static void SplitHeader() {
+  const std::string &data = kRequest;
+  for (size_t split = 0; split < data.size(); split++) {
+    HttpParser parser(HttpParser::Kind::kRequest);
+    CHECK(parser.Parse(data.data(), split) == Status::kIncomplete);
+    CHECK(parser.Parse(data.data(), data.size()) == Status::kComplete);
+    CheckRequest(parser, data.size());
+  }
+  HttpParser parser(HttpParser::Kind::kRequest);
+  for (size_t length = 0; length < data.size(); length++) {
+    CHECK(parser.Parse(data.data(), length) == Status::kIncomplete);
+  }
+  CHECK(parser.Parse(data.data(), data.size()) == Status::kComplete);
+  CheckRequest(parser, data.size());
+}
+
+static void LineEndings() {
+  std::string bare =
+      "GET /index.html HTTP/1.1\n"
+      "Host: example.com\n"
+      "Content-Length: 12\n"
+      "Connection: keep-alive\n"
+      "\n";
+  HttpParser parser(HttpParser::Kind::kRequest);
+  CHECK(parser.Parse(bare.data(), bare.size()) == Status::kComplete);
+  CheckRequest(parser, bare.size());
+
+  // Mixed, with the blank line ending both ways.
+  for (const char *end : {"\r\n", "\n"}) {
+    std::string mixed = std::string("GET /index.html HTTP/1.1\r\n"
+                                    "Host: example.com\n"
+                                    "Content-Length: 12\r\n"
+                                    "Connection: keep-alive\n") +
+                        end + "body";
+    parser.Reset();
+    CHECK(parser.Parse(mixed.data(), mixed.size()) == Status::kComplete);
+    CheckRequest(parser, mixed.size() - 4);
+  }
+
+  // A lone \r isn't a line ending.
+  std::string cr = "GET / HTTP/1.1\r\rHost: x\r\r";
+  parser.Reset();
+  CHECK(parser.Parse(cr.data(), cr.size()) == Status::kIncomplete);
+}
+
+static void CaseInsensitive() {
+  HttpParser parser(HttpParser::Kind::kRequest);
+  CHECK(parser.Parse(kRequest.data(), kRequest.size()) == Status::kComplete);
+  CHECK(parser.Find("host") == "example.com");
+  CHECK(parser.Find("CONTENT-length") == "12");
+  CHECK(parser.Has("connection"));
+  CHECK(parser.Has("HOST"));
+  CHECK(!parser.Has("Hostx"));
+  CHECK(!parser.Has("Hos"));
+  CHECK(parser.Find("Accept").empty());
+  CHECK(HttpParser::Equal("Keep-Alive", "keep-alive"));
+  CHECK(!HttpParser::Equal("keep-alive", "keep-alive "));
+}
+
+static void TooManyHeaders() {
+  auto make = [](size_t num_headers) {
+    std::string data = "GET / HTTP/1.1\r\n";
+    for (size_t i = 0; i < num_headers; i++) {
+      data += "X-Header-" + std::to_string(i) + ": " + std::to_string(i) +
+              "\r\n";
+    }
+    return data + "\r\n";
+  };
+  std::string full = make(HttpParser::kMaxHeaders);
+  HttpParser parser(HttpParser::Kind::kRequest);
+  CHECK(parser.Parse(full.data(), full.size()) == Status::kComplete);
+  CHECK(parser.NumHeaders() == HttpParser::kMaxHeaders);
+  CHECK(parser.Find("x-header-63") == "63");
+
+  std::string over = make(HttpParser::kMaxHeaders + 1);
+  parser.Reset();
+  CHECK(parser.Parse(over.data(), over.size()) == Status::kError);
+}
+
+static void Malformed() {
+  for (const char *data : {"GET /\r\n\r\n", "\r\n\r\n",
+                           "GET / HTTP/1.1 extra\r\n\r\n",
+                           "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+                           "GET / HTTP/1.1\r\n: empty name\r\n\r\n",
+                           "GET / HTTP/1.1\r\n continuation\r\n\r\n"}) {
+    HttpParser parser(HttpParser::Kind::kRequest);
+    CHECK(parser.Parse(data, std::string(data).size()) == Status::kError);
+  }
+  for (const char *data :
+       {"HTTP/1.1 2000 OK\r\n\r\n", "HTTP/1.1 2x0 OK\r\n\r\n"}) {
+    HttpParser parser(HttpParser::Kind::kResponse);
+    CHECK(parser.Parse(data, std::string(data).size()) == Status::kError);
+  }
+}
+
+static void Response() {
+  std::string data =
+      "HTTP/1.1 404 Not Found\r\n"
+      "Content-Type: text/html\r\n"
+      "X-Folded: one\r\n"
+      "  two\r\n"
+      "\r\n";
+  HttpParser parser(HttpParser::Kind::kResponse);
+  CHECK(parser.Parse(data.data(), data.size()) == Status::kComplete);
+  CHECK(parser.Protocol() == "HTTP/1.1");
+  CHECK(parser.StatusCode() == 404);
+  CHECK(parser.Reason() == "Not Found");
+  CHECK(parser.Find("content-type") == "text/html");
+  CHECK(parser.Find("X-Folded") == "one\r\n  two");
+}
+
+// Pipelined requests in one buffer, each taken off the front after it has
+// been parsed.
+static void Pipelined() {
+  std::string buffer = kRequest +
+                       "POST /form HTTP/1.0\r\nContent-Length: 0\r\n\r\n" +
+                       "GET /partial HTTP/1.1\r\nHo";
+  HttpParser parser(HttpParser::Kind::kRequest);
+  CHECK(parser.Parse(buffer.data(), buffer.size()) == Status::kComplete);
+  CheckRequest(parser, kRequest.size());
+  // Parse again without Reset is still the same message.
+  CHECK(parser.Parse(buffer.data(), buffer.size()) == Status::kComplete);
+  buffer.erase(0, parser.HeaderLength());
+
+  parser.Reset();
+  CHECK(parser.Parse(buffer.data(), buffer.size()) == Status::kComplete);
+  CHECK(parser.Method() == "POST");
+  CHECK(parser.Target() == "/form");
+  CHECK(parser.Protocol() == "HTTP/1.0");
+  CHECK(parser.NumHeaders() == 1);
+  CHECK(!parser.Has("Host"));
+  buffer.erase(0, parser.HeaderLength());
+
+  parser.Reset();
+  CHECK(parser.Parse(buffer.data(), buffer.size()) == Status::kIncomplete);
+  buffer += "st: example.com\r\n\r\n";
+  CHECK(parser.Parse(buffer.data(), buffer.size()) == Status::kComplete);
+  CHECK(parser.Target() == "/partial");
+  CHECK(parser.Find("Host") == "example.com");
+  CHECK(parser.HeaderLength() == buffer.size());
+}
+
+int main() {
+  SplitHeader();
+  LineEndings();
+  CaseInsensitive();
+  TooManyHeaders();
+  Malformed();
+  Response();
+  Pipelined();
+  return co::CheckResult("http_parser_test");
+}
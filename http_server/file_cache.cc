@@ -0,0 +1,95 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "http_server/file_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "timer_queue.h"
+
+#if defined(__APPLE__)
+#define ST_MTIM st_mtimespec
+#else
+#define ST_MTIM st_mtim
+#endif
+
+std::shared_ptr<const FileCache::File> FileCache::Find(std::string_view path) {
+  auto found = map_.find(path);
+  if (found == map_.end()) {
+    return nullptr;
+  }
+  EntryList::iterator it = found->second;
+  uint64_t now = co::MonotonicNow();
+  if (now - it->validated_ns >= stat_ttl_ns_) {
+    // A file that is being asked for often enough to be cached has its
+    // inode in the kernel's cache, so this doesn't wait for the disk.
+    struct stat st;
+    const File &file = *it->file;
+    if (stat(it->path.c_str(), &st) == -1 || st.st_size != file.size ||
+        st.ST_MTIM.tv_sec != file.mtime.tv_sec ||
+        st.ST_MTIM.tv_nsec != file.mtime.tv_nsec) {
+      Erase(it);
+      return nullptr;
+    }
+    it->validated_ns = now;
+  }
+  lru_.splice(lru_.begin(), lru_, it);
+  return it->file;
+}
+
+std::shared_ptr<FileCache::File> FileCache::Load(int fd,
+                                                 const struct stat &st) {
+  auto file = std::make_shared<File>();
+  file->size = st.st_size;
+  file->mtime = st.ST_MTIM;
+  file->contents.resize(st.st_size);
+  size_t length = static_cast<size_t>(st.st_size);
+  size_t offset = 0;
+  while (offset < length) {
+    ssize_t n = pread(fd, file->contents.data() + offset, length - offset,
+                      static_cast<off_t>(offset));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Error, or the file got shorter.
+      return nullptr;
+    }
+    offset += n;
+  }
+  char header[128];
+  int n = snprintf(header, sizeof(header),
+                   " 200 OK\r\nContent-type: text/html\r\n"
+                   "Content-length: %zu\r\nConnection: ",
+                   length);
+  file->header.assign(header, n);
+  return file;
+}
+
+void FileCache::Insert(std::string_view path,
+                       std::shared_ptr<const File> file) {
+  auto found = map_.find(path);
+  if (found != map_.end()) {
+    Erase(found->second);
+  }
+  lru_.push_front({std::string(path), std::move(file), co::MonotonicNow()});
+  map_[lru_.front().path] = lru_.begin();
+  size_ += Cost(lru_.front());
+  while (size_ > capacity_) {
+    Erase(std::prev(lru_.end()));
+  }
+}
+
+size_t FileCache::Cost(const Entry &entry) {
+  return entry.path.size() + entry.file->header.size() +
+         entry.file->contents.size();
+}
+
+void FileCache::Erase(EntryList::iterator it) {
+  size_ -= Cost(*it);
+  map_.erase(it->path);
+  lru_.erase(it);
+}
@@ -0,0 +1,89 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef file_cache_h
+#define file_cache_h
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A cache of the contents of small files along with most of the response
+// header for sending them, so that a request for a cached file can be
+// answered without any filesystem calls.  The least recently used files are
+// dropped to keep the total size (contents and headers) under the capacity,
+// and no one file can take more than an eighth of it.
+//
+// A cached file is assumed to be unchanged for the stat TTL after it was
+// last checked.  After that, the next request for it stats the file and it
+// is dropped if its size or modification time has changed.
+//
+// Each scheduler has its own cache, so there is no locking.  Files are
+// handed out as shared pointers so that one can be dropped while a
+// coroutine is still sending it.
+class FileCache {
+ public:
+  struct File {
+    // The response header from after the protocol up to the value of the
+    // Connection header, which is different for each request.
+    std::string header;
+    std::string contents;
+    off_t size;
+    struct timespec mtime;
+  };
+
+  FileCache(size_t capacity, uint64_t stat_ttl_ns)
+      : capacity_(capacity), stat_ttl_ns_(stat_ttl_ns) {}
+
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+
+  // The cached file for the path, or null if it isn't cached or it has
+  // changed.
+  std::shared_ptr<const File> Find(std::string_view path);
+
+  // Is a file of this size small enough to cache?
+  bool Fits(off_t size) const {
+    return static_cast<size_t>(size) <= capacity_ / 8;
+  }
+
+  // Read an open file into a File to be added with Insert.  Returns null
+  // if it can't be read or isn't the size st says.  This reads from the
+  // disk, so it should be offloaded, and it doesn't touch the cache.
+  static std::shared_ptr<File> Load(int fd, const struct stat &st);
+
+  // Add a file (from Load) to the cache, replacing any already there for
+  // the path.
+  void Insert(std::string_view path, std::shared_ptr<const File> file);
+
+  // Total bytes of the cached files and their headers.
+  size_t Size() const { return size_; }
+
+ private:
+  struct Entry {
+    std::string path;
+    std::shared_ptr<const File> file;
+    uint64_t validated_ns;  // When the file was last checked.
+  };
+  using EntryList = std::list<Entry>;
+
+  static size_t Cost(const Entry &entry);
+  void Erase(EntryList::iterator it);
+
+  size_t capacity_;
+  uint64_t stat_ttl_ns_;
+  size_t size_ = 0;
+  // Most recently used first.  The map's keys are the entries' paths.
+  EntryList lru_;
+  std::unordered_map<std::string_view, EntryList::iterator> map_;
+};
+
+#endif  // file_cache_h
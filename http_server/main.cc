@@ -2,310 +2,523 @@
 // All Rights Reserved
 // See LICENSE file for licensing information.
 
+#include "buffered_io.h"
 #include "coroutine.h"
+#include "http_parser.h"
+#include "http_server/file_cache.h"
+#include "scheduler_group.h"
+#include "sync.h"
+#include <algorithm>
+#include <charconv>
 #include <csignal>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <map>
+#include <limits.h>
 #include <memory>
 #include <netinet/in.h>
-#include <set>
-#include <sstream>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
-static co::CoroutineScheduler *g_scheduler;
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/openat2.h>) && defined(SYS_openat2)
+#include <linux/openat2.h>
+#endif
+#endif
+
+static co::SchedulerGroup *g_schedulers;
+
+// How long an idle persistent connection is kept open.  Set by -k.
+static uint64_t g_keep_alive_timeout_ns = 10000000000ULL;
+
+// Size of each scheduler's file cache (0 for none) and how long a cached
+// file is trusted before it is checked again.  Set by -c and -s.
+static size_t g_file_cache_size = 64 * 1024 * 1024;
+static uint64_t g_stat_ttl_ns = 1000000000ULL;
+
+// The length of each listening socket's queue of connections waiting to be
+// accepted and the most connections each scheduler handles at once.  Set
+// by -b and -m.
+static int g_backlog = 1024;
+static size_t g_max_connections = 10000;
 void Signal(int sig) {
   printf("\nAll coroutines:\n");
-  g_scheduler->Show();
+  for (size_t i = 0; i < g_schedulers->Size(); i++) {
+    g_schedulers->Scheduler(i).Show();
+  }
   signal(sig, SIG_DFL);
   raise(sig);
 }
 
-// Send a buffer full of data to the coroutines file descriptor.
-static void SendToClient(co::Coroutine *c, int fd, const char *response,
-                         size_t length) {
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
+// Send the response header followed by the first length bytes of the file
+// using sendfile, so the contents of the file are never copied into user
+// space.  Returns false if the client has gone away.
+static bool SendFile(co::Coroutine *c, int fd, int file_fd, size_t length,
+                     const char *header, size_t header_length) {
+  off_t offset = 0;
+#if defined(__APPLE__)
+  // The header is sent by sendfile along with the file.
+  struct iovec header_iov = {const_cast<char *>(header), header_length};
+  struct sf_hdtr hdtr = {&header_iov, 1, nullptr, 0};
+  while (header_iov.iov_len > 0 || static_cast<size_t>(offset) < length) {
     c->Wait(fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
+    // On input len is the number of bytes of the header and file to send. On
+    // return it's the number sent.
+    off_t len = header_iov.iov_len + (length - offset);
+    int e = sendfile(file_fd, fd, offset, &len,
+                     header_iov.iov_len > 0 ? &hdtr : nullptr, 0);
+    if (e == -1 && errno != EAGAIN && errno != EINTR) {
+      perror("sendfile");
+      return false;
+    }
+    if (e == 0 && len == 0) {
+      // File got shorter.
+      return false;
     }
-    ssize_t n = write(fd, response + offset, nbytes);
+    size_t sent = static_cast<size_t>(len);
+    size_t header_sent = std::min(sent, header_iov.iov_len);
+    header_iov.iov_base =
+        static_cast<char *>(header_iov.iov_base) + header_sent;
+    header_iov.iov_len -= header_sent;
+    offset += sent - header_sent;
+  }
+#else
+  // Send the header with MSG_MORE so that it goes out in the same packet as
+  // the start of the file.
+  int flags = length > 0 ? MSG_MORE : 0;
+  while (header_length > 0) {
+    c->Wait(fd, POLLOUT);
+    ssize_t n = send(fd, header, header_length, flags);
     if (n == -1) {
-      perror("write");
-      return;
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      perror("send");
+      return false;
+    }
+    header += n;
+    header_length -= n;
+  }
+  while (static_cast<size_t>(offset) < length) {
+    // This only waits when the socket is full.
+    ssize_t n = c->SendFile(fd, file_fd, &offset, length - offset);
+    if (n == -1) {
+      perror("sendfile");
+      return false;
     }
     if (n == 0) {
-      return;
+      // File got shorter.
+      return false;
     }
-    length -= n;
-    offset += n;
   }
+#endif
+  return true;
 }
 
-static std::vector<std::string> SplitString(const std::string &str) {
-  std::vector<std::string> result;
-  std::istringstream iss(str);
-  std::string token;
+// Send a file from the cache.  The header and contents go out in the same
+// writev as any responses to earlier pipelined requests that are still in
+// the writer.
+static bool SendCached(co::BufferedWriter &writer, std::string_view protocol,
+                       bool keep_alive, const FileCache::File &file) {
+  static constexpr std::string_view kKeepAlive = "keep-alive\r\n\r\n";
+  static constexpr std::string_view kClose = "close\r\n\r\n";
+  std::string_view connection = keep_alive ? kKeepAlive : kClose;
+  struct iovec iov[4] = {
+      {const_cast<char *>(protocol.data()), protocol.size()},
+      {const_cast<char *>(file.header.data()), file.header.size()},
+      {const_cast<char *>(connection.data()), connection.size()},
+      {const_cast<char *>(file.contents.data()), file.contents.size()},
+  };
+  return writer.WriteV(iov, 4);
+}
 
-  while (std::getline(iss, token, ' ')) {
-    result.push_back(token);
+// Read from the client until the reader holds a complete request header.
+// Before waiting for more data, any responses to earlier (pipelined)
+// requests are sent.  Returns kIncomplete if the connection is closed,
+// fails or has been idle too long.
+static co::HttpParser::Status ReadRequest(co::BufferedReader &reader,
+                                          co::BufferedWriter &writer,
+                                          co::HttpParser &parser) {
+  for (;;) {
+    // The buffer might already have the next request in it if the client
+    // is pipelining requests.
+    std::string_view data = reader.Data();
+    co::HttpParser::Status status = parser.Parse(data.data(), data.size());
+    if (status != co::HttpParser::Status::kIncomplete) {
+      return status;
+    }
+    // Wait for data to arrive.  This will yield to other coroutines and
+    // we will resume when data is available to read.  If the client
+    // doesn't send anything for a while (set by the reader's timeout) we
+    // give up on it.
+    if (!writer.Flush() || !reader.Fill()) {
+      return co::HttpParser::Status::kIncomplete;
+    }
   }
-
-  return result;
 }
 
-static void ReadHeaders(std::string &buffer, std::vector<std::string> &header,
-                        std::map<std::string, std::string> &http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer.size() && buffer[i] != '\r') {
-    i++;
+// Does the client want the connection kept open after this request?  It's
+// the default for HTTP/1.1 and has to be asked for in HTTP/1.0.
+static bool WantsKeepAlive(const co::HttpParser &request) {
+  std::string_view connection = request.Find("Connection");
+  if (co::HttpParser::Equal(connection, "close")) {
+    return false;
   }
-  if (i == buffer.size()) {
-    // No header line.
-    return;
+  if (co::HttpParser::Equal(connection, "keep-alive")) {
+    return true;
   }
-  std::string header_line(buffer.substr(0, i));
-  i += 2; // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  header = SplitString(header_line);
+  return request.Protocol() == "HTTP/1.1";
+}
 
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer.length()) {
-    if (buffer[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
-      break;
-    }
-    char *name = &buffer[i];
-    while (i < buffer.size() && buffer[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer[i] = toupper(buffer[i]);
-      i++;
-    }
-    // No header value, end of headers.
-    if (i == buffer.size()) {
-      break;
-    }
-    buffer[i] = '\0'; // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer.size() && isspace(buffer[i])) {
-      i++;
-    }
-    char *value = &buffer[i];
-    while (i < buffer.size()) {
-      if (i < buffer.size() + 3 && buffer[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer[i + 2] != ' ' && buffer[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
-      }
-      i++;
-    }
-    buffer[i] = '\0'; // Replace \r by EOL
-    i += 2;
-    http_headers[name] = value;
+// Get the length of a request's body from its Content-length, which is 0
+// if there isn't one.  Returns false if it isn't a number.
+static bool ContentLength(const co::HttpParser &request, size_t &length) {
+  length = 0;
+  std::string_view content_length = request.Find("Content-length");
+  if (content_length.empty()) {
+    return true;
   }
+  const char *end = content_length.data() + content_length.size();
+  auto [ptr, ec] = std::from_chars(content_length.data(), end, length);
+  return ec == std::errc() && ptr == end;
 }
 
-void Server(co::Coroutine *c, int fd, struct sockaddr_in sender,
-            socklen_t sender_len) {
-  std::string buffer;
-
-  // Read incoming HTTP request and parse it.
-  for (;;) {
-    char buf[64];
-
-    // Wait for data to arrive.  This will yield to other coroutines and
-    // we will resume when data is available to read.
-
-    c->Wait(fd, POLLIN);
-    ssize_t n = read(fd, buf, sizeof(buf));
-
-    if (n == -1) {
-      perror("read");
-      close(fd);
-      return;
-    }
-    if (n == 0) {
-      // EOF while reading header, nothing we can do.
-      close(fd);
-      return;
-    }
-    // Append to data buffer.
-    buffer += std::string(buf, n);
-
-    // A blank line terminates the read
-    if (buffer.find("\r\n\r\n") != std::string::npos) {
-      break;
-    }
+// Open a regular file to send.  Returns -1 if it can't be sent.  This can
+// wait for the disk, so it runs on an offload thread.
+static int OpenFile(const char *path, struct stat &st) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
   }
+#if defined(__linux__)
+  // Have the kernel start reading the file so that sendfile is less likely
+  // to wait for the disk.
+  (void)posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+  return fd;
+}
 
-  std::vector<std::string> header;
-  std::map<std::string, std::string> http_headers;
+// Most requests are for files the kernel has cached, and handing those to
+// an offload thread would cost more than opening them.  This opens the
+// file if that can be done without waiting for the disk: the path lookup
+// is done from the cache and the start of the file is in memory.  Returns
+// false if it can't tell without waiting.
+static bool OpenFileIfCached(const char *path, int &fd, struct stat &st) {
+#if defined(RESOLVE_CACHED)
+  struct open_how how = {};
+  how.flags = O_RDONLY;
+  how.resolve = RESOLVE_CACHED;
+  fd = static_cast<int>(syscall(SYS_openat2, AT_FDCWD, path, &how,
+                                sizeof(how)));
+  if (fd == -1) {
+    // EAGAIN if the lookup needs the disk, and older kernels don't have
+    // openat2 or RESOLVE_CACHED at all.
+    return errno != EAGAIN && errno != ENOSYS && errno != EINVAL;
+  }
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    fd = -1;
+    return true;
+  }
+  char byte;
+  struct iovec iov = {&byte, 1};
+  if (st.st_size == 0 || preadv2(fd, &iov, 1, 0, RWF_NOWAIT) == 1) {
+    return true;
+  }
+  close(fd);
+  return false;
+#else
+  return false;
+#endif
+}
 
-  // The buffer contains the HTTP header line and the HTTP headers.
-  ReadHeaders(buffer, header, http_headers);
+// Handle one request.  Returns false if the connection can't be used for
+// another request.  Sets keep_alive if the client wants the connection kept
+// open.  Small responses are left in the writer to be sent with any others.
+// Files are served from the cache, if there is one, and small files that
+// aren't in it are added.
+static bool HandleRequest(co::Coroutine *c, co::BufferedWriter &writer,
+                          const co::HttpParser &request, bool &keep_alive,
+                          FileCache *cache) {
+  std::string_view method = request.Method();
+  std::string_view filename = request.Target();
+  std::string_view protocol = request.Protocol();
+  int protocol_length = static_cast<int>(protocol.size());
+
+  std::string_view hostname = request.Find("Host");
+  if (hostname.empty()) {
+    hostname = "unknown";
+  }
 
-  // These are the indexes into the http_header for the fields.
-  const size_t kMethod = 0;
-  const size_t kFilename = 1;
-  const size_t kProtocol = 2;
+  keep_alive = WantsKeepAlive(request);
+  const char *connection = keep_alive ? "keep-alive" : "close";
 
-  // Make alises for the http header fields.
-  std::string &method = header[kMethod];
-  std::string &filename = header[kFilename];
-  std::string &protocol = header[kProtocol];
+  printf("%s: %.*s for %.*s from %.*s\n", c->Name().c_str(),
+         static_cast<int>(method.size()), method.data(),
+         static_cast<int>(filename.size()), filename.data(),
+         static_cast<int>(hostname.size()), hostname.data());
 
   char response[256];
 
-  std::string hostname = "unknown";
-  auto it = http_headers.find("HOST");
-  if (it != http_headers.end()) {
-    hostname = it->second;
-  }
-
-  printf("%s: %s for %s from %s\n", c->Name().c_str(), method.c_str(),
-         filename.c_str(), hostname.c_str());
-
-  // Only support the GET method for now.
-
+  // Only support the GET method for now.  Every response has a
+  // Content-length so that the client can find the end of it on a
+  // persistent connection.
   if (method == "GET") {
+    char path[PATH_MAX];
+    int file_fd = -1;
     struct stat st;
-    int e = stat(filename.c_str(), &st);
-    if (e == -1) {
-      int n = snprintf(response, sizeof(response), "%s 404 Not Found\r\n\r\n",
-                       protocol.c_str());
-      SendToClient(c, fd, response, n);
-    } else {
-      int file_fd = open(filename.c_str(), O_RDONLY);
-      if (file_fd == -1) {
-        int n = snprintf(response, sizeof(response), "%s 404 Not Found\r\n\r\n",
-                         protocol.c_str());
-        SendToClient(c, fd, response, n);
-      } else {
-        // Send the file back.
-        int n =
-            snprintf(response, sizeof(response),
-                     "%s 200 OK\r\nContent-type: text/html\r\nContent-length: "
-                     "%zd\r\n\r\n",
-                     protocol.c_str(), static_cast<size_t>(st.st_size));
-        SendToClient(c, fd, response, n);
-
-        for (;;) {
-          char buf[1024];
-          c->Wait(file_fd, POLLIN);
-          ssize_t n = read(file_fd, buf, sizeof(buf));
-          if (n == -1) {
-            perror("file read");
-            break;
-          }
-          if (n == 0) {
-            break;
-          }
-          SendToClient(c, fd, buf, n);
+    if (filename.size() < sizeof(path)) {
+      memcpy(path, filename.data(), filename.size());
+      path[filename.size()] = '\0';
+      if (cache != nullptr) {
+        if (std::shared_ptr<const FileCache::File> file =
+                cache->Find(filename)) {
+          return SendCached(writer, protocol, keep_alive, *file);
         }
-        close(file_fd);
       }
+      if (!OpenFileIfCached(path, file_fd, st)) {
+        file_fd = c->Offload([&path, &st] { return OpenFile(path, st); });
+      }
+    }
+    std::shared_ptr<const FileCache::File> file;
+    if (file_fd != -1 && cache != nullptr && cache->Fits(st.st_size)) {
+      file = c->Offload(
+          [file_fd, &st] { return FileCache::Load(file_fd, st); });
+      if (file != nullptr) {
+        cache->Insert(filename, file);
+      }
+    }
+    bool ok;
+    if (file != nullptr) {
+      ok = SendCached(writer, protocol, keep_alive, *file);
+    } else if (file_fd == -1) {
+      int n = snprintf(response, sizeof(response),
+                       "%.*s 404 Not Found\r\nContent-length: 0\r\n"
+                       "Connection: %s\r\n\r\n",
+                       protocol_length, protocol.data(), connection);
+      ok = writer.Write(response, n);
+    } else {
+      // Send the file back.  There's no point waiting for the file to be
+      // readable since it's a regular file.
+      int n = snprintf(response, sizeof(response),
+                       "%.*s 200 OK\r\nContent-type: text/html\r\n"
+                       "Content-length: %zd\r\nConnection: %s\r\n\r\n",
+                       protocol_length, protocol.data(),
+                       static_cast<size_t>(st.st_size), connection);
+      ok = writer.Flush() &&
+           SendFile(c, writer.Fd(), file_fd, st.st_size, response, n);
     }
-  } else {
-    // Invalid request method.
-    int n = snprintf(response, sizeof(response),
-                     "%s 400 Invalid request method\r\n\r\n", protocol.c_str());
-    SendToClient(c, fd, response, n);
+    if (file_fd != -1) {
+      close(file_fd);
+    }
+    return ok;
   }
+  // Invalid request method.
+  int n = snprintf(response, sizeof(response),
+                   "%.*s 400 Invalid request method\r\nContent-length: 0\r\n"
+                   "Connection: %s\r\n\r\n",
+                   protocol_length, protocol.data(), connection);
+  return writer.Write(response, n);
+}
 
+// Serve requests on a connection until the client closes it, asks for it to
+// be closed or leaves it idle for too long.  Pipelined requests are handled
+// in the order they arrive.
+void Server(co::Coroutine *c, int fd, struct sockaddr_in sender,
+            socklen_t sender_len, FileCache *cache) {
+  co::BufferedReader reader(c, fd);
+  co::BufferedWriter writer(c, fd);
+  reader.SetTimeout(g_keep_alive_timeout_ns);
+  co::HttpParser request(co::HttpParser::Kind::kRequest);
+  for (;;) {
+    co::HttpParser::Status status = ReadRequest(reader, writer, request);
+    if (status == co::HttpParser::Status::kError) {
+      writer.Write("HTTP/1.0 400 Bad request\r\nContent-length: 0\r\n"
+                   "Connection: close\r\n\r\n");
+    }
+    if (status != co::HttpParser::Status::kComplete) {
+      break;
+    }
+    // The body has to be skipped to get to the next request, so we have to
+    // know where it ends.  We don't decode chunked (or any other transfer
+    // coded) bodies.
+    if (request.Has("Transfer-Encoding")) {
+      writer.Write("HTTP/1.0 411 Length required\r\nContent-length: 0\r\n"
+                   "Connection: close\r\n\r\n");
+      break;
+    }
+    size_t body_length;
+    if (!ContentLength(request, body_length)) {
+      writer.Write("HTTP/1.0 400 Bad request\r\nContent-length: 0\r\n"
+                   "Connection: close\r\n\r\n");
+      break;
+    }
+    bool keep_alive = false;
+    bool ok = HandleRequest(c, writer, request, keep_alive, cache);
+    if (!ok || !keep_alive) {
+      break;
+    }
+    reader.Consume(request.HeaderLength());
+    request.Reset();
+    // We don't support anything that uses a request body but we need to
+    // skip it to get to the next request.
+    if (reader.Size() < body_length && !writer.Flush()) {
+      break;
+    }
+    if (!reader.Skip(body_length)) {
+      break;
+    }
+  }
+  writer.Flush();
   close(fd);
 }
 
-void Listener(co::Coroutine *c) {
-  int s = socket(PF_INET, SOCK_STREAM, 0);
-  if (s == -1) {
-    perror("socket");
-    return;
-  }
-  int val = 1;
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-  struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
-#if defined(__APPLE__)
-                             .sin_len = sizeof(int),
+#if defined(SOCK_NONBLOCK)
+static constexpr int kAcceptFlags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+#else
+static constexpr int kAcceptFlags = 0;
 #endif
-                             .sin_addr.s_addr = INADDR_ANY};
-  int e = bind(s, (struct sockaddr *)&addr, sizeof(addr));
-  if (e == -1) {
-    perror("bind");
-    close(s);
-    return;
-  }
-  listen(s, 10);
 
-  std::set<std::unique_ptr<co::Coroutine>> coroutines;
+// Accept a connection, waiting for one only if there isn't one already, so
+// a burst of connections is taken in one go without a trip through the
+// poller for each.  The connection is non-blocking so that a big sendfile
+// only sends what will fit in the socket buffer rather than blocking
+// everything.
+static int AcceptConnection(co::Coroutine *c, int s, struct sockaddr_in &sender,
+                            socklen_t &sender_len) {
+  sender_len = sizeof(sender);
+#if defined(__linux__)
+  int fd = accept4(s, (struct sockaddr *)&sender, &sender_len, kAcceptFlags);
+#else
+  int fd = accept(s, (struct sockaddr *)&sender, &sender_len);
+#endif
+  if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // This allows other coroutines to run while we are waiting.
+    sender_len = sizeof(sender);
+    fd = c->Accept(s, (struct sockaddr *)&sender, &sender_len, kAcceptFlags);
+  }
+#if !defined(SOCK_NONBLOCK)
+  if (fd != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  return fd;
+}
 
-  c->Scheduler().SetCompletionCallback([&coroutines](co::Coroutine *c) {
-    for (auto it = coroutines.begin(); it != coroutines.end(); it++) {
-      if (it->get() == c) {
-        coroutines.erase(it);
-        return;
-      }
-    }
-  });
+// Each scheduler has its own listener coroutine with its own socket for
+// the port.  The OS spreads the incoming connections across them.
+void Listener(co::Coroutine *c, int s, FileCache *cache) {
+  // A permit for each connection the scheduler may have open at once.
+  // When they are all taken the listener stops accepting until one is
+  // done, and new connections wait in the socket's backlog.
+  co::Semaphore connections(g_max_connections);
 
   // Enter a loop accepting incoming connections and spawning coroutines
   // to handle each one.  All coroutines run "in parallel", cooperating with
   // each other.  No threading here.
   for (;;) {
-    // Wait for incoming connection.  This allows other coroutines to run
-    // while we are waiting.
-    c->Wait(s, POLLIN);
-
+    connections.Acquire(c);
     struct sockaddr_in sender;
-    socklen_t sender_len = sizeof(sender);
-    int fd = accept(s, (struct sockaddr *)&sender, &sender_len);
+    socklen_t sender_len;
+    int fd = AcceptConnection(c, s, sender, sender_len);
     if (fd == -1) {
+      int e = errno;
       perror("accept");
+      connections.Release();
+      if (e == EMFILE || e == ENFILE || e == ENOBUFS || e == ENOMEM) {
+        // The connection is still waiting and will be accepted again
+        // straight away, so give the connections a chance to finish.
+        c->Millisleep(10);
+      }
       continue;
     }
 
-    // Make a coroutine to handle the connection.
-    coroutines.insert(std::make_unique<co::Coroutine>(
-        c->Scheduler(), [fd, sender, sender_len](co::Coroutine *c) {
-          Server(c, fd, sender, sender_len);
-        }));
+    // Responses are written whole (and pipelined ones together), so there
+    // is no point in Nagle holding back the last piece of one until the
+    // client acks the previous one.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Make a coroutine to handle the connection.  The scheduler deletes it
+    // when the connection is done.
+    c->Scheduler().Spawn(
+        [fd, sender, sender_len, cache, &connections](co::Coroutine *c) {
+          Server(c, fd, sender, sender_len, cache);
+          connections.Release();
+        });
   }
 }
 
 int main(int argc, const char *argv[]) {
-  co::CoroutineScheduler scheduler;
+  // One scheduler per CPU unless told otherwise with -t.
+  size_t num_threads = 0;
+  co::PollerType poller_type = co::PollerType::kDefault;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      g_keep_alive_timeout_ns =
+          strtoull(argv[++i], nullptr, 10) * 1000000000ULL;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      poller_type = co::PollerType::kIoUring;
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      g_file_cache_size = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      g_stat_ttl_ns = strtoull(argv[++i], nullptr, 10) * 1000000ULL;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      g_backlog = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      g_max_connections = std::max(strtoull(argv[++i], nullptr, 10), 1ULL);
+    } else {
+      fprintf(stderr, "usage: http_server [-t threads] "
+                      "[-k keep-alive-seconds] [-u] [-c cache-megabytes] "
+                      "[-s stat-ttl-milliseconds] [-b backlog] "
+                      "[-m max-connections-per-thread]\n");
+      exit(1);
+    }
+  }
+  co::SchedulerGroup schedulers(num_threads, poller_type);
+
+  // Each scheduler has a file cache of its own.
+  std::vector<std::unique_ptr<FileCache>> caches(schedulers.Size());
+  if (g_file_cache_size > 0) {
+    for (auto &cache : caches) {
+      cache = std::make_unique<FileCache>(g_file_cache_size, g_stat_ttl_ns);
+    }
+  }
 
-  g_scheduler = &scheduler; // For signal handler.
+  g_schedulers = &schedulers; // For signal handler.
   signal(SIGPIPE, SIG_IGN);
   signal(SIGQUIT, Signal);
 
-  co::Coroutine listener(scheduler, Listener, "listener");
+  std::vector<int> listeners = schedulers.OpenListeners(80, g_backlog);
+  if (listeners.empty()) {
+    exit(1);
+  }
 
-  // Run the main loop
-  scheduler.Run();
+  // Run a listener coroutine in each scheduler.  They all run in parallel
+  // on their own threads.  The listeners have a higher priority than the
+  // connections so that accepting isn't held up behind busy connections.
+  schedulers.Run([&listeners, &caches](co::CoroutineScheduler &scheduler,
+                                       size_t i) {
+    scheduler.Spawn([s = listeners[i], cache = caches[i].get()](
+                        co::Coroutine *c) { Listener(c, s, cache); },
+                    "listener", co::kCoDefaultStackSize, nullptr,
+                    co::Priority::kHigh);
+  });
 }
@@ -0,0 +1,798 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "poller.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__APPLE__)
+#include <sys/event.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define CO_IO_URING 1
+#endif
+#endif
+
+namespace co {
+
+// Convert a nanosecond timeout to milliseconds, rounding up so that we
+// don't wake up before the timeout has expired.
+static int TimeoutMs(int64_t timeout_ns) {
+  if (timeout_ns < 0) {
+    return -1;
+  }
+  int64_t ms = (timeout_ns + 999999) / 1000000;
+  return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+}
+
+void Poller::Add(int fd, short events, Coroutine *co) {
+  if (fd < 0) {
+    // Like ::poll, negative fds are ignored.
+    return;
+  }
+  if (static_cast<size_t>(fd) >= fds_.size()) {
+    fds_.resize(fd + 1);
+  }
+  FdInterest &interest = fds_[fd];
+  if (interest.waiters.empty()) {
+    num_fds_++;
+  }
+  interest.waiters.push_back({co, events});
+  short new_events = interest.events | events;
+  if (new_events != interest.events && !interest.always_ready) {
+    if (!Update(fd, interest.events, new_events)) {
+      interest.always_ready = true;
+      always_ready_.push_back(fd);
+    }
+  }
+  interest.events = new_events;
+  if (track_changes_) {
+    NoteChange(fd, interest);
+  }
+}
+
+void Poller::Remove(int fd, short events, Coroutine *co) {
+  if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()) {
+    return;
+  }
+  FdInterest &interest = fds_[fd];
+  short new_events = 0;
+  bool found = false;
+  for (size_t i = 0; i < interest.waiters.size();) {
+    Waiter &w = interest.waiters[i];
+    if (!found && w.co == co && w.events == events) {
+      found = true;
+      w = interest.waiters.back();
+      interest.waiters.pop_back();
+      continue;
+    }
+    new_events |= w.events;
+    i++;
+  }
+  if (found && interest.waiters.empty()) {
+    num_fds_--;
+  }
+  if (interest.always_ready) {
+    if (interest.waiters.empty()) {
+      interest.always_ready = false;
+      always_ready_.erase(
+          std::find(always_ready_.begin(), always_ready_.end(), fd));
+    }
+  } else if (new_events != interest.events) {
+    Update(fd, interest.events, new_events);
+  }
+  interest.events = new_events;
+  if (track_changes_) {
+    if (interest.waiters.empty()) {
+      interest.emptied = true;
+    }
+    NoteChange(fd, interest);
+  }
+}
+
+// Remember that the fd needs looking at by the next TakeChanges.  Only the
+// events at that time are reported, so waits that come and go in between
+// don't cost the caller anything.
+void Poller::NoteChange(int fd, FdInterest &interest) {
+  if (!interest.changed) {
+    interest.changed = true;
+    changed_fds_.push_back(fd);
+  }
+}
+
+void Poller::TakeChanges(std::vector<PollChange> &changes) {
+  if (!track_changes_) {
+    track_changes_ = true;
+    for (size_t fd = 0; fd < fds_.size(); fd++) {
+      if (fds_[fd].events != 0) {
+        NoteChange(static_cast<int>(fd), fds_[fd]);
+      }
+    }
+  }
+  for (int fd : changed_fds_) {
+    FdInterest &interest = fds_[fd];
+    interest.changed = false;
+    short events = interest.always_ready ? 0 : interest.events;
+    if (interest.emptied && interest.reported_events != 0 && events != 0) {
+      // Nothing was waiting for it for a while, so it might have been
+      // closed and the number reused.  Closing takes an fd out of an epoll
+      // set, so the caller has to be told to put it back.
+      changes.push_back({fd, interest.reported_events, 0});
+      interest.reported_events = 0;
+    }
+    interest.emptied = false;
+    if (events != interest.reported_events) {
+      changes.push_back({fd, interest.reported_events, events});
+      interest.reported_events = events;
+    }
+  }
+  changed_fds_.clear();
+}
+
+void Poller::Dispatch(int fd, short revents, std::vector<PollEvent> &events) {
+  if (static_cast<size_t>(fd) >= fds_.size()) {
+    return;
+  }
+  for (auto &w : fds_[fd].waiters) {
+    short r = revents & (w.events | POLLERR | POLLHUP | POLLNVAL);
+    if (r != 0) {
+      events.push_back({w.co, fd, r});
+    }
+  }
+}
+
+int Poller::DispatchAlwaysReady(std::vector<PollEvent> &events) {
+  for (int fd : always_ready_) {
+    Dispatch(fd, fds_[fd].events, events);
+  }
+  return static_cast<int>(always_ready_.size());
+}
+
+// Portable poller using ::poll.  The pollfd array is kept up to date as
+// interest is added and removed rather than being rebuilt for each call.
+class PollPoller : public Poller {
+ public:
+  int Poll(int64_t timeout_ns, std::vector<PollEvent> &events) override {
+    int timeout = HasAlwaysReady() ? 0 : TimeoutMs(timeout_ns);
+    int num_ready = ::poll(pollfds_.data(), pollfds_.size(), timeout);
+    if (num_ready < 0) {
+      return -1;
+    }
+    for (size_t i = 0; i < pollfds_.size() && num_ready > 0; i++) {
+      if (pollfds_[i].revents != 0) {
+        Dispatch(pollfds_[i].fd, pollfds_[i].revents, events);
+      }
+    }
+    return num_ready + DispatchAlwaysReady(events);
+  }
+
+  PollerType Type() const override { return PollerType::kPoll; }
+
+ private:
+  bool Update(int fd, short old_events, short new_events) override {
+    if (static_cast<size_t>(fd) >= slots_.size()) {
+      slots_.resize(fd + 1, -1);
+    }
+    if (old_events == 0) {
+      slots_[fd] = static_cast<int>(pollfds_.size());
+      pollfds_.push_back({.fd = fd, .events = new_events});
+    } else if (new_events == 0) {
+      // Move the last pollfd into the removed slot.
+      int slot = slots_[fd];
+      pollfds_[slot] = pollfds_.back();
+      slots_[pollfds_[slot].fd] = slot;
+      pollfds_.pop_back();
+      slots_[fd] = -1;
+    } else {
+      pollfds_[slots_[fd]].events = new_events;
+    }
+    return true;
+  }
+
+  std::vector<struct pollfd> pollfds_;
+  std::vector<int> slots_;  // Index into pollfds_ for each fd.
+};
+
+#if defined(__linux__)
+#if defined(CO_IO_URING)
+// A minimal io_uring made with the system calls directly rather than with
+// liburing.  Operations are put into the submission ring by Queue and the
+// kernel is told about all of them at once by Submit.  Completions are
+// read straight out of the completion ring, which is shared with the
+// kernel.  The ring's fd is readable when there are completions, so it can
+// sit in an epoll set.
+class IoRing {
+ public:
+  // Returns nullptr if the kernel doesn't have io_uring or can't do all
+  // the operations we need.
+  static std::unique_ptr<IoRing> Create(unsigned entries) {
+    struct io_uring_params params = {};
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd == -1) {
+      return nullptr;
+    }
+    std::unique_ptr<IoRing> ring(new IoRing(fd));
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0 ||
+        !ring->Map(params) || !ring->CanDoOps()) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  ~IoRing() {
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    close(fd_);
+  }
+
+  int Fd() const { return fd_; }
+
+  // Add the operation to the submission ring (and one for its timeout).
+  // If the ring is full, what's there is submitted to make room.
+  bool Queue(AsyncIo *io) {
+    unsigned needed = io->timeout_ns > 0 ? 2 : 1;
+    if (SpaceLeft() < needed) {
+      Submit();
+      if (SpaceLeft() < needed) {
+        return false;
+      }
+    }
+    struct io_uring_sqe *sqe = NextSqe();
+    sqe->fd = io->fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(io);
+    switch (io->op) {
+      case AsyncIo::Op::kRead:
+      case AsyncIo::Op::kWrite:
+        sqe->opcode = io->op == AsyncIo::Op::kRead ? IORING_OP_READ
+                                                   : IORING_OP_WRITE;
+        sqe->addr = reinterpret_cast<uint64_t>(io->buffer);
+        sqe->len = static_cast<uint32_t>(std::min<size_t>(io->length, INT_MAX));
+        // Use and update the file position like read and write do.
+        sqe->off = static_cast<uint64_t>(-1);
+        break;
+      case AsyncIo::Op::kAccept:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = reinterpret_cast<uint64_t>(io->buffer);
+        sqe->addr2 = reinterpret_cast<uint64_t>(io->addr_len);
+        sqe->accept_flags = static_cast<uint32_t>(io->flags);
+        break;
+      case AsyncIo::Op::kConnect:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = reinterpret_cast<uint64_t>(io->buffer);
+        sqe->off = io->length;
+        break;
+    }
+    if (io->timeout_ns > 0) {
+      // A linked timeout cancels the operation if it isn't done in time.
+      // The kernel reads the timespec when it's submitted.  Its own
+      // completion has no AsyncIo and is ignored.
+      sqe->flags |= IOSQE_IO_LINK;
+      io->timeout.tv_sec = static_cast<time_t>(io->timeout_ns / 1000000000);
+      io->timeout.tv_nsec = static_cast<long>(io->timeout_ns % 1000000000);
+      struct io_uring_sqe *timeout = NextSqe();
+      timeout->opcode = IORING_OP_LINK_TIMEOUT;
+      timeout->fd = -1;
+      timeout->addr = reinterpret_cast<uint64_t>(&io->timeout);
+      timeout->len = 1;
+    }
+    return true;
+  }
+
+  // Tell the kernel about the queued operations.  Any it doesn't take now
+  // (because it's short of resources) are left for the next time.
+  void Submit() {
+    while (num_queued_ > 0) {
+      long n = syscall(__NR_io_uring_enter, fd_, num_queued_, 0, 0, nullptr,
+                       0);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      num_queued_ -= static_cast<unsigned>(n);
+      if (n == 0) {
+        break;
+      }
+    }
+  }
+
+  bool HasCompletions() const {
+    return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+
+  // Set the results of the completed operations and add an event for
+  // each.  Returns the number of events.
+  int Complete(std::vector<PollEvent> &events) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    int num_events = 0;
+    for (; head != tail; head++) {
+      struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      AsyncIo *io = reinterpret_cast<AsyncIo *>(cqe.user_data);
+      if (io == nullptr) {
+        continue;
+      }
+      io->result = cqe.res;
+      events.push_back({io->co, io->fd, POLLIN});
+      num_events++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return num_events;
+  }
+
+ private:
+  explicit IoRing(int fd) : fd_(fd) {}
+
+  bool Map(const struct io_uring_params &params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = MapRegion(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == nullptr) {
+      return false;
+    }
+    cq_ring_ =
+        single_mmap ? sq_ring_ : MapRegion(cq_ring_size_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == nullptr) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe *>(
+        MapRegion(sqes_size_, IORING_OFF_SQES));
+    if (sqes_ == nullptr) {
+      return false;
+    }
+    char *sq = static_cast<char *>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    char *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void *MapRegion(size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  // io_uring can be there but have some operations missing (or be
+  // restricted by a seccomp filter), so ask what it can actually do.
+  bool CanDoOps() {
+    constexpr unsigned kMaxOps = 256;
+    std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                             kMaxOps * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe =
+        reinterpret_cast<struct io_uring_probe *>(buffer.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                kMaxOps) < 0) {
+      return false;
+    }
+    for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ACCEPT,
+                        IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT}) {
+      if (op > probe->last_op ||
+          (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned SpaceLeft() const {
+    return sq_entries_ -
+           (*sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+  }
+
+  // The caller has checked that there's room.
+  struct io_uring_sqe *NextSqe() {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    num_queued_++;
+    return sqe;
+  }
+
+  int fd_;
+  void *sq_ring_ = nullptr;
+  void *cq_ring_ = nullptr;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe *cqes_ = nullptr;
+  unsigned num_queued_ = 0;  // In the ring but not yet submitted.
+};
+#endif
+
+class EpollPoller : public Poller {
+ public:
+  EpollPoller() : events_(64) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+      fprintf(stderr, "Failed to create epoll fd: %s\n", strerror(errno));
+      abort();
+    }
+  }
+
+  ~EpollPoller() { close(epoll_fd_); }
+
+#if defined(CO_IO_URING)
+  // Do asynchronous I/O with an io_uring whose fd is in the epoll set.
+  // Returns false if the kernel can't.
+  bool UseIoUring() {
+    ring_ = IoRing::Create(kRingEntries);
+    if (ring_ == nullptr) {
+      return false;
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = ring_->Fd();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, ring_->Fd(), &ev) == -1) {
+      ring_.reset();
+      return false;
+    }
+    return true;
+  }
+
+  bool Submit(AsyncIo *io) override {
+    return ring_ != nullptr && ring_->Queue(io);
+  }
+
+  int FlushAsyncIo() override {
+    if (ring_ == nullptr) {
+      return -1;
+    }
+    ring_->Submit();
+    return ring_->Fd();
+  }
+
+  void CompleteAsyncIo(std::vector<PollEvent> &events) override {
+    if (ring_ != nullptr) {
+      ring_->Complete(events);
+    }
+  }
+#endif
+
+  int Poll(int64_t timeout_ns, std::vector<PollEvent> &events) override {
+    int timeout = HasAlwaysReady() ? 0 : TimeoutMs(timeout_ns);
+    int ring_fd = -1;
+#if defined(CO_IO_URING)
+    if (ring_ != nullptr) {
+      // Everything queued since the last poll goes to the kernel at once.
+      ring_fd = ring_->Fd();
+      ring_->Submit();
+      if (ring_->HasCompletions()) {
+        timeout = 0;
+      }
+    }
+#endif
+    int num_ready;
+    for (;;) {
+      num_ready = epoll_wait(epoll_fd_, events_.data(),
+                             static_cast<int>(events_.size()), timeout);
+      if (num_ready < 0) {
+        if (errno == EINTR && ring_fd != -1) {
+          // The io_uring's completion work can interrupt the wait.
+          num_ready = 0;
+          break;
+        }
+        return -1;
+      }
+      if (static_cast<size_t>(num_ready) < events_.size()) {
+        break;
+      }
+      // There might be more ready fds than we have room for.  Make more
+      // room and look again without waiting so that the caller sees all
+      // of them.
+      events_.resize(events_.size() * 2);
+      timeout = 0;
+    }
+    int num_fds = num_ready;
+    for (int i = 0; i < num_ready; i++) {
+      if (events_[i].data.fd == ring_fd) {
+        // The completions are collected below.
+        num_fds--;
+        continue;
+      }
+      // The epoll event bits have the same values as the poll ones.
+      Dispatch(events_[i].data.fd, static_cast<short>(events_[i].events),
+               events);
+    }
+#if defined(CO_IO_URING)
+    if (ring_ != nullptr) {
+      num_fds += ring_->Complete(events);
+    }
+#endif
+    return num_fds + DispatchAlwaysReady(events);
+  }
+
+  PollerType Type() const override {
+#if defined(CO_IO_URING)
+    if (ring_ != nullptr) {
+      return PollerType::kIoUring;
+    }
+#endif
+    return PollerType::kEpoll;
+  }
+
+ private:
+  bool Update(int fd, short old_events, short new_events) override {
+    struct epoll_event ev = {};
+    ev.events = static_cast<unsigned short>(new_events);
+    ev.data.fd = fd;
+    if (new_events == 0) {
+      // The fd might already have been closed, which removes it from
+      // the epoll set, so errors are ignored.
+      (void)epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &ev);
+      return true;
+    }
+    int op = old_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd_, op, fd, &ev) == 0) {
+      return true;
+    }
+    if (errno == EPERM) {
+      // Regular files can't be used with epoll.  They are always ready.
+      return false;
+    }
+    // Closed and reopened fds can be out of step with the epoll set.
+    if (errno == EEXIST) {
+      (void)epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+    } else if (errno == ENOENT) {
+      (void)epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+    return true;
+  }
+
+#if defined(CO_IO_URING)
+  static constexpr unsigned kRingEntries = 256;
+  std::unique_ptr<IoRing> ring_;
+#endif
+  int epoll_fd_;
+  std::vector<struct epoll_event> events_;
+};
+#endif
+
+#if defined(__APPLE__)
+class KqueuePoller : public Poller {
+ public:
+  KqueuePoller() : events_(64) {
+    kq_ = kqueue();
+    if (kq_ == -1) {
+      fprintf(stderr, "Failed to create kqueue: %s\n", strerror(errno));
+      abort();
+    }
+  }
+
+  ~KqueuePoller() { close(kq_); }
+
+  int Poll(int64_t timeout_ns, std::vector<PollEvent> &events) override {
+    struct timespec ts;
+    struct timespec *timeout = nullptr;
+    if (HasAlwaysReady()) {
+      timeout_ns = 0;
+    }
+    if (timeout_ns >= 0) {
+      ts.tv_sec = timeout_ns / 1000000000;
+      ts.tv_nsec = timeout_ns % 1000000000;
+      timeout = &ts;
+    }
+    int num_ready;
+    for (;;) {
+      num_ready = kevent(kq_, nullptr, 0, events_.data(),
+                         static_cast<int>(events_.size()), timeout);
+      if (num_ready < 0) {
+        return -1;
+      }
+      if (static_cast<size_t>(num_ready) < events_.size()) {
+        break;
+      }
+      // Make more room and look again without waiting.
+      events_.resize(events_.size() * 2);
+      ts.tv_sec = 0;
+      ts.tv_nsec = 0;
+      timeout = &ts;
+    }
+    for (int i = 0; i < num_ready; i++) {
+      struct kevent &e = events_[i];
+      short revents = e.filter == EVFILT_WRITE ? POLLOUT : POLLIN;
+      if ((e.flags & EV_EOF) != 0) {
+        revents |= POLLHUP;
+      }
+      if ((e.flags & EV_ERROR) != 0) {
+        revents |= POLLERR;
+      }
+      Dispatch(static_cast<int>(e.ident), revents, events);
+    }
+    return num_ready + DispatchAlwaysReady(events);
+  }
+
+  PollerType Type() const override { return PollerType::kKqueue; }
+
+ private:
+  static constexpr uint8_t kReadFilter = 1;
+  static constexpr uint8_t kWriteFilter = 2;
+
+  // A kqueue won't report a regular file at EOF as readable, but ::poll
+  // always reports them as ready, so they aren't polled.  Finding out
+  // whether an fd is a regular file takes an fstat, so the answer is kept
+  // in its FdInterest.  To know when it is out of date, filters are
+  // disabled rather than deleted when nothing is waiting, and a regular
+  // file gets a disabled read filter.  Closing the fd deletes them, so when
+  // they are next enabled (or, for a regular file, disabled again) ENOENT
+  // says that the fd might be a different file now.
+  bool Update(int fd, short old_events, short new_events) override {
+    FdInterest &interest = Interest(fd);
+    short enabled = old_events;
+    if (old_events == 0) {
+      if (interest.kq_filters != 0) {
+        if (Reenable(fd, interest, new_events)) {
+          enabled = new_events & FilterEvents(interest.kq_filters);
+        } else {
+          interest.kq_filters = 0;
+        }
+      }
+      if (interest.kq_filters == 0) {
+        struct stat st;
+        interest.regular_file = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (interest.regular_file) {
+          struct kevent change;
+          EV_SET(&change, fd, EVFILT_READ, EV_ADD | EV_DISABLE, 0, 0, nullptr);
+          if (kevent(kq_, &change, 1, nullptr, 0, nullptr) == 0) {
+            interest.kq_filters = kReadFilter;
+          }
+        }
+      }
+      if (interest.regular_file) {
+        return false;
+      }
+    }
+    struct kevent changes[2];
+    int num_changes = 0;
+    auto change = [&](short event, int16_t filter, uint8_t bit) {
+      bool want = (new_events & event) != 0;
+      if (want == ((enabled & event) != 0)) {
+        return;
+      }
+      uint16_t flags = EV_DISABLE;
+      if (want) {
+        flags = (interest.kq_filters & bit) != 0 ? EV_ENABLE : EV_ADD;
+        interest.kq_filters |= bit;
+      }
+      EV_SET(&changes[num_changes++], fd, filter, flags, 0, 0, nullptr);
+    };
+    change(POLLIN, EVFILT_READ, kReadFilter);
+    change(POLLOUT, EVFILT_WRITE, kWriteFilter);
+    if (num_changes > 0) {
+      // The fd might have been closed while it was waited for, so errors
+      // are ignored.  The next Reenable will notice.
+      (void)kevent(kq_, changes, num_changes, nullptr, 0, nullptr);
+    }
+    return true;
+  }
+
+  static short FilterEvents(uint8_t filters) {
+    return ((filters & kReadFilter) != 0 ? POLLIN : 0) |
+           ((filters & kWriteFilter) != 0 ? POLLOUT : 0);
+  }
+
+  // Enable the fd's existing filters that are wanted and disable the
+  // others.  Returns false if the filters have gone because the fd has been
+  // closed since they were added.
+  bool Reenable(int fd, const FdInterest &interest, short new_events) {
+    struct kevent changes[2];
+    int num_changes = 0;
+    if ((interest.kq_filters & kReadFilter) != 0) {
+      bool want = !interest.regular_file && (new_events & POLLIN) != 0;
+      EV_SET(&changes[num_changes++], fd, EVFILT_READ,
+             (want ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, 0, 0, nullptr);
+    }
+    if ((interest.kq_filters & kWriteFilter) != 0) {
+      bool want = (new_events & POLLOUT) != 0;
+      EV_SET(&changes[num_changes++], fd, EVFILT_WRITE,
+             (want ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, 0, 0, nullptr);
+    }
+    // With EV_RECEIPT every change comes back with EV_ERROR set and the
+    // error, if any, in data.
+    struct kevent results[2];
+    int n = kevent(kq_, changes, num_changes, results, num_changes, nullptr);
+    if (n != num_changes) {
+      return false;
+    }
+    for (int i = 0; i < n; i++) {
+      if ((results[i].flags & EV_ERROR) != 0 && results[i].data != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int kq_;
+  std::vector<struct kevent> events_;
+};
+#endif
+
+std::unique_ptr<Poller> Poller::Create(PollerType type) {
+  switch (type) {
+    case PollerType::kDefault:
+#if defined(__linux__)
+      return std::make_unique<EpollPoller>();
+#elif defined(__APPLE__)
+      return std::make_unique<KqueuePoller>();
+#else
+      break;
+#endif
+    case PollerType::kEpoll:
+#if defined(__linux__)
+      return std::make_unique<EpollPoller>();
+#else
+      break;
+#endif
+    case PollerType::kIoUring:
+#if defined(CO_IO_URING)
+    {
+      auto poller = std::make_unique<EpollPoller>();
+      if (poller->UseIoUring()) {
+        return poller;
+      }
+    }
+#endif
+      return Create(PollerType::kDefault);
+    case PollerType::kKqueue:
+#if defined(__APPLE__)
+      return std::make_unique<KqueuePoller>();
+#else
+      break;
+#endif
+    case PollerType::kPoll:
+      break;
+  }
+  return std::make_unique<PollPoller>();
+}
+
+}  // namespace co
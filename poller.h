@@ -0,0 +1,179 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef poller_h
+#define poller_h
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace co {
+
+class Coroutine;
+
+// The type of multiplexed I/O used by the scheduler.  The default is
+// the best one for the operating system: epoll on Linux and kqueue on
+// MacOS.  Plain ::poll is available everywhere.
+//
+// kIoUring is epoll with an io_uring alongside it for asynchronous I/O
+// (see AsyncIo).  If the kernel can't do what's needed with io_uring, or
+// on other operating systems, the default is used instead.
+enum class PollerType {
+  kDefault,
+  kPoll,
+  kEpoll,
+  kKqueue,
+  kIoUring,
+};
+
+// A ready event from a Poller.  There is one of these for each coroutine
+// waiting for an fd that has been triggered.  The coroutine is nullptr for
+// fds that were added without one (like the scheduler's interrupt fd).
+struct PollEvent {
+  Coroutine *co;
+  int fd;
+  short revents;
+};
+
+// A change in the events the coroutines are waiting for on an fd, for
+// callers that poll the fds themselves.  An old_events of 0 means the fd
+// is new to the set, and an events of 0 means it has left it.
+struct PollChange {
+  int fd;
+  short old_events;
+  short events;
+};
+
+// An I/O operation done asynchronously by the OS for a coroutine.  The
+// poller queues it and all the operations queued before the next Poll are
+// submitted together.  When it completes, result is set to what the system
+// call would have returned, or -errno for an error, and Poll returns an
+// event for the coroutine.  The AsyncIo must stay where it is until then.
+struct AsyncIo {
+  enum class Op : uint8_t {
+    kRead,
+    kWrite,
+    kAccept,
+    kConnect,
+  };
+
+  Op op;
+  int fd;
+  void *buffer = nullptr;  // The data, or the address for Accept and Connect.
+  size_t length = 0;       // Size of the data, or of the address for Connect.
+  socklen_t *addr_len = nullptr;  // For Accept.
+  int flags = 0;                  // For Accept.
+  uint64_t timeout_ns = 0;  // If non-zero it fails with -ECANCELED after this.
+  Coroutine *co = nullptr;
+  int result = 0;
+  struct timespec timeout = {};  // For the poller.
+};
+
+// A Poller holds a persistent set of fds that coroutines are waiting for.
+// Interest in an fd is added when a coroutine starts waiting and removed
+// when the wait ends, so the cost of a Poll call depends on the number of
+// fds that are ready rather than the number of fds in the set.
+//
+// More than one coroutine can wait for the same fd.  The events registered
+// with the OS for an fd are the union of the events each coroutine is
+// waiting for.
+class Poller {
+ public:
+  virtual ~Poller() = default;
+
+  // Make a poller of the given type.  If the type isn't supported on this
+  // operating system, a poll based one is returned.
+  static std::unique_ptr<Poller> Create(PollerType type);
+
+  // Add and remove interest in an fd by a coroutine.
+  void Add(int fd, short events, Coroutine *co);
+  void Remove(int fd, short events, Coroutine *co);
+
+  // Wait for up to timeout_ns nanoseconds (-1 means forever) for fds to
+  // become ready.  Appends an event to events for every waiter whose fd has
+  // been triggered.  Returns the number of ready fds, or -1 for error.
+  virtual int Poll(int64_t timeout_ns, std::vector<PollEvent> &events) = 0;
+
+  // Which kind of poller is this?
+  virtual PollerType Type() const = 0;
+
+  // Queue an asynchronous operation.  Returns false if the poller can't do
+  // asynchronous I/O or there is no room for it, in which case the caller
+  // should wait for the fd to be ready and do the I/O itself.
+  virtual bool Submit(AsyncIo *io) { return false; }
+
+  // For callers that do their own polling instead of calling Poll:
+  // FlushAsyncIo submits the queued operations and returns an fd that is
+  // readable when some have completed, or -1 if there are none in
+  // progress.  CompleteAsyncIo appends events for the completed ones.
+  virtual int FlushAsyncIo() { return -1; }
+  virtual void CompleteAsyncIo(std::vector<PollEvent> &events) {}
+
+  // Also for callers that do their own polling: the changes to the set
+  // since the last call are appended, one for each fd whose events are
+  // different now.  The first call starts keeping track and appends every
+  // fd in the set.  Fds that the OS can't poll (regular files) aren't
+  // included because they are always ready (see DispatchAlwaysReady).
+  void TakeChanges(std::vector<PollChange> &changes);
+
+  // Add an event for each waiter of fd that is interested in revents.
+  void Dispatch(int fd, short revents, std::vector<PollEvent> &events);
+
+  // Add events for all fds that are always ready.  Returns the number of
+  // fds.
+  int DispatchAlwaysReady(std::vector<PollEvent> &events);
+
+  bool HasAlwaysReady() const { return !always_ready_.empty(); }
+
+  // Number of fds in the set.
+  size_t NumFds() const { return num_fds_; }
+
+ protected:
+  struct Waiter {
+    Coroutine *co;
+    short events;
+  };
+
+  struct FdInterest {
+    std::vector<Waiter> waiters;
+    short events = 0;          // Union of events for all waiters.
+    bool always_ready = false;  // OS can't poll it (regular file).
+    // For the kqueue poller: the filters added for the fd, enabled or not,
+    // and whether it was a regular file when they were added.
+    uint8_t kq_filters = 0;
+    bool regular_file = false;
+    // For TakeChanges: the events the caller was last told about, whether
+    // the fd is in changed_fds_ and whether it has had no waiters since.
+    short reported_events = 0;
+    bool changed = false;
+    bool emptied = false;
+  };
+
+  // Called when the union of events for an fd changes.  Either of the
+  // event sets can be zero, meaning the fd is being added or removed.
+  // Returns false if the OS can't poll the fd, in which case it is
+  // always considered to be ready.
+  virtual bool Update(int fd, short old_events, short new_events) = 0;
+
+  // The interest in an fd that is in the set.  For use by Update.
+  FdInterest &Interest(int fd) { return fds_[fd]; }
+
+ private:
+  void NoteChange(int fd, FdInterest &interest);
+
+  std::vector<FdInterest> fds_;  // Indexed by fd.
+  std::vector<int> always_ready_;
+  size_t num_fds_ = 0;
+  bool track_changes_ = false;  // Set by the first TakeChanges.
+  std::vector<int> changed_fds_;
+};
+
+}  // namespace co
+#endif  // poller_h
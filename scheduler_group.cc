@@ -0,0 +1,134 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "scheduler_group.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace co {
+
+SchedulerGroup::SchedulerGroup(size_t num_schedulers, PollerType poller_type) {
+  if (num_schedulers == 0) {
+    num_schedulers = std::thread::hardware_concurrency();
+    if (num_schedulers == 0) {
+      num_schedulers = 1;
+    }
+  }
+  for (size_t i = 0; i < num_schedulers; i++) {
+    schedulers_.push_back(std::make_unique<CoroutineScheduler>(poller_type));
+  }
+}
+
+SchedulerGroup::~SchedulerGroup() {
+  Stop();
+  Join();
+}
+
+void SchedulerGroup::Start(SchedulerInitFunction init) {
+  for (size_t i = 0; i < schedulers_.size(); i++) {
+    threads_.emplace_back([this, i, init]() { RunScheduler(i, init); });
+  }
+}
+
+void SchedulerGroup::Join() {
+  for (auto &t : threads_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  threads_.clear();
+}
+
+void SchedulerGroup::Stop() {
+  for (auto &s : schedulers_) {
+    s->Stop();
+  }
+}
+
+void SchedulerGroup::RunScheduler(size_t index,
+                                  const SchedulerInitFunction &init) {
+#if defined(__linux__)
+  if (pin_threads_) {
+    unsigned int num_cpus = std::thread::hardware_concurrency();
+    if (num_cpus > 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(index % num_cpus, &cpus);
+      // If this fails (we might be restricted to some CPUs) the thread just
+      // runs unpinned.
+      (void)pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+  }
+#endif
+  CoroutineScheduler &scheduler = *schedulers_[index];
+  if (init != nullptr) {
+    init(scheduler, index);
+  }
+  scheduler.Run();
+}
+
+int SchedulerGroup::OpenReusePortListener(int port, int backlog) {
+  int s = socket(PF_INET, SOCK_STREAM, 0);
+  if (s == -1) {
+    return -1;
+  }
+  // Non-blocking so that a wakeup for a connection that has gone by the
+  // time it is accepted doesn't block the scheduler's thread.
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+  int val = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1) {
+    int e = errno;
+    close(s);
+    errno = e;
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+#if defined(__APPLE__)
+  addr.sin_len = sizeof(addr);
+#endif
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if (bind(s, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(s, backlog) == -1) {
+    int e = errno;
+    close(s);
+    errno = e;
+    return -1;
+  }
+  return s;
+}
+
+std::vector<int> SchedulerGroup::OpenListeners(int port, int backlog) {
+  std::vector<int> sockets;
+  for (size_t i = 0; i < schedulers_.size(); i++) {
+    int s = OpenReusePortListener(port, backlog);
+    if (s == -1) {
+      perror("listener socket");
+      for (int fd : sockets) {
+        close(fd);
+      }
+      return {};
+    }
+    sockets.push_back(s);
+  }
+  return sockets;
+}
+
+}  // namespace co
@@ -0,0 +1,99 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef scheduler_group_h
+#define scheduler_group_h
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace co {
+
+// A SchedulerGroup runs a number of CoroutineSchedulers, each on its own
+// thread.  On Linux each thread is pinned to its own CPU.  Coroutines
+// belong to the scheduler they were created in and never move to another
+// thread, so each scheduler is still single threaded and the coroutines
+// in it don't need any locking between them.  Nothing is shared between
+// the schedulers unless you share it.
+//
+// Use it like:
+//
+//   co::SchedulerGroup group;
+//   std::vector<int> listeners = group.OpenListeners(80);
+//   group.Run([&listeners](co::CoroutineScheduler &scheduler, size_t i) {
+//     scheduler.Spawn([s = listeners[i]](co::Coroutine *c) {
+//       Listener(c, s);
+//     });
+//   });
+//
+// The function passed to Run is called on each scheduler's thread before
+// the scheduler runs.  It creates the coroutines for that scheduler.
+using SchedulerInitFunction =
+    std::function<void(CoroutineScheduler &scheduler, size_t index)>;
+
+class SchedulerGroup {
+ public:
+  // Make a group of num_schedulers schedulers.  Zero means one for each
+  // CPU.
+  explicit SchedulerGroup(size_t num_schedulers = 0,
+                          PollerType poller_type = PollerType::kDefault);
+
+  // Stops the schedulers and waits for the threads to finish.
+  ~SchedulerGroup();
+
+  SchedulerGroup(const SchedulerGroup &) = delete;
+  SchedulerGroup &operator=(const SchedulerGroup &) = delete;
+
+  size_t Size() const { return schedulers_.size(); }
+  CoroutineScheduler &Scheduler(size_t index) { return *schedulers_[index]; }
+
+  // Whether to pin each scheduler's thread to a CPU.  The default is to
+  // pin them.  This has no effect if the operating system can't do it or
+  // after Start.
+  void SetPinThreads(bool pin) { pin_threads_ = pin; }
+
+  // Start a thread for each scheduler.  The init function is called on
+  // the thread and then the scheduler is run until it has no coroutines
+  // or is stopped.
+  void Start(SchedulerInitFunction init);
+
+  // Wait for all the threads to finish.
+  void Join();
+
+  // Start the threads and wait for them to finish.
+  void Run(SchedulerInitFunction init) {
+    Start(std::move(init));
+    Join();
+  }
+
+  // Stop all the schedulers.  This can be called from any thread,
+  // including from a coroutine in one of the schedulers.
+  void Stop();
+
+  // Open a TCP listening socket on the port with SO_REUSEPORT set so that
+  // many sockets can listen on the same port.  The operating system
+  // spreads incoming connections across the sockets.  The socket is
+  // non-blocking and close-on-exec.  Returns -1 with errno set on failure.
+  static int OpenReusePortListener(int port, int backlog = 128);
+
+  // Open one listening socket for the port for each scheduler.  The
+  // socket for scheduler i is at index i.  Returns an empty vector on
+  // failure, after printing why.
+  std::vector<int> OpenListeners(int port, int backlog = 128);
+
+ private:
+  void RunScheduler(size_t index, const SchedulerInitFunction &init);
+
+  std::vector<std::unique_ptr<CoroutineScheduler>> schedulers_;
+  std::vector<std::thread> threads_;
+  bool pin_threads_ = true;
+};
+
+}  // namespace co
+#endif  // scheduler_group_h
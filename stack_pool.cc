@@ -0,0 +1,202 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "stack_pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Painting and measuring go through the parts of stacks that no frame owns
+// now, which ASAN might still have poisoned for the frames that were there.
+#if defined(__GNUC__)
+#define CO_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define CO_NO_SANITIZE_ADDRESS
+#endif
+
+namespace co {
+
+// What unused stacks are painted with.  It isn't the same in every byte so
+// that painting doesn't turn into a memset that ASAN would check.
+static constexpr uint64_t kStackPaint = 0x5ac0ffee5ac0ffeeULL;
+
+StackPool::~StackPool() {
+  for (size_t sc = 0; sc < free_.size(); sc++) {
+    for (void *stack : free_[sc]) {
+      Unmap(stack, size_t(1) << sc);
+    }
+  }
+}
+
+size_t StackPool::PageSize() {
+  static size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return page_size;
+}
+
+size_t StackPool::RoundSize(size_t size) {
+  size_t rounded = PageSize();
+  while (rounded < size) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+size_t StackPool::SizeClass(size_t size) {
+  size_t sc = 0;
+  while ((size_t(1) << sc) < size) {
+    sc++;
+  }
+  return sc;
+}
+
+void *StackPool::Allocate(size_t size) {
+  size_t sc = SizeClass(size);
+  if (sc < free_.size() && !free_[sc].empty()) {
+    void *stack = free_[sc].back();
+    free_[sc].pop_back();
+    if (measure_ && release_idle_) {
+      // Releasing it wiped the paint.
+      Paint(stack, size);
+    }
+    return stack;
+  }
+
+  // Map the stack with a guard page at the bottom.
+  size_t page_size = PageSize();
+  int flags = MAP_PRIVATE | MAP_ANON;
+#if defined(MAP_STACK)
+  flags |= MAP_STACK;
+#endif
+  void *mem = mmap(nullptr, size + page_size, PROT_READ | PROT_WRITE, flags,
+                   -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Failed to allocate stack for coroutine with size %zd: %s\n",
+            size, strerror(errno));
+    abort();
+  }
+  if (mprotect(mem, page_size, PROT_NONE) == -1) {
+    fprintf(stderr, "Failed to protect stack guard page: %s\n",
+            strerror(errno));
+    abort();
+  }
+  void *stack = static_cast<char *>(mem) + page_size;
+  if (measure_) {
+    Paint(stack, size);
+  }
+  return stack;
+}
+
+void StackPool::Free(void *stack, size_t size, StackSiteStats *site) {
+  if (stack == nullptr) {
+    return;
+  }
+  size_t used = 0;
+  if (measure_) {
+    used = Usage(stack, size);
+    if (site != nullptr) {
+      site->stacks++;
+      site->max_used = std::max(site->max_used, used);
+    }
+  }
+  size_t sc = SizeClass(size);
+  if (sc >= free_.size()) {
+    free_.resize(sc + 1);
+  }
+  if (free_[sc].size() >= max_cached_) {
+    Unmap(stack, size);
+    return;
+  }
+  if (measure_ && !release_idle_) {
+    // Only the part that was used needs painting again.
+    Paint(static_cast<char *>(stack) + size - used, used);
+  }
+  if (release_idle_) {
+#if defined(__APPLE__)
+    (void)madvise(stack, size, MADV_FREE);
+#else
+    (void)madvise(stack, size, MADV_DONTNEED);
+#endif
+  }
+  free_[sc].push_back(stack);
+}
+
+size_t StackPool::NumCachedStacks() const {
+  size_t n = 0;
+  for (auto &f : free_) {
+    n += f.size();
+  }
+  return n;
+}
+
+CO_NO_SANITIZE_ADDRESS
+void StackPool::Paint(void *start, size_t size) {
+  uint64_t *p = static_cast<uint64_t *>(start);
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+    p[i] = kStackPaint;
+  }
+}
+
+// Stacks grow down, so the lowest word that isn't paint is the deepest
+// the stack has been.
+CO_NO_SANITIZE_ADDRESS
+size_t StackPool::Usage(const void *stack, size_t size) const {
+  if (!measure_) {
+    return 0;
+  }
+  const uint64_t *p = static_cast<const uint64_t *>(stack);
+  size_t words = size / sizeof(uint64_t);
+  size_t i = 0;
+  while (i < words && p[i] == kStackPaint) {
+    i++;
+  }
+  return (words - i) * sizeof(uint64_t);
+}
+
+StackSiteStats *StackPool::Site(const char *name, const void *site) {
+  if (name != nullptr) {
+    auto [it, added] = named_sites_.try_emplace(name);
+    if (added) {
+      it->second.name = name;
+    }
+    return &it->second;
+  }
+  auto [it, added] = sites_.try_emplace(site);
+  if (added) {
+    it->second.site = site;
+  }
+  return &it->second;
+}
+
+size_t StackPool::SiteStackSize(StackSiteStats *site, size_t size) {
+  site->requested_size = size;
+  if (adaptive_ && site->stacks >= kSiteSamples) {
+    size = std::min(size, RoundSize(site->max_used * 2));
+  }
+  site->allocated_size = size;
+  return size;
+}
+
+std::vector<StackSiteStats> StackPool::AllSiteStats() const {
+  std::vector<StackSiteStats> r;
+  for (auto &[name, stats] : named_sites_) {
+    r.push_back(stats);
+  }
+  for (auto &[site, stats] : sites_) {
+    r.push_back(stats);
+  }
+  return r;
+}
+
+void StackPool::Unmap(void *stack, size_t size) {
+  size_t page_size = PageSize();
+  munmap(static_cast<char *>(stack) - page_size, size + page_size);
+}
+
+}  // namespace co
@@ -0,0 +1,133 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef stack_pool_h
+#define stack_pool_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace co {
+
+// How much stack the coroutines made in one place have used.  Coroutines
+// made with a name are counted by name.  Others are counted by the site
+// that made them, which is the type of their function (so each lambda is
+// a site of its own).
+struct StackSiteStats {
+  std::string name;             // Name given to the coroutines, if any.
+  const void *site = nullptr;   // Otherwise, the code that made them.
+  uint64_t stacks = 0;          // Number of stacks measured.
+  size_t max_used = 0;          // Most used of any of them, in bytes.
+  size_t requested_size = 0;    // Size of stack last asked for.
+  size_t allocated_size = 0;    // Size of stack last given.
+};
+
+// A pool of coroutine stacks.  Each stack is mapped directly from the OS
+// with a guard page below it (stacks grow down) so that a stack overflow
+// causes a fault rather than silently corrupting other memory.
+//
+// Stack sizes are rounded up to a power of two (at least a page) and freed
+// stacks are kept on a free list for their size so that they can be reused
+// without going back to the OS.  A scheduler holds one of these for all its
+// coroutines.
+//
+// The pool can also measure how much of each stack is used, by painting
+// the stacks with a pattern and looking for the lowest address that has
+// been overwritten, and then use that to give smaller stacks to the
+// coroutines made in the same place.
+class StackPool {
+ public:
+  // Number of stacks from a site that are measured before its stacks are
+  // sized to fit.
+  static constexpr uint64_t kSiteSamples = 16;
+
+  StackPool() = default;
+  ~StackPool();
+
+  StackPool(const StackPool &) = delete;
+  StackPool &operator=(const StackPool &) = delete;
+
+  // The actual size of the stack given for a requested size.
+  static size_t RoundSize(size_t size);
+
+  // Allocate a stack of the given size, which must have been rounded by
+  // RoundSize.  Returns the lowest address of the usable stack.  Aborts
+  // if the memory can't be mapped.
+  void *Allocate(size_t size);
+
+  // Give a stack (from Allocate with the same size) back to the pool.  If
+  // usage is being measured and site isn't null, the stack's usage is
+  // recorded for the site.
+  void Free(void *stack, size_t size, StackSiteStats *site = nullptr);
+
+  // If set, stacks are painted when they are allocated so that Usage can
+  // tell how much of them has been used.  Painting makes all of each stack
+  // resident (normally only the pages that are used are), but stacks from
+  // the pool only need the part that was used repainting.  Set this before
+  // allocating any stacks.
+  void SetMeasureUsage(bool measure) { measure_ = measure; }
+  bool MeasuresUsage() const { return measure_; }
+
+  // If set (which also sets SetMeasureUsage), once kSiteSamples stacks from
+  // a site have been measured, its stacks are the smallest size that is at
+  // least twice the most any of them has used, if that is smaller than the
+  // size asked for.  They are never bigger.  A coroutine that goes deeper
+  // than all those before it from the same site could hit the guard page,
+  // so only use this when the same code always makes about the same calls.
+  void SetAdaptiveSizing(bool adaptive) {
+    adaptive_ = adaptive;
+    measure_ |= adaptive;
+  }
+
+  // The most of a stack from Allocate that has been used since it was
+  // allocated, in bytes from the top.  This is 0 unless usage is being
+  // measured.  It looks through the unused part so it isn't free.
+  size_t Usage(const void *stack, size_t size) const;
+
+  // The statistics for the coroutines with the given name, or if that is
+  // null, those made at the given site.  The result stays valid as long as
+  // the pool.
+  StackSiteStats *Site(const char *name, const void *site);
+
+  // The size of stack to give a coroutine from the site that asked
+  // for the given size (rounded by RoundSize).
+  size_t SiteStackSize(StackSiteStats *site, size_t size);
+
+  // Snapshots of the statistics for all the sites.
+  std::vector<StackSiteStats> AllSiteStats() const;
+
+  // Maximum number of free stacks kept for each size.  Stacks freed when
+  // there are already this many are unmapped.
+  void SetMaxCachedStacks(size_t n) { max_cached_ = n; }
+
+  // If set, the memory for freed stacks is given back to the OS while they
+  // are in the pool (the address space is kept).  This reduces the
+  // resident size of a program that has had a lot of coroutines at once,
+  // at the cost of page faults when the stacks are reused.
+  void SetReleaseIdleStacks(bool release) { release_idle_ = release; }
+
+  // Number of free stacks in the pool.
+  size_t NumCachedStacks() const;
+
+ private:
+  static size_t PageSize();
+  static size_t SizeClass(size_t size);
+  static void Unmap(void *stack, size_t size);
+  static void Paint(void *start, size_t size);
+
+  // Free stacks, indexed by size class (log2 of the size).
+  std::vector<std::vector<void *>> free_;
+  size_t max_cached_ = 1024;
+  bool release_idle_ = false;
+  bool measure_ = false;
+  bool adaptive_ = false;
+  std::unordered_map<std::string, StackSiteStats> named_sites_;
+  std::unordered_map<const void *, StackSiteStats> sites_;
+};
+
+}  // namespace co
+#endif  // stack_pool_h
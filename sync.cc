@@ -0,0 +1,118 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "sync.h"
+
+namespace co {
+
+// The waiter is on the waiting coroutine's stack, which GCC warns about.
+// It's taken off the list before Wait returns.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+void WaitList::Wait(Coroutine *c) {
+  Waiter waiter{c};
+  if (tail_ == nullptr) {
+    head_ = &waiter;
+  } else {
+    tail_->next = &waiter;
+  }
+  tail_ = &waiter;
+  // Only WakeOne takes the waiter off the list.  If anything else wakes
+  // the coroutine it goes back to sleep, since returning would leave the
+  // list pointing at this stack frame.
+  while (!waiter.woken) {
+    c->Suspend();
+  }
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+
+bool WaitList::WakeOne() {
+  Waiter *waiter = head_;
+  if (waiter == nullptr) {
+    return false;
+  }
+  head_ = waiter->next;
+  if (head_ == nullptr) {
+    tail_ = nullptr;
+  }
+  waiter->woken = true;
+  waiter->co->Wake();
+  return true;
+}
+
+void WaitList::WakeAll() {
+  while (WakeOne()) {
+  }
+}
+
+void Mutex::Lock(Coroutine *c) {
+  if (!locked_) {
+    locked_ = true;
+    return;
+  }
+  // Unlock hands the mutex over, so it's ours when we're woken.
+  waiters_.Wait(c);
+}
+
+bool Mutex::TryLock() {
+  if (locked_) {
+    return false;
+  }
+  locked_ = true;
+  return true;
+}
+
+void Mutex::Unlock() {
+  // If there's a waiter it now owns the mutex, which stays locked.
+  if (!waiters_.WakeOne()) {
+    locked_ = false;
+  }
+}
+
+void ConditionVariable::Wait(Coroutine *c, Mutex &mutex) {
+  mutex.Unlock();
+  waiters_.Wait(c);
+  mutex.Lock(c);
+}
+
+void Semaphore::Acquire(Coroutine *c) {
+  if (permits_ > 0 && waiters_.IsEmpty()) {
+    permits_--;
+    return;
+  }
+  // Release gives the permit to us directly.
+  waiters_.Wait(c);
+}
+
+bool Semaphore::TryAcquire() {
+  if (permits_ == 0 || !waiters_.IsEmpty()) {
+    return false;
+  }
+  permits_--;
+  return true;
+}
+
+void Semaphore::Release(size_t permits) {
+  for (; permits > 0 && waiters_.WakeOne(); permits--) {
+  }
+  permits_ += permits;
+}
+
+void WaitGroup::Done() {
+  if (count_ > 0 && --count_ == 0) {
+    waiters_.WakeAll();
+  }
+}
+
+void WaitGroup::Wait(Coroutine *c) {
+  if (count_ > 0) {
+    waiters_.Wait(c);
+  }
+}
+
+}  // namespace co
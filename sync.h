@@ -0,0 +1,139 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef sync_h
+#define sync_h
+
+#include <cstddef>
+
+#include "coroutine.h"
+
+namespace co {
+
+// Synchronization between coroutines in the same scheduler.  A coroutine
+// that has to wait is suspended on an intrusive list of waiters (the list
+// nodes are on the waiting coroutines' stacks) and is woken by putting it
+// in the scheduler's ready queue.  No fds or system calls are involved.
+//
+// These are not for synchronizing threads.  All the coroutines that use
+// one must be in the same scheduler.  Waiters are woken in the order they
+// started waiting.
+
+// A list of suspended coroutines.
+class WaitList {
+ public:
+  WaitList() = default;
+  WaitList(const WaitList &) = delete;
+  WaitList &operator=(const WaitList &) = delete;
+
+  bool IsEmpty() const { return head_ == nullptr; }
+
+  // Suspend c until it is woken by WakeOne or WakeAll.
+  void Wait(Coroutine *c);
+
+  // Wake the coroutine that has been waiting longest.  Returns false if
+  // there are none.
+  bool WakeOne();
+  void WakeAll();
+
+ private:
+  struct Waiter {
+    Coroutine *co;
+    Waiter *next = nullptr;
+    bool woken = false;
+  };
+
+  Waiter *head_ = nullptr;
+  Waiter *tail_ = nullptr;
+};
+
+// A mutex for holding something across the points where a coroutine
+// gives up control (like a Wait).  The mutex goes straight to the first
+// waiter when it's unlocked, so a coroutine that unlocks it and locks it
+// again can't take it from under the others.
+class Mutex {
+ public:
+  void Lock(Coroutine *c);
+  bool TryLock();
+  void Unlock();
+
+  bool IsLocked() const { return locked_; }
+
+ private:
+  bool locked_ = false;
+  WaitList waiters_;
+};
+
+// Locks a mutex for the lifetime of the object.
+class MutexLock {
+ public:
+  MutexLock(Mutex &mutex, Coroutine *c) : mutex_(mutex) { mutex_.Lock(c); }
+  ~MutexLock() { mutex_.Unlock(); }
+
+  MutexLock(const MutexLock &) = delete;
+  MutexLock &operator=(const MutexLock &) = delete;
+
+ private:
+  Mutex &mutex_;
+};
+
+class ConditionVariable {
+ public:
+  // Unlock mutex (which must be locked by c), wait to be notified and lock
+  // it again.
+  void Wait(Coroutine *c, Mutex &mutex);
+
+  // Wait until pred returns true.
+  template <typename Predicate>
+  void Wait(Coroutine *c, Mutex &mutex, Predicate pred) {
+    while (!pred()) {
+      Wait(c, mutex);
+    }
+  }
+
+  void NotifyOne() { waiters_.WakeOne(); }
+  void NotifyAll() { waiters_.WakeAll(); }
+
+ private:
+  WaitList waiters_;
+};
+
+// A counting semaphore.  Released permits go to waiters before anyone
+// else.
+class Semaphore {
+ public:
+  explicit Semaphore(size_t permits = 0) : permits_(permits) {}
+
+  // Take a permit, waiting until there is one.
+  void Acquire(Coroutine *c);
+  bool TryAcquire();
+  void Release(size_t permits = 1);
+
+  size_t Available() const { return permits_; }
+
+ private:
+  size_t permits_;
+  WaitList waiters_;
+};
+
+// Waits for a number of things to be done, like a group of coroutines
+// finishing.  Add the number of things before starting them, have each one
+// call Done, and Wait returns when they all have.
+class WaitGroup {
+ public:
+  void Add(size_t n = 1) { count_ += n; }
+  void Done();
+
+  // Wait until the count is zero.  Any number of coroutines can wait.
+  void Wait(Coroutine *c);
+
+  size_t Count() const { return count_; }
+
+ private:
+  size_t count_ = 0;
+  WaitList waiters_;
+};
+
+}  // namespace co
+#endif  // sync_h
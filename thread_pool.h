@@ -0,0 +1,57 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace co {
+
+// A fixed number of worker threads that run tasks in the order they are
+// submitted.  A scheduler uses one for Coroutine::Offload, which moves work
+// that would block the scheduler's thread (reading regular files, which
+// can't be polled, or long computations) off it.
+class ThreadPool {
+ public:
+  // A piece of work.  Execute is called on a worker thread and the pool
+  // doesn't touch the task after it returns.
+  class Task {
+   public:
+    virtual ~Task() = default;
+    virtual void Execute() = 0;
+  };
+
+  explicit ThreadPool(size_t num_threads);
+
+  // Runs the tasks that are still queued and waits for the threads to
+  // finish.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Queue a task to be run by the next free thread.  This can be called
+  // from any thread.
+  void Submit(Task *task);
+
+  size_t NumThreads() const { return threads_.size(); }
+
+ private:
+  void Worker();
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::deque<Task *> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace co
+#endif  // thread_pool_h
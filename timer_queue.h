@@ -0,0 +1,138 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef __TIMER_QUEUE_H
+#define __TIMER_QUEUE_H
+
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace co {
+
+class Coroutine;
+
+// Current time in nanoseconds from the monotonic clock.  All timer
+// deadlines use this clock.
+inline uint64_t MonotonicNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// A timer is held by its owner (a coroutine) and linked into a TimerQueue.
+// No memory is allocated for each timer.
+struct Timer {
+  static constexpr size_t kNotQueued = static_cast<size_t>(-1);
+
+  bool IsQueued() const { return index != kNotQueued; }
+
+  uint64_t deadline = 0;      // Monotonic time in ns, 0 if not set.
+  size_t index = kNotQueued;  // Position in the TimerQueue's heap.
+  Coroutine *co = nullptr;    // Who owns this timer.
+};
+
+// A priority queue of timers ordered by deadline.  This is a binary
+// min-heap in which each timer knows its position so that it can be
+// removed in O(log n) when a wait finishes before its timeout.
+class TimerQueue {
+ public:
+  // Add a timer with its deadline already set.
+  void Add(Timer *timer);
+
+  // Remove a timer if it is in the queue.
+  void Remove(Timer *timer);
+
+  bool IsEmpty() const { return heap_.empty(); }
+  size_t Size() const { return heap_.size(); }
+
+  // Deadline of the first timer to expire.  The queue must not be empty.
+  uint64_t NextDeadline() const { return heap_[0]->deadline; }
+
+  // Remove and return a timer whose deadline is at or before now, or
+  // nullptr if there are none.
+  Timer *PopExpired(uint64_t now);
+
+ private:
+  void Place(Timer *timer, size_t index) {
+    heap_[index] = timer;
+    timer->index = index;
+  }
+  void SiftUp(size_t index);
+  void SiftDown(size_t index);
+
+  std::vector<Timer *> heap_;
+};
+
+inline void TimerQueue::Add(Timer *timer) {
+  heap_.push_back(timer);
+  timer->index = heap_.size() - 1;
+  SiftUp(timer->index);
+}
+
+inline void TimerQueue::Remove(Timer *timer) {
+  if (!timer->IsQueued()) {
+    return;
+  }
+  size_t index = timer->index;
+  Timer *last = heap_.back();
+  heap_.pop_back();
+  timer->index = Timer::kNotQueued;
+  if (last == timer) {
+    return;
+  }
+  // Move the last timer into the hole and restore the heap.  It might need
+  // to go either way.
+  Place(last, index);
+  SiftUp(index);
+  SiftDown(last->index);
+}
+
+inline Timer *TimerQueue::PopExpired(uint64_t now) {
+  if (heap_.empty() || heap_[0]->deadline > now) {
+    return nullptr;
+  }
+  Timer *timer = heap_[0];
+  Remove(timer);
+  return timer;
+}
+
+inline void TimerQueue::SiftUp(size_t index) {
+  Timer *timer = heap_[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (heap_[parent]->deadline <= timer->deadline) {
+      break;
+    }
+    Place(heap_[parent], index);
+    index = parent;
+  }
+  Place(timer, index);
+}
+
+inline void TimerQueue::SiftDown(size_t index) {
+  Timer *timer = heap_[index];
+  size_t size = heap_.size();
+  for (;;) {
+    size_t child = index * 2 + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size && heap_[child + 1]->deadline < heap_[child]->deadline) {
+      child++;
+    }
+    if (timer->deadline <= heap_[child]->deadline) {
+      break;
+    }
+    Place(heap_[child], index);
+    index = child;
+  }
+  Place(timer, index);
+}
+
+}  // namespace co
+#endif  // __TIMER_QUEUE_H
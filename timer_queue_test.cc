@@ -0,0 +1,109 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+// Checks for TimerQueue, against a std::multiset doing the same things.
+// Prints what fails and exits with 1 if anything does.
+
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "timer_queue.h"
+
+using namespace co;
+
+static void Basic() {
+  TimerQueue queue;
+  CHECK(queue.IsEmpty());
+  CHECK(queue.PopExpired(~uint64_t(0)) == nullptr);
+
+  Timer timers[5];
+  uint64_t deadlines[5] = {50, 10, 40, 10, 30};
+  for (int i = 0; i < 5; i++) {
+    timers[i].deadline = deadlines[i];
+    queue.Add(&timers[i]);
+    CHECK(timers[i].IsQueued());
+  }
+  CHECK(queue.Size() == 5);
+  CHECK(queue.NextDeadline() == 10);
+
+  // Removing one that isn't first, and one that isn't queued.
+  queue.Remove(&timers[2]);
+  CHECK(!timers[2].IsQueued());
+  queue.Remove(&timers[2]);
+  CHECK(queue.Size() == 4);
+
+  CHECK(queue.PopExpired(9) == nullptr);
+  Timer *first = queue.PopExpired(10);
+  Timer *second = queue.PopExpired(10);
+  CHECK(first != nullptr && second != nullptr && first != second);
+  CHECK(first->deadline == 10 && second->deadline == 10);
+  CHECK(!first->IsQueued() && !second->IsQueued());
+  CHECK(queue.PopExpired(10) == nullptr);
+  CHECK(queue.NextDeadline() == 30);
+  CHECK(queue.PopExpired(100) == &timers[4]);
+  CHECK(queue.PopExpired(100) == &timers[0]);
+  CHECK(queue.IsEmpty());
+}
+
+// Random adds, removes and pops.  Timers that are due are popped in
+// deadline order.
+static void Random() {
+  constexpr int kTimers = 1000;
+  std::mt19937 rng(54321);
+  std::vector<Timer> timers(kTimers);
+  std::multiset<std::pair<uint64_t, Timer *>> reference;
+  TimerQueue queue;
+  uint64_t now = 0;
+  for (int step = 0; step < 200000; step++) {
+    Timer &timer = timers[rng() % kTimers];
+    uint32_t r = rng() % 100;
+    if (r < 45) {
+      if (!timer.IsQueued()) {
+        // Plenty of equal deadlines.
+        timer.deadline = now + rng() % 200;
+        queue.Add(&timer);
+        reference.insert({timer.deadline, &timer});
+      }
+    } else if (r < 75) {
+      if (timer.IsQueued()) {
+        reference.erase(reference.find({timer.deadline, &timer}));
+      }
+      queue.Remove(&timer);
+      CHECK(!timer.IsQueued());
+    } else {
+      now += rng() % 20;
+      uint64_t last = 0;
+      while (Timer *expired = queue.PopExpired(now)) {
+        CHECK(expired->deadline <= now);
+        CHECK(expired->deadline >= last);
+        CHECK(!expired->IsQueued());
+        last = expired->deadline;
+        auto it = reference.find({expired->deadline, expired});
+        if (it == reference.end()) {
+          CHECK(false);
+          return;
+        }
+        reference.erase(it);
+      }
+      CHECK(reference.empty() || reference.begin()->first > now);
+    }
+    CHECK(queue.Size() == reference.size());
+    if (!reference.empty()) {
+      CHECK(queue.NextDeadline() == reference.begin()->first);
+    }
+  }
+  for (Timer &timer : timers) {
+    CHECK(timer.IsQueued() ==
+          (reference.count({timer.deadline, &timer}) != 0));
+  }
+}
+
+int main() {
+  Basic();
+  Random();
+  return co::CheckResult("timer_queue_test");
+}
@@ -0,0 +1,116 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#include "watchdog.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "timer_queue.h"
+
+namespace co {
+
+Watchdog::Watchdog(uint64_t threshold_ns, StallCallback callback)
+    : threshold_ns_(threshold_ns), callback_(std::move(callback)) {
+  thread_ = std::thread([this]() { Run(); });
+}
+
+Watchdog::~Watchdog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_one();
+  thread_.join();
+}
+
+void Watchdog::Resumed(uint32_t id, const std::string *name,
+                       void *address) {
+  // running_ is 0 here.  Nothing below can be seen before that.
+  std::atomic_thread_fence(std::memory_order_release);
+  id_.store(id, std::memory_order_relaxed);
+  name_.store(name, std::memory_order_relaxed);
+  address_.store(address, std::memory_order_relaxed);
+  running_.store(++run_, std::memory_order_release);
+}
+
+// running_ and reading_name_ are each set by one thread and then the other
+// is looked at (sequentially consistent both ways), so either this sees
+// the thread reading the name and waits, or the thread sees that the run
+// is over and doesn't read it.
+void Watchdog::SwitchedOut() {
+  running_.store(0, std::memory_order_seq_cst);
+  while (reading_name_.load(std::memory_order_seq_cst)) {
+  }
+}
+
+void Watchdog::BeginNameChange() {
+  changing_name_.store(true, std::memory_order_seq_cst);
+  while (reading_name_.load(std::memory_order_seq_cst)) {
+  }
+}
+
+// Copy the name of the coroutine in a run, returning false if the run is
+// over or the name is being changed.
+bool Watchdog::CopyName(uint64_t run, const std::string *name,
+                        std::string &copy) {
+  reading_name_.store(true, std::memory_order_seq_cst);
+  bool ok = running_.load(std::memory_order_seq_cst) == run &&
+            !changing_name_.load(std::memory_order_seq_cst);
+  if (ok) {
+    copy = *name;
+  }
+  reading_name_.store(false, std::memory_order_release);
+  return ok;
+}
+
+void Watchdog::Run() {
+  // Reading the clock on every switch would cost as much as the switch, so
+  // a run is timed from when this first sees it, at most an interval after
+  // it started.  Looking eight times per threshold means a stall is
+  // reported by the time it has gone on for 1.25 times the threshold.
+  auto interval = std::chrono::nanoseconds(
+      std::max<uint64_t>(threshold_ns_ / 8, 1000000));
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    stop_cv_.wait_for(lock, interval);
+    if (stop_) {
+      break;
+    }
+    uint64_t run = running_.load(std::memory_order_acquire);
+    if (run == 0 || run == reported_) {
+      continue;
+    }
+    uint64_t now = MonotonicNow();
+    if (run != seen_run_) {
+      seen_run_ = run;
+      seen_ns_ = now;
+      continue;
+    }
+    if (now - seen_ns_ < threshold_ns_) {
+      continue;
+    }
+    StallReport report;
+    report.id = id_.load(std::memory_order_relaxed);
+    const std::string *name = name_.load(std::memory_order_relaxed);
+    report.address = address_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (running_.load(std::memory_order_relaxed) != run) {
+      continue;
+    }
+    report.running_ns = now - seen_ns_;
+    if (!CopyName(run, name, report.name)) {
+      continue;
+    }
+    if (report.name.empty()) {
+      report.name = "co-" + std::to_string(report.id);
+    }
+    reported_ = run;
+    lock.unlock();
+    callback_(report);
+    lock.lock();
+  }
+}
+
+}  // namespace co
@@ -0,0 +1,99 @@
+// Copyright 2023 David Allison
+// All Rights Reserved
+// See LICENSE file for licensing information.
+
+#ifndef watchdog_h
+#define watchdog_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace co {
+
+// What a Watchdog knows about a coroutine that has been running for too
+// long.
+struct StallReport {
+  uint32_t id;            // Coroutine id.
+  std::string name;       // Coroutine name.
+  void *address;          // Where it was resumed from (its last yield,
+                          // wait or call), nullptr if it's on its first run.
+  uint64_t running_ns;    // At least how long it had been running.
+};
+
+using StallCallback = std::function<void(const StallReport &report)>;
+
+// Scheduling is cooperative, so a coroutine that doesn't yield (a long
+// computation or a blocking system call) stops all the others in its
+// scheduler from running.  A Watchdog notices when this happens.
+//
+// The scheduler tells the watchdog when it resumes a coroutine and when the
+// coroutine switches back.  A helper thread wakes up a few times per
+// threshold and calls the callback if the same coroutine has been running
+// for longer than the threshold.  It is called once for each run that is
+// too long, while the coroutine is still running, so that coroutines that
+// never give up control are found too.
+//
+// The callback is called on the watchdog's thread, not the scheduler's.  It
+// must not touch the scheduler or its coroutines.
+//
+// Use CoroutineScheduler::SetWatchdog rather than making one of these
+// directly.
+class Watchdog {
+ public:
+  Watchdog(uint64_t threshold_ns, StallCallback callback);
+  ~Watchdog();
+
+  Watchdog(const Watchdog &) = delete;
+  Watchdog &operator=(const Watchdog &) = delete;
+
+  // Called in the scheduler's thread on every switch, so they don't lock
+  // or copy anything.  The name is the coroutine's own, which is only read
+  // to report a stall (an empty one is reported as "co-<id>").  It must
+  // stay where it is until SwitchedOut, and any change to it must be
+  // between BeginNameChange and EndNameChange.
+  void Resumed(uint32_t id, const std::string *name, void *address);
+  void SwitchedOut();
+  void BeginNameChange();
+  void EndNameChange() {
+    changing_name_.store(false, std::memory_order_release);
+  }
+
+ private:
+  void Run();
+  bool CopyName(uint64_t run, const std::string *name, std::string &copy);
+
+  uint64_t threshold_ns_;
+  StallCallback callback_;
+
+  // The current run, published by the scheduler's thread like a seqlock.
+  // Each run has a different number, which is in running_ while the
+  // coroutine is running and 0 otherwise.  The fields are only valid if
+  // running_ is the same before and after reading them.
+  uint64_t run_ = 0;  // Only used by the scheduler's thread.
+  std::atomic<uint32_t> id_{0};
+  std::atomic<const std::string *> name_{nullptr};
+  std::atomic<void *> address_{nullptr};
+  std::atomic<uint64_t> running_{0};
+  // While the thread copies the name, the scheduler's thread waits
+  // before switching out (the coroutine might be deleted) or changing it.
+  std::atomic<bool> reading_name_{false};
+  std::atomic<bool> changing_name_{false};
+
+  std::mutex mutex_;  // For stop_.
+  // Only used by the thread: the run it last saw and when it first saw
+  // it, and the last run reported.
+  uint64_t seen_run_ = 0;
+  uint64_t seen_ns_ = 0;
+  uint64_t reported_ = 0;
+  bool stop_ = false;
+  std::condition_variable stop_cv_;
+  std::thread thread_;
+};
+
+}  // namespace co
+#endif  // watchdog_h